@@ -0,0 +1,22 @@
+# - Try to find OSMesa (off-screen Mesa)
+#
+# Once done this will define
+#
+#  OSMESA_FOUND - system has OSMesa
+#  OSMESA_INCLUDE_DIRS - the OSMesa include directories
+#  OSMESA_LIBRARIES - the libraries needed to use OSMesa
+
+find_path(OSMESA_INCLUDE_DIR GL/osmesa.h
+	HINTS $ENV{OSMESA_DIR}/include)
+find_library(OSMESA_LIBRARY NAMES OSMesa OSMesa32 osmesa
+	HINTS $ENV{OSMESA_DIR}/lib)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(OSMesa DEFAULT_MSG OSMESA_LIBRARY OSMESA_INCLUDE_DIR)
+
+if(OSMESA_FOUND)
+	set(OSMESA_INCLUDE_DIRS ${OSMESA_INCLUDE_DIR})
+	set(OSMESA_LIBRARIES ${OSMESA_LIBRARY})
+endif()
+
+mark_as_advanced(OSMESA_INCLUDE_DIR OSMESA_LIBRARY)
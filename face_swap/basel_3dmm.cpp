@@ -1,6 +1,7 @@
 #include "face_swap/basel_3dmm.h"
 #include "face_swap/utilities.h"
 #include <fstream>
+#include <opencv2/core/utility.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>  // debug
 
@@ -93,45 +94,198 @@ namespace face_swap
         */
     }
 
-    Mesh Basel3DMM::sample(const cv::Mat & shape_coefficients, 
-        const cv::Mat & tex_coefficients)
+    /** Evaluate a PCA model: out = PC * (coefficients .* EV) + MU.
+    If accumulate is true the result is added to the values already in out.
+    */
+    template<typename T>
+    static void samplePCA(const cv::Mat& PC, const cv::Mat& MU, const cv::Mat& EV,
+        const cv::Mat& coefficients, T* out, bool accumulate = false)
     {
-        Mesh mesh;
-        mesh.faces = faces;
-
-        cv::Mat s = shape_coefficients.mul(shapeEV);
-        cv::Mat t = tex_coefficients.mul(texEV);
+        CV_Assert(coefficients.total() == (size_t)PC.cols && EV.total() == (size_t)PC.cols);
+        CV_Assert(MU.total() == (size_t)PC.rows);
 
-        mesh.vertices = shapePC * s + shapeMU;
-        mesh.colors = texPC * t + texMU;
+        // Scale the coefficients by the eigenvalues
+        const int cols = PC.cols;
+        cv::AutoBuffer<float> scaled(cols);
+        const float* coeff_data = (const float*)coefficients.data;
+        const float* ev_data = (const float*)EV.data;
+        for (int j = 0; j < cols; ++j)
+            scaled[j] = coeff_data[j] * ev_data[j];
 
-        int total_vertices = mesh.vertices.rows / 3;
-        mesh.vertices = mesh.vertices.reshape(0, total_vertices);
-        mesh.colors = mesh.colors.reshape(0, total_vertices);
-        mesh.colors.convertTo(mesh.colors, CV_8U);
+        // For each row of the model
+        const float* mu_data = (const float*)MU.data;
+        const float* scaled_data = scaled;
+        cv::parallel_for_(cv::Range(0, PC.rows), [&](const cv::Range& range)
+        {
+            for (int i = range.start; i < range.end; ++i)
+            {
+                const float* pc_data = PC.ptr<float>(i);
+                float sum = mu_data[i];
+                for (int j = 0; j < cols; ++j)
+                    sum += pc_data[j] * scaled_data[j];
+                out[i] = accumulate ? cv::saturate_cast<T>(out[i] + sum) :
+                    cv::saturate_cast<T>(sum);
+            }
+        });
+    }
 
+    Mesh Basel3DMM::sample(const cv::Mat & shape_coefficients, 
+        const cv::Mat & tex_coefficients) const
+    {
+        Mesh mesh;
+        sample(shape_coefficients, tex_coefficients, cv::Mat(), mesh,
+            SAMPLE_SHAPE | SAMPLE_COLORS);
         return mesh;
     }
 
     Mesh Basel3DMM::sample(const cv::Mat& shape_coefficients,
-        const cv::Mat& tex_coefficients, const cv::Mat& expr_coefficients)
+        const cv::Mat& tex_coefficients, const cv::Mat& expr_coefficients) const
     {
         Mesh mesh;
+        sample(shape_coefficients, tex_coefficients, expr_coefficients, mesh);
+        return mesh;
+    }
+
+    void Basel3DMM::sample(const cv::Mat& shape_coefficients,
+        const cv::Mat& tex_coefficients, const cv::Mat& expr_coefficients,
+        Mesh& mesh, int flags) const
+    {
+        int total_vertices = shapeMU.rows / 3;
         mesh.faces = faces;
 
-        cv::Mat s = shape_coefficients.mul(shapeEV);
-        cv::Mat t = tex_coefficients.mul(texEV);
-        cv::Mat e = expr_coefficients.mul(exprEV);
+        // Vertices
+        if (flags & (SAMPLE_SHAPE | SAMPLE_EXPR))
+        {
+            mesh.vertices.create(total_vertices, 3, CV_32F);
+            float* vert_data = (float*)mesh.vertices.data;
+            if (flags & SAMPLE_SHAPE)
+                samplePCA(shapePC, shapeMU, shapeEV, shape_coefficients, vert_data);
+            else mesh.vertices.setTo(0.0f);
+            if (flags & SAMPLE_EXPR)
+                samplePCA(exprPC, exprMU, exprEV, expr_coefficients, vert_data, true);
+        }
 
-        mesh.vertices = shapePC * s + shapeMU + exprPC * e + exprMU;
-        mesh.colors = texPC * t + texMU;
+        // Colors
+        if (flags & SAMPLE_COLORS)
+        {
+            mesh.colors.create(total_vertices, 3, CV_8U);
+            samplePCA(texPC, texMU, texEV, tex_coefficients, mesh.colors.data);
+        }
+    }
 
-        int total_vertices = mesh.vertices.rows / 3;
-        mesh.vertices = mesh.vertices.reshape(0, total_vertices);
-        mesh.colors = mesh.colors.reshape(0, total_vertices);
-        mesh.colors.convertTo(mesh.colors, CV_8U);
+    void Basel3DMM::sampleExpression(const cv::Mat& identity,
+        const cv::Mat& expr_coefficients, Mesh& mesh) const
+    {
+        CV_Assert(identity.rows == shapeMU.rows / 3 && identity.type() == CV_32F);
+        mesh.faces = faces;
+        identity.copyTo(mesh.vertices);
+        samplePCA(exprPC, exprMU, exprEV, expr_coefficients,
+            (float*)mesh.vertices.data, true);
+    }
 
-        return mesh;
+    /** Copy the rows of a per-vertex model matrix [3N x K] that belong to the
+    specified vertices.
+    */
+    static cv::Mat selectVertexRows(const cv::Mat& m, const std::vector<int>& indices)
+    {
+        cv::Mat out((int)indices.size() * 3, m.cols, m.type());
+        size_t row_size = m.cols * m.elemSize();
+        for (size_t i = 0; i < indices.size(); ++i)
+            memcpy(out.ptr(3 * (int)i), m.ptr(3 * indices[i]), 3 * row_size);
+        return out;
+    }
+
+    /** Create a compacted model from a subset of the model's faces.
+    Only the vertices referenced by the faces are kept.
+    @param model The model to compact.
+    @param faces Triangles indexing the vertices of model [F' x 3, CV_16U].
+    */
+    static Basel3DMM compactModel(const Basel3DMM& model, const cv::Mat& faces)
+    {
+        int total_vertices = model.shapeMU.rows / 3;
+
+        // Find the referenced vertices and assign them compacted indices
+        std::vector<int> new_indices(total_vertices, -1);
+        const unsigned short* faces_data = (const unsigned short*)faces.data;
+        for (size_t i = 0; i < faces.total(); ++i)
+            new_indices[faces_data[i]] = 0;
+        std::vector<int> indices;
+        for (int i = 0; i < total_vertices; ++i)
+        {
+            if (new_indices[i] < 0) continue;
+            new_indices[i] = (int)indices.size();
+            indices.push_back(i);
+        }
+
+        Basel3DMM sub;
+        sub.faces.create(faces.rows, 3, CV_16U);
+        unsigned short* sub_faces_data = (unsigned short*)sub.faces.data;
+        for (size_t i = 0; i < faces.total(); ++i)
+            *sub_faces_data++ = (unsigned short)new_indices[faces_data[i]];
+
+        // Map the vertices to the full model
+        sub.vertex_indices.create((int)indices.size(), 1, CV_32S);
+        int* vertex_indices_data = (int*)sub.vertex_indices.data;
+        for (size_t i = 0; i < indices.size(); ++i)
+            *vertex_indices_data++ = model.vertex_indices.empty() ?
+                indices[i] : model.vertex_indices.at<int>(indices[i]);
+
+        // Copy the model rows of the remaining vertices
+        sub.shapeMU = selectVertexRows(model.shapeMU, indices);
+        sub.shapePC = selectVertexRows(model.shapePC, indices);
+        sub.texMU = selectVertexRows(model.texMU, indices);
+        sub.texPC = selectVertexRows(model.texPC, indices);
+        sub.exprMU = selectVertexRows(model.exprMU, indices);
+        sub.exprPC = selectVertexRows(model.exprPC, indices);
+        sub.shapeEV = model.shapeEV;
+        sub.texEV = model.texEV;
+        sub.exprEV = model.exprEV;
+        sub.adjacency = MeshAdjacency::create(sub.faces, (int)indices.size());
+
+        // Keep the atlas coordinates of the remaining vertices
+        if (!model.atlas_uv.empty())
+        {
+            sub.atlas_uv.create((int)indices.size(), 2, CV_32F);
+            for (size_t i = 0; i < indices.size(); ++i)
+                model.atlas_uv.row(indices[i]).copyTo(sub.atlas_uv.row((int)i));
+        }
+
+        return sub;
+    }
+
+    Basel3DMM Basel3DMM::submodel(const cv::Mat& vertex_mask) const
+    {
+        int total_vertices = shapeMU.rows / 3;
+        CV_Assert(vertex_mask.total() == (size_t)total_vertices && vertex_mask.isContinuous());
+        cv::Mat mask = vertex_mask.reshape(1, 1) != 0;
+
+        // Find the faces with all their vertices in the mask
+        cv::Mat sub_faces;
+        const unsigned char* mask_data = mask.data;
+        for (int i = 0; i < faces.rows; ++i)
+        {
+            const unsigned short* f = faces.ptr<unsigned short>(i);
+            if (mask_data[f[0]] && mask_data[f[1]] && mask_data[f[2]])
+                sub_faces.push_back(faces.row(i));
+        }
+
+        Basel3DMM sub = compactModel(*this, sub_faces);
+
+        // Spread the atlas over the remaining vertices
+        cv::Mat mean_vertices = (sub.shapeMU + sub.exprMU).reshape(1, sub.shapeMU.rows / 3);
+        generateCylindricalUV(mean_vertices, sub.atlas_uv);
+
+        return sub;
+    }
+
+    Basel3DMM Basel3DMM::decimate(float ratio) const
+    {
+        // Simplify the mean face
+        cv::Mat mean_vertices = (shapeMU + exprMU).reshape(1, shapeMU.rows / 3);
+        cv::Mat lod_faces;
+        decimateMesh(mean_vertices, faces, (int)std::round(faces.rows * ratio), lod_faces);
+
+        return compactModel(*this, lod_faces);
     }
 
     Basel3DMM Basel3DMM::load(const std::string & model_file)
@@ -164,6 +318,13 @@ namespace face_swap
             unsigned short* out_faces_data = (unsigned short*)basel_3dmm.faces.data;
             for (int i = 0; i < faces_size; ++i)
                 *out_faces_data++ = (unsigned short)(*faces_data++);
+            basel_3dmm.adjacency = MeshAdjacency::create(basel_3dmm.faces,
+                basel_3dmm.shapeMU.rows / 3);
+
+            // Texture atlas coordinates of the mean face
+            cv::Mat mean_vertices = (basel_3dmm.shapeMU + basel_3dmm.exprMU).reshape(1,
+                basel_3dmm.shapeMU.rows / 3);
+            generateCylindricalUV(mean_vertices, basel_3dmm.atlas_uv);
         }
         catch (H5::DataSetIException error)
         {
@@ -0,0 +1,453 @@
+#include "face_swap/blending_utilities.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// OpenCV
+#include <opencv2/core/hal/intrin.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace face_swap
+{
+	// The pyramid is coarsened until the smaller side is at most this size
+	const int POISSON_MIN_LEVEL_SIZE = 16;
+
+	// Relaxation iterations on the finest level, doubled for each coarser level
+	const int POISSON_FINE_ITERATIONS = 8;
+
+	// Maximum relaxation iterations of a single level
+	const int POISSON_MAX_ITERATIONS = 256;
+
+	// Over-relaxation factor
+	const float POISSON_SOR_OMEGA = 1.7f;
+
+	// Maximum relaxation iterations when starting from an initial guess
+	const int POISSON_WARM_MAX_ITERATIONS = 48;
+
+	// Relaxation from an initial guess stops when no pixel changes by more than this
+	const float POISSON_WARM_TOLERANCE = 0.1f;
+
+	// An initial guess is discarded if its first relaxation changes a pixel by more than this
+	const float POISSON_WARM_MAX_FIRST_DELTA = 4.0f;
+
+	/** A level of the multigrid pyramid.
+	*/
+	struct PoissonLevel
+	{
+		cv::Mat unknown;	///< Non-zero for the pixels to solve [CV_8U].
+		cv::Mat values;		///< Boundary values and the solution [CV_32F].
+	};
+
+	/** Calculate the unknowns of the next coarser level.
+	A coarse pixel is unknown only if all of its fine pixels are unknown, so the
+	boundary of the domain is kept on all the levels.
+	*/
+	static void coarsenUnknown(const cv::Mat& fine, cv::Mat& coarse)
+	{
+		coarse.create((fine.rows + 1) / 2, (fine.cols + 1) / 2, CV_8U);
+		for (int r = 0; r < coarse.rows; ++r)
+		{
+			const unsigned char* fine_row0 = fine.ptr<unsigned char>(2 * r);
+			const unsigned char* fine_row1 = fine.ptr<unsigned char>(std::min(2 * r + 1, fine.rows - 1));
+			unsigned char* coarse_row = coarse.ptr<unsigned char>(r);
+			for (int c = 0; c < coarse.cols; ++c)
+			{
+				const int c1 = std::min(2 * c + 1, fine.cols - 1);
+				coarse_row[c] = fine_row0[2 * c] && fine_row0[c1] && fine_row1[2 * c] && fine_row1[c1];
+			}
+		}
+	}
+
+	/** Calculate the boundary values of the next coarser level by averaging
+	the boundary values of the known fine pixels.
+	*/
+	static void coarsenValues(const PoissonLevel& fine, PoissonLevel& coarse)
+	{
+		coarse.values.create(coarse.unknown.size(), CV_32F);
+		for (int r = 0; r < coarse.values.rows; ++r)
+		{
+			const unsigned char* coarse_unknown = coarse.unknown.ptr<unsigned char>(r);
+			float* coarse_values = coarse.values.ptr<float>(r);
+			for (int c = 0; c < coarse.values.cols; ++c)
+			{
+				float sum = 0.0f;
+				int count = 0;
+				for (int fr = 2 * r; fr < std::min(2 * r + 2, fine.values.rows); ++fr)
+				{
+					const unsigned char* fine_unknown = fine.unknown.ptr<unsigned char>(fr);
+					const float* fine_values = fine.values.ptr<float>(fr);
+					for (int fc = 2 * c; fc < std::min(2 * c + 2, fine.values.cols); ++fc)
+					{
+						if (fine_unknown[fc]) continue;
+						sum += fine_values[fc];
+						++count;
+					}
+				}
+				coarse_values[c] = (coarse_unknown[c] || count == 0) ? 0.0f : sum / count;
+			}
+		}
+	}
+
+	/** Red-black successive over-relaxation of the Laplace equation on the unknown pixels.
+	The unknown pixels are never on the border of the level.
+	@return The maximum absolute change of a pixel in the last iteration.
+	*/
+	static float relax(PoissonLevel& level, int iterations)
+	{
+		cv::Mat& values = level.values;
+		float max_delta = 0.0f;
+		for (int i = 0; i < iterations; ++i)
+		{
+			max_delta = 0.0f;
+			for (int color = 0; color < 2; ++color)
+			{
+				for (int r = 1; r < values.rows - 1; ++r)
+				{
+					const unsigned char* unknown = level.unknown.ptr<unsigned char>(r);
+					const float* up = values.ptr<float>(r - 1);
+					const float* down = values.ptr<float>(r + 1);
+					float* v = values.ptr<float>(r);
+					for (int c = 1 + ((r + color) & 1); c < values.cols - 1; c += 2)
+					{
+						if (!unknown[c]) continue;
+						const float delta = POISSON_SOR_OMEGA *
+							(0.25f * (up[c] + down[c] + v[c - 1] + v[c + 1]) - v[c]);
+						v[c] += delta;
+						max_delta = std::max(max_delta, std::abs(delta));
+					}
+				}
+			}
+		}
+
+		return max_delta;
+	}
+
+	/** Solve the Laplace equation on the unknown pixels of the finest level, with
+	the known pixels as Dirichlet boundary conditions. The coarsest level is solved
+	first and each solution is the initial guess for the next finer level.
+	*/
+	static void solveLaplace(std::vector<PoissonLevel>& levels)
+	{
+		for (size_t l = 1; l < levels.size(); ++l)
+			coarsenValues(levels[l - 1], levels[l]);
+
+		const int coarsest = (int)levels.size() - 1;
+		for (int l = coarsest; l >= 0; --l)
+		{
+			PoissonLevel& level = levels[l];
+
+			// Initialize the unknowns from the coarser level
+			if (l < coarsest)
+			{
+				const cv::Mat& coarse_values = levels[l + 1].values;
+				for (int r = 0; r < level.values.rows; ++r)
+				{
+					const unsigned char* unknown = level.unknown.ptr<unsigned char>(r);
+					const float* coarse = coarse_values.ptr<float>(r / 2);
+					float* v = level.values.ptr<float>(r);
+					for (int c = 0; c < level.values.cols; ++c)
+						if (unknown[c]) v[c] = coarse[c / 2];
+				}
+			}
+
+			// The coarsest level is relaxed until the boundary values propagate across it
+			const int iterations = l == coarsest ?
+				2 * std::max(level.values.rows, level.values.cols) :
+				std::min(POISSON_FINE_ITERATIONS << l, POISSON_MAX_ITERATIONS);
+			relax(level, iterations);
+		}
+	}
+
+	void poissonBlend(const cv::Mat& src, const cv::Mat& dst, const cv::Mat& mask, cv::Mat& out,
+		const cv::Rect& mask_bbox, const cv::Mat& guess)
+	{
+		CV_Assert(src.type() == CV_8UC3 && dst.type() == CV_8UC3 && src.size() == dst.size());
+		CV_Assert(mask.type() == CV_8U && mask.size() == src.size());
+		CV_Assert(guess.empty() || (guess.type() == CV_8UC3 && guess.size() == src.size()));
+		dst.copyTo(out);
+
+		// The domain is the mask's bounding box with a one pixel boundary
+		cv::Rect bbox = mask_bbox.area() > 0 ? mask_bbox : cv::boundingRect(mask);
+		if (bbox.area() == 0) return;
+		cv::Rect roi(bbox.x - 1, bbox.y - 1, bbox.width + 2, bbox.height + 2);
+		roi &= cv::Rect(0, 0, src.cols, src.rows);
+
+		// Build the unknowns pyramid, the image border is always part of the boundary
+		std::vector<PoissonLevel> levels(1);
+		levels[0].unknown = mask(roi) != 0;
+		for (int r = 0; r < roi.height; ++r)
+		{
+			unsigned char* unknown = levels[0].unknown.ptr<unsigned char>(r);
+			const int y = roi.y + r;
+			if (y == 0 || y == src.rows - 1)
+			{
+				std::fill(unknown, unknown + roi.width, 0);
+				continue;
+			}
+			if (roi.x == 0) unknown[0] = 0;
+			if (roi.x + roi.width == src.cols) unknown[roi.width - 1] = 0;
+		}
+		const bool warm_start = !guess.empty();
+		while (std::min(levels.back().unknown.rows, levels.back().unknown.cols) > POISSON_MIN_LEVEL_SIZE)
+		{
+			levels.emplace_back();
+			coarsenUnknown(levels[levels.size() - 2].unknown, levels.back().unknown);
+		}
+
+		// Solve for the difference between the output and the source, which is
+		// harmonic inside the mask and equals dst - src on the boundary
+		const cv::Mat src_roi = src(roi), dst_roi = dst(roi);
+		const cv::Mat guess_roi = warm_start ? guess(roi) : cv::Mat();
+		cv::Mat out_roi = out(roi);
+		cv::parallel_for_(cv::Range(0, 3), [&](const cv::Range& range)
+		{
+			for (int ch = range.start; ch < range.end; ++ch)
+			{
+				std::vector<PoissonLevel> channel_levels(levels.size());
+				for (size_t l = 0; l < levels.size(); ++l)
+					channel_levels[l].unknown = levels[l].unknown;
+
+				// Boundary values and the initial guess
+				cv::Mat& values = channel_levels[0].values;
+				values.create(roi.size(), CV_32F);
+				for (int r = 0; r < roi.height; ++r)
+				{
+					const unsigned char* unknown = levels[0].unknown.ptr<unsigned char>(r);
+					const cv::Vec3b* src_data = src_roi.ptr<cv::Vec3b>(r);
+					const cv::Vec3b* dst_data = dst_roi.ptr<cv::Vec3b>(r);
+					const cv::Vec3b* guess_data = warm_start ? guess_roi.ptr<cv::Vec3b>(r) : nullptr;
+					float* v = values.ptr<float>(r);
+					for (int c = 0; c < roi.width; ++c)
+					{
+						if (!unknown[c]) v[c] = (float)dst_data[c][ch] - (float)src_data[c][ch];
+						else v[c] = warm_start ? (float)guess_data[c][ch] - (float)src_data[c][ch] : 0.0f;
+					}
+				}
+
+				// Starting from a guess, only the finest level is relaxed until it converges.
+				// A guess that is far from the solution would take too many iterations on the
+				// finest level, so it is replaced by the multigrid solve from zero
+				bool solved = false;
+				if (warm_start && relax(channel_levels[0], 1) <= POISSON_WARM_MAX_FIRST_DELTA)
+				{
+					for (int i = 1; i < POISSON_WARM_MAX_ITERATIONS; ++i)
+						if (relax(channel_levels[0], 1) < POISSON_WARM_TOLERANCE) break;
+					solved = true;
+				}
+				if (!solved) solveLaplace(channel_levels);
+
+				// Add the source to the solution
+				for (int r = 0; r < roi.height; ++r)
+				{
+					const unsigned char* unknown = levels[0].unknown.ptr<unsigned char>(r);
+					const cv::Vec3b* src_data = src_roi.ptr<cv::Vec3b>(r);
+					const float* v = values.ptr<float>(r);
+					cv::Vec3b* out_data = out_roi.ptr<cv::Vec3b>(r);
+					for (int c = 0; c < roi.width; ++c)
+						if (unknown[c]) out_data[c][ch] = cv::saturate_cast<uchar>(src_data[c][ch] + v[c]);
+				}
+			}
+		});
+	}
+
+	/** Blend a pyramid level: b + (a - b) * m.
+	*/
+	static cv::Mat blendLevel(const cv::Mat& a, const cv::Mat& b, const cv::Mat& m)
+	{
+		cv::Mat m3;
+		cv::merge(std::vector<cv::Mat>(3, m), m3);
+		return b + (a - b).mul(m3);
+	}
+
+	void multibandBlend(const cv::Mat& src, const cv::Mat& dst, const cv::Mat& mask,
+		cv::Mat& out, int levels, const cv::Rect& mask_bbox)
+	{
+		CV_Assert(src.type() == CV_8UC3 && dst.type() == CV_8UC3 && src.size() == dst.size());
+		CV_Assert(mask.type() == CV_8U && mask.size() == src.size() && levels >= 0);
+		dst.copyTo(out);
+
+		// Pad the mask's bounding box by the support of the coarsest level
+		cv::Rect bbox = mask_bbox.area() > 0 ? mask_bbox : cv::boundingRect(mask);
+		if (bbox.area() == 0) return;
+		const int margin = 1 << levels;
+		cv::Rect roi(bbox.x - margin, bbox.y - margin, bbox.width + 2 * margin, bbox.height + 2 * margin);
+		roi &= cv::Rect(0, 0, src.cols, src.rows);
+		while (levels > 0 && std::min(roi.width, roi.height) >> levels < 2) --levels;
+
+		// Gaussian pyramids
+		std::vector<cv::Mat> src_pyr(levels + 1), dst_pyr(levels + 1), mask_pyr(levels + 1);
+		src(roi).convertTo(src_pyr[0], CV_32F);
+		dst(roi).convertTo(dst_pyr[0], CV_32F);
+		mask(roi).convertTo(mask_pyr[0], CV_32F, 1.0 / 255.0);
+		for (int l = 1; l <= levels; ++l)
+		{
+			cv::pyrDown(src_pyr[l - 1], src_pyr[l]);
+			cv::pyrDown(dst_pyr[l - 1], dst_pyr[l]);
+			cv::pyrDown(mask_pyr[l - 1], mask_pyr[l]);
+		}
+
+		// Blend the Laplacian levels while collapsing the pyramid
+		cv::Mat result = blendLevel(src_pyr[levels], dst_pyr[levels], mask_pyr[levels]);
+		cv::Mat src_up, dst_up, result_up;
+		for (int l = levels - 1; l >= 0; --l)
+		{
+			const cv::Size size = src_pyr[l].size();
+			cv::pyrUp(src_pyr[l + 1], src_up, size);
+			cv::pyrUp(dst_pyr[l + 1], dst_up, size);
+			cv::pyrUp(result, result_up, size);
+			result = result_up + blendLevel(src_pyr[l] - src_up, dst_pyr[l] - dst_up, mask_pyr[l]);
+		}
+
+		cv::Mat out_roi = out(roi);
+		result.convertTo(out_roi, CV_8U);
+	}
+
+	void featherBlend(const cv::Mat& src, const cv::Mat& dst, const cv::Mat& mask,
+		cv::Mat& out, float radius, const cv::Rect& mask_bbox)
+	{
+		CV_Assert(src.type() == CV_8UC3 && dst.type() == CV_8UC3 && src.size() == dst.size());
+		CV_Assert(mask.type() == CV_8U && mask.size() == src.size());
+		dst.copyTo(out);
+
+		cv::Rect bbox = mask_bbox.area() > 0 ? mask_bbox : cv::boundingRect(mask);
+		if (bbox.area() == 0) return;
+		if (radius <= 0.0f) radius = std::max(0.1f * std::min(bbox.width, bbox.height), 1.0f);
+		cv::Rect roi(bbox.x - 1, bbox.y - 1, bbox.width + 2, bbox.height + 2);
+		roi &= cv::Rect(0, 0, src.cols, src.rows);
+
+		// Distance of the mask pixels from the background
+		cv::Mat dist;
+		cv::distanceTransform(mask(roi), dist, cv::DIST_L2, cv::DIST_MASK_3);
+
+		const float inv_radius = 1.0f / radius;
+		const cv::Mat src_roi = src(roi);
+		cv::Mat out_roi = out(roi);
+		cv::parallel_for_(cv::Range(0, roi.height), [&](const cv::Range& range)
+		{
+			for (int r = range.start; r < range.end; ++r)
+			{
+				const float* dist_data = dist.ptr<float>(r);
+				const cv::Vec3b* src_data = src_roi.ptr<cv::Vec3b>(r);
+				cv::Vec3b* out_data = out_roi.ptr<cv::Vec3b>(r);
+				for (int c = 0; c < roi.width; ++c)
+				{
+					if (dist_data[c] <= 0.0f) continue;
+					const float alpha = std::min(dist_data[c] * inv_radius, 1.0f);
+					for (int k = 0; k < 3; ++k)
+						out_data[c][k] = cv::saturate_cast<uchar>(
+							alpha * src_data[c][k] + (1.0f - alpha) * out_data[c][k]);
+				}
+			}
+		});
+	}
+
+	/** Accumulate the set bits of a mask chunk into the row statistics.
+	@param bits One bit per mask pixel.
+	@param n The number of pixels in the chunk.
+	@param x The column of the chunk's first pixel.
+	*/
+	static inline void accumulateMaskBits(unsigned int bits, int n, int x,
+		int& min_x, int& max_x, int& count, double& sum_x)
+	{
+		if (bits == 0) return;
+		if (bits == (1u << n) - 1)
+		{
+			// Full chunk
+			min_x = std::min(min_x, x);
+			max_x = std::max(max_x, x + n - 1);
+			count += n;
+			sum_x += n * (x + 0.5 * (n - 1));
+			return;
+		}
+		for (int j = 0; j < n; ++j)
+		{
+			if ((bits & (1u << j)) == 0) continue;
+			min_x = std::min(min_x, x + j);
+			max_x = std::max(max_x, x + j);
+			++count;
+			sum_x += x + j;
+		}
+	}
+
+	cv::Rect createBlendMask(const cv::Mat& depthbuf, const cv::Mat& seg,
+		cv::Mat& mask, cv::Point2f* centroid)
+	{
+		CV_Assert(depthbuf.type() == CV_32F);
+		CV_Assert(seg.empty() || (seg.type() == CV_8U && seg.size() == depthbuf.size()));
+		mask.create(depthbuf.size(), CV_8U);
+
+		// Each row is processed independently, its statistics are reduced at the end
+		const bool with_seg = !seg.empty();
+		const float background = std::numeric_limits<float>::max();
+		std::vector<cv::Vec4i> row_bounds(depthbuf.rows);	// min x, max x, count, unused
+		std::vector<double> row_sum_x(depthbuf.rows);
+		cv::parallel_for_(cv::Range(0, depthbuf.rows), [&](const cv::Range& range)
+		{
+			for (int r = range.start; r < range.end; ++r)
+			{
+				const float* depth_data = depthbuf.ptr<float>(r);
+				const unsigned char* seg_data = with_seg ? seg.ptr<unsigned char>(r) : nullptr;
+				unsigned char* mask_data = mask.ptr<unsigned char>(r);
+				int min_x = std::numeric_limits<int>::max(), max_x = -1, count = 0;
+				double sum_x = 0.0;
+
+				int c = 0;
+#if CV_SIMD128
+				const cv::v_float32x4 vbackground = cv::v_setall_f32(background);
+				const cv::v_uint8x16 vthreshold = cv::v_setall_u8(128);
+				for (; c <= depthbuf.cols - 16; c += 16)
+				{
+					// Rendered pixels, narrowed from 32 bit lane masks to 8 bit
+					const cv::v_int32x4 m0 = cv::v_reinterpret_as_s32(cv::v_load(depth_data + c) < vbackground);
+					const cv::v_int32x4 m1 = cv::v_reinterpret_as_s32(cv::v_load(depth_data + c + 4) < vbackground);
+					const cv::v_int32x4 m2 = cv::v_reinterpret_as_s32(cv::v_load(depth_data + c + 8) < vbackground);
+					const cv::v_int32x4 m3 = cv::v_reinterpret_as_s32(cv::v_load(depth_data + c + 12) < vbackground);
+					cv::v_uint8x16 m = cv::v_reinterpret_as_u8(cv::v_pack(cv::v_pack(m0, m1), cv::v_pack(m2, m3)));
+
+					// Combine with the segmentation
+					if (with_seg) m = m & (cv::v_load(seg_data + c) >= vthreshold);
+					cv::v_store(mask_data + c, m);
+					accumulateMaskBits((unsigned int)cv::v_signmask(m), 16, c, min_x, max_x, count, sum_x);
+				}
+#endif
+				for (; c < depthbuf.cols; ++c)
+				{
+					const bool inside = depth_data[c] < background && (!with_seg || seg_data[c] >= 128);
+					mask_data[c] = inside ? 255 : 0;
+					accumulateMaskBits(inside ? 1u : 0u, 1, c, min_x, max_x, count, sum_x);
+				}
+				row_bounds[r] = cv::Vec4i(min_x, max_x, count, 0);
+				row_sum_x[r] = sum_x;
+			}
+		});
+
+		// Reduce the rows
+		int min_x = std::numeric_limits<int>::max(), max_x = -1, min_y = -1, max_y = -1;
+		double count = 0.0, sum_x = 0.0, sum_y = 0.0;
+		for (int r = 0; r < depthbuf.rows; ++r)
+		{
+			const cv::Vec4i& bounds = row_bounds[r];
+			if (bounds[2] == 0) continue;
+			min_x = std::min(min_x, bounds[0]);
+			max_x = std::max(max_x, bounds[1]);
+			if (min_y < 0) min_y = r;
+			max_y = r;
+			count += bounds[2];
+			sum_x += row_sum_x[r];
+			sum_y += (double)r * bounds[2];
+		}
+		if (count == 0.0)
+		{
+			if (centroid != nullptr) *centroid = cv::Point2f();
+			return cv::Rect();
+		}
+		if (centroid != nullptr) *centroid = cv::Point2f((float)(sum_x / count), (float)(sum_y / count));
+
+		return cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+	}
+
+}   // namespace face_swap
@@ -1,46 +1,45 @@
 #include "face_swap/cnn_3dmm.h"
+#include "face_swap/cnn_utilities.h"
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>  // debug
 
+#include <algorithm>
 #include <exception>
 #include <fstream>
+#include <stdexcept>
 
 #include <H5Cpp.h>
 
+// Caffe
+#include <caffe/caffe.hpp>
+
 using std::string;
 using namespace caffe;
 
 namespace face_swap
 {
+// Maximum number of calibration crops used by quantize, each one is a floating
+// point forward pass when the network is loaded
+const int QUANTIZE_MAX_CALIB_SAMPLES = 16;
+
 CNN3DMM::CNN3DMM(const string& deploy_file, const string& caffe_model_file,
-    const std::string& mean_file, bool init_cnn, bool with_gpu, int gpu_device_id) :
+    const std::string& mean_file, bool init_cnn, bool with_gpu, int gpu_device_id,
+    const std::string& inference_backend) :
     m_num_channels(0), m_with_gpu(with_gpu)
 {
     if (!init_cnn) return;
 
-    // Initialize device mode
-    if (with_gpu)
-    {
-        Caffe::SetDevice(gpu_device_id);
-        Caffe::set_mode(Caffe::GPU);
-    }
-    else Caffe::set_mode(Caffe::CPU);
-
-    // Set test mode
-    //Caffe::set_phase(Caffe::TEST);
-
     // Load the network
-    m_net.reset(new Net<float>(deploy_file, caffe::TEST));
-    m_net->CopyTrainedLayersFrom(caffe_model_file);
-
-    CHECK_EQ(m_net->num_inputs(), 1) << "Network should have exactly one input.";
-    CHECK_EQ(m_net->num_outputs(), 1) << "Network should have exactly one output.";
+    m_net = InferenceBackend::create(inference_backend, deploy_file, caffe_model_file,
+        with_gpu, gpu_device_id);
+    if (!m_net)
+        throw std::runtime_error("Inference backend \"" + inference_backend + "\" is not available!");
 
-    Blob<float>* input_layer = m_net->input_blobs()[0];
-    m_num_channels = input_layer->channels();
+    std::vector<int> input_shape = m_net->inputShape();
+    m_num_channels = input_shape[1];
     CHECK(m_num_channels == 3 || m_num_channels == 1)
             << "Input layer should have 1 or 3 channels.";
-    m_input_size = cv::Size(input_layer->width(), input_layer->height());
+    m_input_size = cv::Size(input_shape[3], input_shape[2]);
 
     // Load mean file
     m_mean = readMean(mean_file);
@@ -50,13 +49,11 @@ void CNN3DMM::process(const cv::Mat& img,
     cv::Mat& shape_coefficients, cv::Mat& tex_coefficients)
 {
     // Prepare input data
-    cv::Mat img_processed = preprocess(img);
-    copyInputData(img_processed);
-	const vector<Blob<float>*>& output_blobs = m_net->Forward();
+    preprocess(img, m_net->inputData());
+	cv::Mat output = m_net->forward("fc_ftnew");
 
     // Output results
-	const std::vector<int>& shape = m_net->blob_by_name("fc_ftnew")->shape();
-	float* featues = m_net->blob_by_name("fc_ftnew")->mutable_cpu_data();
+	float* featues = (float*)output.data;
     shape_coefficients = cv::Mat_<float>(99, 1, featues).clone();
     tex_coefficients = cv::Mat_<float>(99, 1, featues + 99).clone();
 }
@@ -65,24 +62,54 @@ CNN3DMM::~CNN3DMM()
 {
 }
 
-void CNN3DMM::wrapInputLayer(std::vector<cv::Mat>& input_channels)
+void CNN3DMM::writeCalibration(const std::string& calib_file,
+    const std::vector<cv::Mat>& imgs) const
 {
-    Blob<float>* input_layer = m_net->input_blobs()[0];
+    CHECK(!imgs.empty()) << "No calibration images.";
 
-    int width = input_layer->width();
-    int height = input_layer->height();
+    // Preprocess the images into a single blob, in the input layer's format
+    Blob<float> calib_blob((int)imgs.size(), m_num_channels,
+        m_input_size.height, m_input_size.width);
+    float* calib_data = calib_blob.mutable_cpu_data();
+    for (const cv::Mat& img : imgs)
+    {
+        preprocess(img, calib_data);
+        calib_data += calib_blob.count(1);
+    }
 
-#ifdef CPU_ONLY
-    float* input_data = input_layer->mutable_cpu_data();
-#else
-    float* input_data = input_layer->mutable_gpu_data();
-#endif
+    // Write binary proto file
+    caffe::BlobProto blob_proto;
+    calib_blob.ToProto(&blob_proto);
+    caffe::WriteProtoToBinaryFile(blob_proto, calib_file);
+}
+
+void CNN3DMM::quantize(const std::string& calib_file)
+{
+    if (!m_net) return;
 
-    for (int i = 0; i < input_layer->channels(); ++i) {
-        cv::Mat channel(height, width, CV_32FC1, input_data);
-        input_channels.push_back(channel);
-        input_data += width * height;
+    // Read binary proto file
+    caffe::BlobProto blob_proto;
+    caffe::ReadProtoFromBinaryFileOrDie(calib_file, &blob_proto);
+    Blob<float> calib_blob;
+    calib_blob.FromProto(blob_proto);
+    CHECK(calib_blob.channels() == m_num_channels &&
+        calib_blob.width() == m_input_size.width && calib_blob.height() == m_input_size.height)
+        << "Shape of calibration file doesn't match input layer.";
+
+    // Split the calibration blob into single image input blobs, evenly
+    // sampling at most QUANTIZE_MAX_CALIB_SAMPLES crops
+    std::vector<cv::Mat> calib_data;
+    const int shape[] = { 1, m_num_channels, m_input_size.height, m_input_size.width };
+    const int samples = std::min(calib_blob.num(), QUANTIZE_MAX_CALIB_SAMPLES);
+    for (int j = 0; j < samples; ++j)
+    {
+        const int i = j * calib_blob.num() / samples;
+        calib_data.push_back(cv::Mat(4, shape, CV_32F,
+            calib_blob.mutable_cpu_data() + i * calib_blob.count(1)));
     }
+
+    if (!m_net->quantize(calib_data))
+        throw std::runtime_error("Inference backend \"" + m_net->name() + "\" doesn't support quantization!");
 }
 
 cv::Mat CNN3DMM::readMean(const std::string & mean_file) const
@@ -96,89 +123,31 @@ cv::Mat CNN3DMM::readMean(const std::string & mean_file) const
     mean_blob.FromProto(blob_proto);
     CHECK_EQ(mean_blob.channels(), m_num_channels)
         << "Number of channels of mean file doesn't match input layer.";
+    CHECK(mean_blob.width() == m_input_size.width && mean_blob.height() == m_input_size.height)
+        << "Size of mean file doesn't match input layer.";
 
-    // The format of the mean file is planar 32-bit float BGR or grayscale
-    std::vector<cv::Mat> channels;
-    float* data = mean_blob.mutable_cpu_data();
-    for (int i = 0; i < m_num_channels; ++i) {
-        /* Extract an individual channel. */
-        cv::Mat channel(mean_blob.height(), mean_blob.width(), CV_32FC1, data);
-        channels.push_back(channel);
-        data += mean_blob.height() * mean_blob.width();
-    }
-
-    // Merge the separate channels into a single image
-    cv::Mat mean;
-    cv::merge(channels, mean);
+    // The format of the mean file is planar 32-bit float BGR or grayscale,
+    // the same layout as the input layer
+    cv::Mat mean(m_num_channels * mean_blob.height(), mean_blob.width(), CV_32F,
+        mean_blob.mutable_cpu_data());
 
-    return mean;
+    return mean.clone();
 }
 
-cv::Mat CNN3DMM::preprocess(const cv::Mat& img)
+void CNN3DMM::preprocess(const cv::Mat& img, float* input_data) const
 {
-    // Convert the input image to the input image format of the network.
+    // Resize to the network's input size, the color conversion is left
+    // to imageToBlob which reads the 8-bit image directly
     cv::Mat sample;
-    if (img.channels() == 3 && m_num_channels == 1)
-        cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-    else if (img.channels() == 4 && m_num_channels == 1)
-        cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-    else if (img.channels() == 4 && m_num_channels == 3)
-        cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-    else if (img.channels() == 1 && m_num_channels == 3)
-        cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
+    if (img.size() != m_input_size)
+        cv::resize(img, sample, m_input_size, 0, 0, cv::INTER_CUBIC);
     else
         sample = img;
 
-    cv::Mat sample_resized;
-    if (sample.size() != m_input_size)
-        cv::resize(sample, sample_resized, m_input_size, 0, 0, cv::INTER_CUBIC);
-    else
-        sample_resized = sample;
-
-    cv::Mat sample_float;
-    if (m_num_channels == 3)
-        sample_resized.convertTo(sample_float, CV_32FC3);
-    else
-        sample_resized.convertTo(sample_float, CV_32FC1);
-
-    //cv::Mat sample_normalized;
-    //cv::subtract(sample_float, mean_, sample_normalized);
-
-    // Normalize the image by substracting the mean
-    //subtractMean_c3(sample_float);
-    //cv::Mat sample_normalized = sample_float;
-    sample_float -= m_mean;
-
-    return sample_float;
-}
-
-void CNN3DMM::copyInputData(cv::Mat& img)
-{
-    Blob<float>* input_layer = m_net->input_blobs()[0];
-    float* buf = new float[input_layer->count()];
-
-    int r, c, cnl, channels = img.channels();
-    float* img_data = nullptr;
-    float* buf_data = buf;
-    for(cnl = 0; cnl < channels; ++cnl)
-    {
-        img_data = ((float*)img.data) + cnl;
-        for(r = 0; r < img.rows; ++r)
-        {
-            for(c = 0; c < img.cols; ++c)
-            {
-                *buf_data++ = *img_data;
-                img_data += channels;
-            }
-        }
-    }
-
-    if(m_with_gpu)
-        caffe_copy(input_layer->count(), buf, input_layer->mutable_gpu_data());
-    else 
-        caffe_copy(input_layer->count(), buf, input_layer->mutable_cpu_data());
-
-    delete[] buf;
+    // Write the mean subtracted planes directly to the input layer,
+    // the backend uploads them to the GPU on the forward pass if needed
+    imageToBlob(sample, input_data, m_num_channels,
+        cv::Scalar(), (const float*)m_mean.data);
 }
 
 }   // namespace face_swap
@@ -17,9 +17,9 @@ namespace face_swap
     CNN3DMMExpr::CNN3DMMExpr(const std::string& deploy_file,
 		const std::string& caffe_model_file, const std::string& mean_file,
 		const std::string& model_file, bool generic, bool with_expr,
-		bool with_gpu, int gpu_device_id) :
+		bool with_gpu, int gpu_device_id, const std::string& inference_backend) :
         CNN3DMM(deploy_file, caffe_model_file, mean_file, 
-			!generic, with_gpu, gpu_device_id),
+			!generic, with_gpu, gpu_device_id, inference_backend),
         m_generic(generic), m_with_expr(with_expr)
     {
         // Load Basel 3DMM
@@ -0,0 +1,104 @@
+#include "face_swap/cnn_utilities.h"
+
+// OpenCV
+#include <opencv2/core/hal/intrin.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace face_swap
+{
+#if CV_SIMD128
+	/**	Convert 16 pixels of a single channel to float, subtract the mean and store them.
+	*/
+	static inline void storeChannel(const cv::v_uint8x16& v, float* dst,
+		const cv::v_float32x4& vmean_color, const float* mean)
+	{
+		cv::v_uint16x8 w0, w1;
+		cv::v_uint32x4 d0, d1, d2, d3;
+		cv::v_expand(v, w0, w1);
+		cv::v_expand(w0, d0, d1);
+		cv::v_expand(w1, d2, d3);
+		cv::v_float32x4 f0 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(d0)) - vmean_color;
+		cv::v_float32x4 f1 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(d1)) - vmean_color;
+		cv::v_float32x4 f2 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(d2)) - vmean_color;
+		cv::v_float32x4 f3 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(d3)) - vmean_color;
+		if (mean)
+		{
+			f0 -= cv::v_load(mean);
+			f1 -= cv::v_load(mean + 4);
+			f2 -= cv::v_load(mean + 8);
+			f3 -= cv::v_load(mean + 12);
+		}
+		cv::v_store(dst, f0);
+		cv::v_store(dst + 4, f1);
+		cv::v_store(dst + 8, f2);
+		cv::v_store(dst + 12, f3);
+	}
+#endif
+
+	void imageToBlob(const cv::Mat& img, float* blob, int channels,
+		const cv::Scalar& mean_color, const float* mean)
+	{
+		CV_Assert(img.depth() == CV_8U && blob != nullptr);
+		CV_Assert(channels == 1 || channels == 3);
+		const int cn = img.channels();
+
+		// Channel conversions not supported by the kernel
+		if ((channels == 3 && cn == 1) || (channels == 1 && cn != 1))
+		{
+			cv::Mat sample;
+			if (channels == 3) cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
+			else if (cn == 4) cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
+			else cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
+			imageToBlob(sample, blob, channels, mean_color, mean);
+			return;
+		}
+
+		const int plane_size = img.rows * img.cols;
+		const float mc[3] = { (float)mean_color[0], (float)mean_color[1], (float)mean_color[2] };
+#if CV_SIMD128
+		const cv::v_float32x4 vmc[3] = {
+			cv::v_setall_f32(mc[0]), cv::v_setall_f32(mc[1]), cv::v_setall_f32(mc[2]) };
+#endif
+		for (int r = 0; r < img.rows; ++r)
+		{
+			const unsigned char* src = img.ptr<unsigned char>(r);
+			float* dst[3];
+			const float* mean_data[3] = { nullptr, nullptr, nullptr };
+			for (int k = 0; k < channels; ++k)
+			{
+				dst[k] = blob + k * plane_size + r * img.cols;
+				if (mean) mean_data[k] = mean + k * plane_size + r * img.cols;
+			}
+
+			int c = 0;
+#if CV_SIMD128
+			cv::v_uint8x16 b, g, rd, a;
+			for (; c <= img.cols - 16; c += 16)
+			{
+				if (cn == 1)
+				{
+					storeChannel(cv::v_load(src + c), dst[0] + c, vmc[0],
+						mean ? mean_data[0] + c : nullptr);
+					continue;
+				}
+				if (cn == 3) cv::v_load_deinterleave(src + c * 3, b, g, rd);
+				else cv::v_load_deinterleave(src + c * 4, b, g, rd, a);
+				storeChannel(b, dst[0] + c, vmc[0], mean ? mean_data[0] + c : nullptr);
+				storeChannel(g, dst[1] + c, vmc[1], mean ? mean_data[1] + c : nullptr);
+				storeChannel(rd, dst[2] + c, vmc[2], mean ? mean_data[2] + c : nullptr);
+			}
+#endif
+			for (; c < img.cols; ++c)
+			{
+				const unsigned char* pixel = src + c * cn;
+				for (int k = 0; k < channels; ++k)
+				{
+					float val = (float)pixel[k] - mc[k];
+					if (mean) val -= mean_data[k][c];
+					dst[k][c] = val;
+				}
+			}
+		}
+	}
+
+}   // namespace face_swap
@@ -1,43 +1,35 @@
 #include "face_swap/face_seg.h"
 #include "face_swap/segmentation_utilities.h"
+#include "face_swap/cnn_utilities.h"
 #include <exception>
+#include <stdexcept>
+#include <algorithm>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>  // debug
 
-using namespace caffe;
+using std::string;
 
 namespace face_swap
 {
 
 	FaceSeg::FaceSeg(const string& deploy_file, const string& model_file,
-		bool with_gpu, int gpu_device_id, bool scale, bool postprocess_seg) :
-		m_num_channels(0), m_with_gpu(with_gpu), m_scale(scale), m_postprocess_seg(postprocess_seg)
+		bool with_gpu, int gpu_device_id, bool scale, bool postprocess_seg, bool cleanup_seg,
+		const string& inference_backend) :
+		m_num_channels(0), m_with_gpu(with_gpu), m_scale(scale), m_postprocess_seg(postprocess_seg),
+		m_cleanup_seg(cleanup_seg)
 	{
-		if (with_gpu)
-		{
-			Caffe::SetDevice(gpu_device_id);
-			Caffe::set_mode(Caffe::GPU);
-		}
-		else Caffe::set_mode(Caffe::CPU);
-
 		// Load the network
-		m_net.reset(new Net<float>(deploy_file, caffe::TEST));
-		m_net->CopyTrainedLayersFrom(model_file);
-
-		CHECK_EQ(m_net->num_inputs(), 1) << "Network should have exactly one input.";
-		CHECK_EQ(m_net->num_outputs(), 1) << "Network should have exactly one output.";
+		m_net = InferenceBackend::create(inference_backend, deploy_file, model_file,
+			with_gpu, gpu_device_id);
+		if (!m_net)
+			throw std::runtime_error("Inference backend \"" + inference_backend + "\" is not available!");
 
 		// Get suggested input size
-		Blob<float>* input_layer = m_net->input_blobs()[0];
-		m_num_channels = input_layer->channels();
-		CHECK(m_num_channels == 3 || m_num_channels == 1)
-			<< "Input layer should have 1 or 3 channels.";
-		m_input_size = cv::Size(input_layer->width(), input_layer->height());
-
-		// Check number of output channels
-		Blob<float>* output_layer = m_net->output_blobs()[0];
-		if (output_layer->channels() == 21)
-			m_foreground_channel = 15;
+		std::vector<int> input_shape = m_net->inputShape();
+		m_num_channels = input_shape[1];
+		if (m_num_channels != 3 && m_num_channels != 1)
+			throw std::runtime_error("Input layer should have 1 or 3 channels.");
+		m_input_size = cv::Size(input_shape[3], input_shape[2]);
 	}
 
 	FaceSeg::~FaceSeg()
@@ -46,130 +38,113 @@ namespace face_swap
 
 	cv::Mat FaceSeg::process(const cv::Mat& img)
 	{
-		cv::Mat img_scaled;
+		return process(std::vector<cv::Mat>{ img }).front();
+	}
+
+	std::vector<cv::Mat> FaceSeg::process(const std::vector<cv::Mat>& imgs)
+	{
+		std::vector<cv::Mat> segs;
+		if (imgs.empty()) return segs;
+
+		// Choose the batch's input size
+		std::vector<cv::Mat> imgs_scaled(imgs);
+		std::vector<cv::Size> unpadded_sizes;
+		cv::Size input_size = m_input_size;
 		if (!m_scale)
 		{
 			// Enforce network maximum size
-			if (img.cols > m_input_size.width)
+			for (cv::Mat& img_scaled : imgs_scaled)
 			{
-				float scale = (float)m_input_size.width / (float)img.cols;
-				cv::resize(img, img_scaled, cv::Size(), scale, scale, cv::INTER_CUBIC);
+				if (img_scaled.cols > m_input_size.width)
+				{
+					float scale = (float)m_input_size.width / (float)img_scaled.cols;
+					cv::resize(img_scaled, img_scaled, cv::Size(), scale, scale, cv::INTER_CUBIC);
+				}
+				unpadded_sizes.push_back(img_scaled.size());
 			}
-			else img_scaled = img;
-
-			// Reshape net
-			Blob<float>* input_layer = m_net->input_blobs()[0];
-			std::vector<int> shape = { 1, img_scaled.channels(), img_scaled.rows, img_scaled.cols };
-			input_layer->Reshape(shape);
 
-			// Forward dimension change to all layers
-			m_net->Reshape();
+			// Images of different sizes are padded at their bottom and right to the
+			// largest size with the mean color, which is zero after the mean subtraction
+			input_size = cv::Size(0, 0);
+			for (const cv::Mat& img_scaled : imgs_scaled)
+			{
+				input_size.width = std::max(input_size.width, img_scaled.cols);
+				input_size.height = std::max(input_size.height, img_scaled.rows);
+			}
+			for (cv::Mat& img_scaled : imgs_scaled)
+			{
+				if (img_scaled.size() == input_size) continue;
+				cv::copyMakeBorder(img_scaled, img_scaled, 0, input_size.height - img_scaled.rows,
+					0, input_size.width - img_scaled.cols, cv::BORDER_CONSTANT, cv::Scalar(MB, MG, MR));
+			}
 		}
-		else img_scaled = img;
+
+		// Reshape net, the backend only reshapes the layers if the shape changed
+		m_net->reshapeInput({ (int)imgs.size(), m_num_channels, input_size.height, input_size.width });
 
 		// Prepare input data
-		std::vector<cv::Mat> input_channels;
-		wrapInputLayer(input_channels);
-		preprocess(img_scaled, input_channels);
+		float* input_data = m_net->inputData();
+		for (const cv::Mat& img_scaled : imgs_scaled)
+		{
+			preprocess(img_scaled, input_size, input_data);
+			input_data += m_num_channels * input_size.area();
+		}
 
 		// Forward pass
-		m_net->Forward();
-		
-		// Extract background and foreground from output layer
-		Blob<float>* output_layer = m_net->output_blobs()[0];
-		cv::Mat background(output_layer->height(), output_layer->width(), CV_32F, 
-			(void*)output_layer->cpu_data());
-		cv::Mat foreground(output_layer->height(), output_layer->width(), CV_32F,
-			(void*)(output_layer->cpu_data() + m_foreground_channel * (output_layer->height() * output_layer->width())));
-		
-		// Calculate argmax
-		cv::Mat seg(output_layer->height(), output_layer->width(), CV_8U);
-		unsigned char* seg_data = seg.data;
-		float* back_data = (float*)background.data;
-		float* fore_data = (float*)foreground.data;
-		for (int i = 0; i < seg.total(); ++i)
-			*seg_data++ = (*back_data++ < *fore_data++) ? 255 : 0;
-
-		// Refine segmentation
-		//cv::Mat kernel = cv::getStructuringElement(cv::MorphShapes::MORPH_ELLIPSE, cv::Size(3, 3));
-		//cv::erode(seg, seg, kernel, cv::Point(-1, -1), 5);
-		//cv::Mat kernel = cv::getStructuringElement(cv::MorphShapes::MORPH_ELLIPSE, cv::Size(5, 5));
-		//cv::erode(seg, seg, kernel, cv::Point(-1, -1), 1);
-		if(m_postprocess_seg) smoothFlaws(seg, 1, 2);
-
-		// Resize to original image size
-		if (seg.size() != img.size())
-			cv::resize(seg, seg, img.size(), 0, 0, cv::INTER_NEAREST);
+		cv::Mat output = m_net->forward();
 
-		// Output results
-		return seg;
-	}
+		// Extract background and foreground from output layer, networks
+		// trained on all the Pascal VOC classes output persons in channel 15
+		const int out_channels = output.size[1], out_height = output.size[2], out_width = output.size[3];
+		const int foreground_channel = out_channels == 21 ? 15 : 1;
+		for (size_t i = 0; i < imgs.size(); ++i)
+		{
+			float* output_data = (float*)output.data + i * out_channels * (out_height * out_width);
+			cv::Mat background(out_height, out_width, CV_32F, output_data);
+			cv::Mat foreground(out_height, out_width, CV_32F,
+				output_data + foreground_channel * (out_height * out_width));
 
-	void FaceSeg::wrapInputLayer(std::vector<cv::Mat>& input_channels)
-	{
-		Blob<float>* input_layer = m_net->input_blobs()[0];
+			// Calculate argmax from the foreground scores
+			cv::Mat scores, seg;
+			cv::subtract(foreground, background, scores);
 
-		int width = input_layer->width();
-		int height = input_layer->height();
+			// Remove the padding
+			if (!m_scale && imgs_scaled[i].size() != unpadded_sizes[i])
+			{
+				const cv::Rect roi(0, 0,
+					cvRound(unpadded_sizes[i].width * out_width / (float)input_size.width),
+					cvRound(unpadded_sizes[i].height * out_height / (float)input_size.height));
+				scores = scores(roi).clone();
+			}
+			cv::compare(scores, 0.0, seg, cv::CMP_GT);
 
-		float* input_data = input_layer->mutable_cpu_data();
+			// Refine segmentation at the network's resolution, so its cost
+			// doesn't depend on the image size
+			if (m_cleanup_seg || m_postprocess_seg)
+				postprocessSegmentation(seg, m_cleanup_seg, m_cleanup_seg, m_postprocess_seg, 1, 2);
 
-		for (int i = 0; i < input_layer->channels(); ++i) {
-			cv::Mat channel(height, width, CV_32FC1, input_data);
-			input_channels.push_back(channel);
-			input_data += width * height;
+			// Resize to original image size
+			if (seg.size() != imgs[i].size())
+				upsampleSegmentation(seg, scores, imgs[i].size(), seg);
+			segs.push_back(seg);
 		}
+
+		// Output results
+		return segs;
 	}
 
-	void FaceSeg::preprocess(const cv::Mat& img, std::vector<cv::Mat>& input_channels)
+	void FaceSeg::preprocess(const cv::Mat& img, const cv::Size& size, float* input_data)
 	{
-		// Convert the input image to the input image format of the network.
+		// Resize to the network's input size, the color conversion is left
+		// to imageToBlob which reads the 8-bit image directly
 		cv::Mat sample;
-		if (img.channels() == 3 && m_num_channels == 1)
-			cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-		else if (img.channels() == 4 && m_num_channels == 1)
-			cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-		else if (img.channels() == 4 && m_num_channels == 3)
-			cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-		else if (img.channels() == 1 && m_num_channels == 3)
-			cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
+		if (img.size() != size)
+			cv::resize(img, sample, size, 0, 0, cv::INTER_CUBIC);
 		else
 			sample = img;
 
-		cv::Mat sample_resized;
-		if (m_scale && sample.size() != m_input_size)
-		    cv::resize(sample, sample_resized, m_input_size, 0, 0, cv::INTER_CUBIC);
-		else
-		    sample_resized = sample;
-
-		cv::Mat sample_float;
-		if (m_num_channels == 3)
-			sample_resized.convertTo(sample_float, CV_32FC3);
-		else
-			sample_resized.convertTo(sample_float, CV_32FC1);
-
-		// Normalize the image by substracting the mean
-		subtractMean_c3(sample_float);
-
-		// This operation will write the separate BGR planes directly to the
-		// input layer of the network because it is wrapped by the cv::Mat
-		// objects in input_channels. 
-		cv::split(sample_float, input_channels);
-	}
-
-	void FaceSeg::subtractMean_c3(cv::Mat& img)
-	{
-		int r, c;
-		float* img_data = (float*)img.data;
-		for (r = 0; r < img.rows; ++r)
-		{
-			for (c = 0; c < img.cols; ++c)
-			{
-				*img_data++ -= MB;
-				*img_data++ -= MG;
-				*img_data++ -= MR;
-			}
-		}
+		// Write the mean subtracted BGR planes directly to the input layer
+		imageToBlob(sample, input_data, m_num_channels, cv::Scalar(MB, MG, MR));
 	}
 
 }   // namespace face_swap
@@ -2,6 +2,7 @@
 #define FACE_SWAP_BASEL_3DMM_H
 
 #include "face_swap/face_swap_export.h"
+#include "face_swap/mesh_utilities.h"
 
 // Includes
 #include <opencv2/core.hpp>
@@ -36,12 +37,22 @@ namespace face_swap
 	*/
     struct Basel3DMM
     {
+		/**	Flags selecting which parts of the mesh are computed by sample().
+		*/
+		enum SampleFlags
+		{
+			SAMPLE_SHAPE = 1,	///< Compute the vertices from the shape model.
+			SAMPLE_EXPR = 2,	///< Add the expression model to the vertices.
+			SAMPLE_COLORS = 4,	///< Compute the vertex colors from the texture model.
+			SAMPLE_ALL = SAMPLE_SHAPE | SAMPLE_EXPR | SAMPLE_COLORS
+		};
+
 		/**	Sample a mesh from the PCA model.
 		@param[in] shape_coefficients PCA shape coefficients.
 		@param[in] tex_coefficients PCA texture coefficients.
 		*/
         Mesh sample(const cv::Mat& shape_coefficients,
-            const cv::Mat& tex_coefficients);
+            const cv::Mat& tex_coefficients) const;
 
 		/**	Sample a mesh from the PCA model.
 		@param[in] shape_coefficients PCA shape coefficients.
@@ -49,7 +60,53 @@ namespace face_swap
 		@param[in] expr_coefficients PCA expression coefficients.
 		*/
         Mesh sample(const cv::Mat& shape_coefficients,
-            const cv::Mat& tex_coefficients, const cv::Mat& expr_coefficients);
+            const cv::Mat& tex_coefficients, const cv::Mat& expr_coefficients) const;
+
+		/**	Sample a mesh from the PCA model into an existing mesh.
+		Only the parts selected by flags are computed, the rest of the mesh is left
+		untouched. The mesh buffers are reallocated only when their size doesn't
+		match the model, so reusing the same mesh between calls doesn't allocate.
+		@param[in] shape_coefficients PCA shape coefficients.
+		@param[in] tex_coefficients PCA texture coefficients (used with SAMPLE_COLORS).
+		@param[in] expr_coefficients PCA expression coefficients (used with SAMPLE_EXPR).
+		@param[in,out] mesh The mesh to write the sampled data to.
+		@param[in] flags Combination of SampleFlags.
+		*/
+        void sample(const cv::Mat& shape_coefficients,
+            const cv::Mat& tex_coefficients, const cv::Mat& expr_coefficients,
+            Mesh& mesh, int flags = SAMPLE_ALL) const;
+
+		/**	Sample a mesh by adding the expression model to an identity mesh.
+		This skips the shape model evaluation which dominates the sampling cost,
+		so the identity can be sampled once and reused while only the
+		expression changes.
+		@param[in] identity Identity vertices [N x 3], sampled with SAMPLE_SHAPE only.
+		@param[in] expr_coefficients PCA expression coefficients.
+		@param[in,out] mesh The mesh to write the vertices to.
+		*/
+        void sampleExpression(const cv::Mat& identity,
+            const cv::Mat& expr_coefficients, Mesh& mesh) const;
+
+		/**	Create a compacted model of a subset of the vertices.
+		Only the faces with all three vertices in the subset are kept, and the
+		vertices that are not referenced by any of these faces are removed. The
+		atlas coordinates are regenerated to cover only the remaining vertices.
+		@param vertex_mask Per-vertex mask [N], non-zero for vertices to keep.
+		@return The compacted model, its vertex_indices map each of its vertices
+		to the corresponding vertex of the full model.
+		*/
+        Basel3DMM submodel(const cv::Mat& vertex_mask) const;
+
+		/**	Create a simplified level of detail of the model.
+		The mean face is simplified by quadric error metric edge collapses that
+		only remove vertices, so every vertex of the simplified model is a vertex
+		of this model and keeps its PCA rows and atlas coordinates. Texture
+		coordinates that are computed per vertex therefore stay valid.
+		@param ratio The fraction of faces to keep, in the range (0, 1].
+		@return The simplified model, its vertex_indices map each of its vertices
+		to the corresponding vertex of the full model.
+		*/
+        Basel3DMM decimate(float ratio) const;
 
 		/**	Load a Basel's 3DMM from file.
 		@param model_file Path to 3DMM file (.h5).
@@ -57,6 +114,9 @@ namespace face_swap
         static Basel3DMM load(const std::string& model_file);
 
         cv::Mat faces;
+        cv::Mat vertex_indices;     ///< Full model vertex indices [CV_32S], empty for the full model.
+        MeshAdjacency adjacency;    ///< Vertex to face adjacency of faces, for computing vertex normals.
+        cv::Mat atlas_uv;           ///< Texture atlas coordinates of the mean face [N x 2, CV_32F].
         cv::Mat shapeMU, shapePC, shapeEV;
         cv::Mat texMU, texPC, texEV;
         cv::Mat exprMU, exprPC, exprEV;
@@ -0,0 +1,104 @@
+/** @file
+@brief Image blending utility functions.
+*/
+
+#ifndef FACE_SWAP_BLENDING_UTILITIES_H
+#define FACE_SWAP_BLENDING_UTILITIES_H
+
+#include "face_swap/face_swap_export.h"
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_swap
+{
+	/**	Image blending methods, ordered by the amount of work they do: an iterative
+	solve, a fixed number of pyramid levels and a single pass. tests/test_blend times
+	each method on an image pair and reports its difference from cv::seamlessClone,
+	both absolute and relative to pasting the source without blending.
+	*/
+	enum BlendMode
+	{
+		/** Poisson cloning (see poissonBlend). Matches the colors and lighting of the
+		destination along the whole boundary, at the cost of an iterative solve.
+		*/
+		BLEND_POISSON,
+		/** Laplacian pyramid blending (see multibandBlend). Each frequency band is
+		blended over a transition region proportional to its wavelength, which hides
+		the seam without a solve but doesn't correct the source's colors.
+		*/
+		BLEND_MULTIBAND,
+		/** Feathered alpha blending (see featherBlend). A single pass with a distance
+		transform, the seam is softened but differences in lighting remain visible.
+		*/
+		BLEND_FEATHER
+	};
+
+	/**	Blend the source image into the destination image by gradient domain (Poisson) cloning.
+	Solves the same equation as cv::seamlessClone with cv::NORMAL_CLONE when the
+	source and destination are aligned: inside the mask the output has the gradients
+	of the source, and it matches the destination on the mask's boundary. The results
+	differ by the solvers' convergence, tests/test_blend fails if the mean absolute
+	difference exceeds 10% of the difference of pasting the source without blending.
+	The equation is solved only inside the mask's bounding box, by a cascadic
+	multigrid solver with each of the channels solved in parallel.
+	@param[in] src The source image [CV_8UC3].
+	@param[in] dst The destination image [CV_8UC3], same size as src.
+	@param[in] mask Blending mask [CV_8U], non-zero pixels are taken from the source.
+	@param[out] out The blended image, the destination outside the mask.
+	@param[in] mask_bbox The bounding box of the mask, computed from the mask if empty.
+	@param[in] guess Optional initial guess of the output [CV_8UC3], same size as src,
+	only the pixels inside the mask are read. With a close guess, such as the previous
+	video frame's result, only a few iterations on the full resolution are needed.
+	If the first iteration shows that the guess is far from the solution, the guess is
+	discarded and the equation is solved by the multigrid solver as if it was not given.
+	*/
+	FACE_SWAP_EXPORT void poissonBlend(const cv::Mat& src, const cv::Mat& dst,
+		const cv::Mat& mask, cv::Mat& out, const cv::Rect& mask_bbox = cv::Rect(),
+		const cv::Mat& guess = cv::Mat());
+
+	/**	Blend the source image into the destination image by Laplacian pyramid blending.
+	Only the mask's bounding box, padded by the extent of the coarsest level, is processed.
+	@param[in] src The source image [CV_8UC3].
+	@param[in] dst The destination image [CV_8UC3], same size as src.
+	@param[in] mask Blending mask [CV_8U], the source's weight scaled to [0, 255].
+	@param[out] out The blended image.
+	@param[in] levels The number of pyramid levels below the full resolution.
+	@param[in] mask_bbox The bounding box of the mask, computed from the mask if empty.
+	*/
+	FACE_SWAP_EXPORT void multibandBlend(const cv::Mat& src, const cv::Mat& dst,
+		const cv::Mat& mask, cv::Mat& out, int levels = 5, const cv::Rect& mask_bbox = cv::Rect());
+
+	/**	Blend the source image into the destination image by feathered alpha blending.
+	The source's weight ramps from 0 on the mask's boundary to 1 at the feather
+	radius inside the mask, by the mask's distance transform.
+	@param[in] src The source image [CV_8UC3].
+	@param[in] dst The destination image [CV_8UC3], same size as src.
+	@param[in] mask Blending mask [CV_8U], non-zero pixels are taken from the source.
+	@param[out] out The blended image, the destination outside the mask.
+	@param[in] radius Feather radius in pixels. If not positive, 10% of the
+	smaller side of the mask's bounding box is used.
+	@param[in] mask_bbox The bounding box of the mask, computed from the mask if empty.
+	*/
+	FACE_SWAP_EXPORT void featherBlend(const cv::Mat& src, const cv::Mat& dst,
+		const cv::Mat& mask, cv::Mat& out, float radius = 0.0f, const cv::Rect& mask_bbox = cv::Rect());
+
+	/**	Create a blending mask from a rendered depth buffer in a single pass.
+	A pixel is part of the mask if it was rendered, and if the segmentation is
+	given, if it's also part of the segmentation.
+	@param[in] depthbuf Rendered depth buffer [CV_32F], background pixels are
+	std::numeric_limits<float>::max().
+	@param[in] seg Segmentation [CV_8U], same size as depthbuf, pixels of at least
+	128 are foreground. If empty, only the depth buffer is used.
+	@param[out] mask Output mask [CV_8U], 255 for the mask pixels and 0 elsewhere.
+	If it's already allocated with the right size and type, it's written in place,
+	so it can be a region of a larger mask.
+	@param[out] centroid Optional output of the mask's center of mass.
+	@return The tight bounding box of the mask, empty if the mask is empty.
+	*/
+	FACE_SWAP_EXPORT cv::Rect createBlendMask(const cv::Mat& depthbuf, const cv::Mat& seg,
+		cv::Mat& mask, cv::Point2f* centroid = nullptr);
+
+}   // namespace face_swap
+
+#endif	// FACE_SWAP_BLENDING_UTILITIES_H
@@ -2,17 +2,15 @@
 #define FACE_SWAP_CNN_3DMM_H
 
 // Includes
+#include "face_swap/inference_backend.h"
 #include <opencv2/core.hpp>
 
-// Caffe
-#include <caffe/caffe.hpp>
-
 #include <string>
 
 namespace face_swap
 {
-	/**	This class provided face shape and texture estimation using Caffe with
-	a convolutional neural network.
+	/**	This class provided face shape and texture estimation using a convolutional
+	neural network, run by an inference backend (see InferenceBackend).
 	The CNN estimates shape and texture coefficients for a PCA model that is based on
 	Basel's 3D Morphable Model.
 	This is an implementation of the following papers:
@@ -21,7 +19,7 @@ namespace face_swap
 	-# A 3D Face Model for Pose and Illumination Invariant Face Recognition, 
 	P. Paysan and R. Knothe and B. Amberg and S. Romdhani and T. Vetter.
 	*/
-    class CNN3DMM
+    class FACE_SWAP_EXPORT CNN3DMM
     {
     public:
 
@@ -32,10 +30,12 @@ namespace face_swap
 		@param init_cnn if true the CNN will be initialized.
 		@param with_gpu Toggle GPU\CPU execution.
 		@param gpu_device_id Set the GPU's device id.
+		@param inference_backend The inference backend's name (see InferenceBackend::create).
 		*/
         CNN3DMM(const std::string& deploy_file, const std::string& caffe_model_file,
             const std::string& mean_file, bool init_cnn = true,
-			bool with_gpu = true, int gpu_device_id = 0);
+			bool with_gpu = true, int gpu_device_id = 0,
+			const std::string& inference_backend = "caffe");
 
 		/** Destructor.
 		*/
@@ -49,20 +49,34 @@ namespace face_swap
         void process(const cv::Mat& img, 
             cv::Mat& shape_coefficients, cv::Mat& tex_coefficients);
 
-    private:
-        void wrapInputLayer(std::vector<cv::Mat>& input_channels);
+		/** Write an INT8 calibration file from a set of face crops.
+		The crops are preprocessed like the inputs of process and stored in a
+		single blob, so the calibration doesn't depend on the images afterwards.
+		@param[in] calib_file Path to the output calibration file (.binaryproto).
+		@param[in] imgs Face crops representative of the inputs of process.
+		*/
+        void writeCalibration(const std::string& calib_file,
+            const std::vector<cv::Mat>& imgs) const;
 
-        cv::Mat readMean(const std::string& mean_file) const;
+		/** Quantize the CNN to INT8 weights and activations.
+		Requires an inference backend that supports quantization ("opencv"),
+		the accuracy against the floating point CNN can be checked with face_swap_calibrate.
+		The activation ranges are calibrated on at most 16 crops, evenly sampled from the
+		calibration file, which bounds the floating point forward passes this adds to loading.
+		@param[in] calib_file Path to a calibration file written by writeCalibration (.binaryproto).
+		*/
+        void quantize(const std::string& calib_file);
 
-        cv::Mat preprocess(const cv::Mat& img);
+    private:
+        cv::Mat readMean(const std::string& mean_file) const;
 
-        void copyInputData(cv::Mat& img);
+        void preprocess(const cv::Mat& img, float* input_data) const;
 
     protected:
-        std::shared_ptr<caffe::Net<float> > m_net;
+        std::shared_ptr<InferenceBackend> m_net;
         int m_num_channels;
         cv::Size m_input_size;
-        cv::Mat m_mean;
+        cv::Mat m_mean;     ///< Mean image in the input layer's planar layout [(C * H) x W]
         bool m_with_gpu;
     };
 
@@ -9,7 +9,7 @@ class FaceServices2;
 namespace face_swap
 {
 	/**	This class provided face shape, texture, expression and pose estimations using
-	Caffe with a convolutional neural network.
+	a convolutional neural network, run by an inference backend (see InferenceBackend).
 	The CNN estimates shape and texture coefficients for a PCA model that is based on
 	Basel's 3D Morphable Model. The pose and expression are then estimated using epnp
 	optimization. This is an implementation of the following papers:
@@ -31,11 +31,13 @@ namespace face_swap
 		@param with_expr Toggle fitting face expressions.
 		@param with_gpu Toggle GPU\CPU execution.
 		@param gpu_device_id Set the GPU's device id.
+		@param inference_backend The inference backend's name (see InferenceBackend::create).
 		*/
         CNN3DMMExpr(const std::string& deploy_file, const std::string& caffe_model_file,
             const std::string& mean_file, const std::string& model_file,
             bool generic = false, bool with_expr = true,
-			bool with_gpu = true, int gpu_device_id = 0);
+			bool with_gpu = true, int gpu_device_id = 0,
+			const std::string& inference_backend = "caffe");
 
 		/** Destructor.
 		*/
@@ -0,0 +1,32 @@
+/** @file
+@brief Neural network utility functions.
+*/
+
+#ifndef FACE_SWAP_CNN_UTILITIES_H
+#define FACE_SWAP_CNN_UTILITIES_H
+
+#include "face_swap/face_swap_export.h"
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_swap
+{
+	/**	Convert an image to the planar, mean subtracted floating point input of a network.
+	The image is read in a single pass and written directly to the blob, in NCHW
+	layout, without intermediate buffers. BGR and BGRA images are converted to 3 channels
+	and grayscale images to 1 channel, other combinations are converted with cv::cvtColor first.
+	@param[in] img The image [CV_8UC1, CV_8UC3 or CV_8UC4], of any stride.
+	It must already have the network's input size.
+	@param[out] blob Output blob data, must hold channels * img.total() floats.
+	@param[in] channels The number of channels of the blob (1 or 3).
+	@param[in] mean_color Mean color subtracted from all the pixels.
+	@param[in] mean Optional mean image in the blob's planar layout,
+	subtracted from the pixels in addition to the mean color.
+	*/
+	FACE_SWAP_EXPORT void imageToBlob(const cv::Mat& img, float* blob, int channels,
+		const cv::Scalar& mean_color = cv::Scalar(), const float* mean = nullptr);
+
+}   // namespace face_swap
+
+#endif	// FACE_SWAP_CNN_UTILITIES_H
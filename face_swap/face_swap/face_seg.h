@@ -2,20 +2,19 @@
 #define FACE_SWAP_FACE_SEG_H
 
 #include "face_swap/face_swap_export.h"
+#include "face_swap/inference_backend.h"
 
 // std
 #include <string>
+#include <vector>
 
 // OpenCV
 #include <opencv2/core.hpp>
 
-// Caffe
-#include <caffe/caffe.hpp>
-
 namespace face_swap
 {
-	/**	This class provided deep face segmentation using Caffe with a fully connected
-		convolutional neural network.
+	/**	This class provided deep face segmentation using a fully connected
+		convolutional neural network, run by an inference backend (see InferenceBackend).
 	*/
     class FACE_SWAP_EXPORT FaceSeg
     {
@@ -26,11 +25,16 @@ namespace face_swap
 			@param with_gpu Toggle GPU\CPU.
 			@param gpu_device_id Set the GPU's device id.
 			@param scale Scale image to the network's maximum size (depicted by the prototxt file).
-			@param postprocess_seg Toggle postprocessing of the segmentation.
+			@param postprocess_seg Toggle smoothing of the segmentation's flaws (see smoothFlaws).
+			@param cleanup_seg Toggle removal of all but the largest face component and filling of
+			the holes in it (see postprocessSegmentation). Occluders enclosed by the face, such as
+			a microphone in front of the mouth, are filled as face, so this is disabled by default.
+			@param inference_backend The inference backend's name (see InferenceBackend::create).
 		*/
 		FaceSeg(const std::string& deploy_file, const std::string& model_file,
             bool with_gpu = true, int gpu_device_id = 0,
-			bool scale = true, bool postprocess_seg = false);
+			bool scale = true, bool postprocess_seg = false, bool cleanup_seg = false,
+			const std::string& inference_backend = "caffe");
 
         ~FaceSeg();
 
@@ -41,35 +45,33 @@ namespace face_swap
 		*/
         cv::Mat process(const cv::Mat& img);
 
-    private:
-
-		/** Wrap the input layer of the network in separate cv::Mat objects
-			(one per channel). This way we save one memcpy operation and we
-			don't need to rely on cudaMemcpy2D. The last preprocessing operation 
-			will write the separate channels directly to the input layer.
-			@param input_channels Input image channels.
+		/**	Do face segmentation of multiple images in a single forward pass.
+			All the images are packed into one batch, at the network's input size or, if
+			scaling is disabled, at the size of the largest image, smaller images are padded.
+			@param imgs BGR color images.
+			@return 8-bit segmentation masks, one for each image, 255 for face
+			pixels and 0 for background pixels.
 		*/
-        void wrapInputLayer(std::vector<cv::Mat>& input_channels);
+        std::vector<cv::Mat> process(const std::vector<cv::Mat>& imgs);
+
+    private:
 
 		/**	Preprocess image for network.
+			The mean subtracted channels are written directly to the input layer.
 			@param img BGR color image.
-			@param input_channels Input image channels.
-		*/
-        void preprocess(const cv::Mat& img, std::vector<cv::Mat>& input_channels);
-
-		/**	Substract mean color from image.
-			@param img BGR float image.
+			@param size The network's input size.
+			@param input_data The image's position in the input layer.
 		*/
-        void subtractMean_c3(cv::Mat& img);
+        void preprocess(const cv::Mat& img, const cv::Size& size, float* input_data);
 
     protected:
-        std::shared_ptr<caffe::Net<float>> m_net;
+        std::shared_ptr<InferenceBackend> m_net;
         int m_num_channels;
         cv::Size m_input_size;
         bool m_with_gpu;
 		bool m_scale;
 		bool m_postprocess_seg;
-		int m_foreground_channel = 1;
+		bool m_cleanup_seg;
 
 		// Mean pixel color
 		const float MB = 104.00699f, MG = 116.66877f, MR = 122.67892f;
@@ -3,6 +3,7 @@
 
 #include "face_swap/face_swap_export.h"
 #include "face_swap/basel_3dmm.h"
+#include "face_swap/blending_utilities.h"
 
 // std
 #include <memory>
@@ -13,6 +14,8 @@
 
 namespace face_swap
 {
+	class RenderBackend;
+
 	struct FaceData
 	{
 		// Input
@@ -49,9 +52,11 @@ namespace face_swap
 		/**	Transfer the face in the source image onto the face in the target image.
 		@param[in] src_data Includes all the images and intermediate data for the specific face.
 		@param[in] tgt_data Includes all the images and intermediate data for the specific face.
+		@param[in] blend_mode The method for blending the rendered face into the target image.
 		@return The output face swapped image.
 		*/
-		virtual cv::Mat swap(FaceData& src_data, FaceData& tgt_data) = 0;
+		virtual cv::Mat swap(FaceData& src_data, FaceData& tgt_data,
+			BlendMode blend_mode = BLEND_POISSON) = 0;
 
 		/** Process a single image and save the intermediate face data.
 		@param[in] face_data Includes all the images and intermediate data for the specific face.
@@ -62,6 +67,21 @@ namespace face_swap
 
 		virtual cv::Mat renderFaceData(const FaceData& face_data, float scale = 1.0f) = 0;
 
+		/** Set the backend used for rendering the swapped faces.
+		@param[in] backend The render backend (see RenderBackend::create).
+		*/
+		virtual void setRenderBackend(const std::shared_ptr<RenderBackend>& backend) = 0;
+
+		/** Toggle temporal blending for consecutive video frames.
+		When enabled, the Poisson blending of each swap starts from the previous
+		swap's result, warped by the motion of the target landmarks, so only a few
+		iterations are needed and the blending doesn't flicker between frames.
+		Calling this function also discards the previous result, so it should be
+		called at the start of each video.
+		@param[in] enable Toggle temporal blending.
+		*/
+		virtual void setTemporalBlending(bool enable) = 0;
+
 		/**	Construct FaceSwapEngine instance.
 		@param landmarks_path Path to the landmarks model file.
 		@param model_3dmm_h5_path Path to 3DMM file (.h5).
@@ -75,6 +95,10 @@ namespace face_swap
 		@param with_expr Toggle fitting face expressions.
 		@param with_gpu Toggle GPU\CPU execution.
 		@param gpu_device_id Set the GPU's device id.
+		@param inference_backend The backend running the CNNs: "caffe" or "opencv"
+		(see InferenceBackend::create).
+		@param reg_calib_path Path to 3DMM regression CNN INT8 calibration file (.binaryproto),
+		if specified the CNN is quantized (see CNN3DMM::quantize).
 		*/
 		static std::shared_ptr<FaceSwapEngine> createInstance(
 			const std::string& landmarks_path, const std::string& model_3dmm_h5_path,
@@ -82,7 +106,8 @@ namespace face_swap
 			const std::string& reg_deploy_path, const std::string& reg_mean_path,
 			const std::string& seg_model_path, const std::string& seg_deploy_path,
 			bool generic = false, bool with_expr = true, bool with_gpu = true,
-			int gpu_device_id = 0);
+			int gpu_device_id = 0, const std::string& inference_backend = "caffe",
+			const std::string& reg_calib_path = std::string());
 	};
 
 }   // namespace face_swap
@@ -6,9 +6,12 @@
 #include "face_swap/basel_3dmm.h"
 #include "face_swap/face_detection_landmarks.h"
 #include "face_swap/face_seg.h"
+#include "face_swap/render_utilities.h"
+#include "face_swap/render_backend.h"
 
 // std
 #include <memory>
+#include <vector>
 
 
 namespace face_swap
@@ -24,14 +27,17 @@ namespace face_swap
 			const std::string& reg_deploy_path, const std::string& reg_mean_path,
 			const std::string& seg_model_path, const std::string& seg_deploy_path,
 			bool generic = false, bool with_expr = true, bool with_gpu = true,
-			int gpu_device_id = 0);
+			int gpu_device_id = 0, const std::string& inference_backend = "caffe",
+			const std::string& reg_calib_path = std::string());
 
 		/**	Transfer the face in the source image onto the face in the target image.
 		@param[in] src_data Includes all the images and intermediate data for the specific face.
 		@param[in] tgt_data Includes all the images and intermediate data for the specific face.
+		@param[in] blend_mode The method for blending the rendered face into the target image.
 		@return The output face swapped image.
 		*/
-		cv::Mat swap(FaceData& src_data, FaceData& tgt_data);
+		cv::Mat swap(FaceData& src_data, FaceData& tgt_data,
+			BlendMode blend_mode = BLEND_POISSON);
 
 		/** Process a single image and save the intermediate face data.
 		@param[in] face_data Includes all the images and intermediate data for the specific face.
@@ -42,6 +48,16 @@ namespace face_swap
 
 		cv::Mat renderFaceData(const FaceData& img_data, float scale = 1.0f);
 
+		/** Set the backend used for rendering the swapped faces.
+		@param[in] backend The render backend (see RenderBackend::create).
+		*/
+		void setRenderBackend(const std::shared_ptr<RenderBackend>& backend);
+
+		/** Toggle temporal blending for consecutive video frames.
+		@param[in] enable Toggle temporal blending.
+		*/
+		void setTemporalBlending(bool enable);
+
 	private:
 
 		/** Crops the image and it's corresponding segmentation according
@@ -51,13 +67,103 @@ namespace face_swap
 		*/
 		bool preprocessImages(FaceData& face_data);
 
+		/** Preprocess the faces and compute the segmentations of those that
+		need one, as process would, in a single batched forward pass.
+		@param[in] faces The faces' image and intermediate data.
+		*/
+		void segmentFaces(const std::vector<FaceData*>& faces);
+
+		/** Identity mesh cached by the shape coefficients it was sampled from.
+		*/
+		struct IdentityCache
+		{
+			const Basel3DMM* model = nullptr;
+			cv::Mat shape_coefficients;
+			cv::Mat vertices;
+		};
+
+		/** Sample the vertices of a mesh, reusing the cached identity mesh if
+		the shape coefficients did not change since the last call.
+		@param[in] model The 3DMM to sample from.
+		@param[in] shape_coefficients PCA shape coefficients.
+		@param[in] expr_coefficients PCA expression coefficients.
+		@param[in,out] cache The identity cache to use.
+		@param[out] mesh The output mesh.
+		*/
+		void sampleVertices(const Basel3DMM& model, const cv::Mat& shape_coefficients,
+			const cv::Mat& expr_coefficients, IdentityCache& cache, Mesh& mesh);
+
+		/** Source texture atlas cached by copies of the face data and mesh it was
+		generated from, so changes made in place to the source are detected.
+		*/
+		struct AtlasCache
+		{
+			const Basel3DMM* model = nullptr;
+			bool flipped = false;
+			cv::Mat img, seg;
+			cv::Mat shape_coefficients, expr_coefficients;
+			cv::Mat vecR, vecT, K;
+			cv::Mat tex;
+		};
+
+		/** Generate the texture atlas of the source mesh, reusing the cached atlas
+		if the contents of the source's cropped image and segmentation, the model, the
+		coefficients and the camera did not change since the last call.
+		@param[in] model The 3DMM to sample the source mesh from.
+		@param[in] src_data The source face data.
+		@param[in] flipped Toggle using the horizontally flipped source, the flipped
+		image is only created if the atlas is not cached.
+		@return The texture atlas.
+		*/
+		const cv::Mat& sourceAtlas(const Basel3DMM& model, const FaceData& src_data, bool flipped);
+
+		/** Blended region of the previous swap, for temporal blending.
+		*/
+		struct TemporalBlendState
+		{
+			cv::Mat blended;						///< The blended image inside roi.
+			cv::Rect roi;							///< The mask's bounding box.
+			cv::Size img_size;						///< The size of the target image.
+			std::vector<cv::Point2f> landmarks;		///< The target landmarks.
+		};
+
+		/** Warp the previous swap's blended region to the current target as
+		the initial guess for the Poisson blending.
+		@param[in] tgt_data The target face data.
+		@param[in] roi The current mask's bounding box.
+		@param[out] guess The initial guess, only the pixels inside roi are written.
+		@return true if the previous swap is compatible with the current target and the
+		landmarks moved by a similarity transform, up to TEMPORAL_BLEND_MAX_LANDMARKS_ERROR.
+		*/
+		bool temporalBlendGuess(const FaceData& tgt_data, const cv::Rect& roi, cv::Mat& guess);
+
+		/** Select the level of detail to render a face with.
+		@param bbox The face's bounding box in the rendered image.
+		@return The coarsest level with enough faces for the bounding box area.
+		*/
+		const Basel3DMM& selectLOD(const cv::Rect& bbox) const;
+
 	private:
 		//std::shared_ptr<sfl::SequenceFaceLandmarks> m_sfl;
 		std::shared_ptr<FaceDetectionLandmarks> m_lms;
 		std::unique_ptr<CNN3DMMExpr> m_cnn_3dmm_expr;
 		std::unique_ptr<Basel3DMM> m_basel_3dmm;
+		std::unique_ptr<Basel3DMM> m_basel_3dmm_face;	///< Face region of m_basel_3dmm.
+		std::vector<Basel3DMM> m_basel_3dmm_lods;		///< Levels of detail of m_basel_3dmm_face, finest first.
 		std::unique_ptr<FaceSeg> m_face_seg;
 
+		// Reusable mesh buffers
+		Mesh m_src_mesh, m_tgt_mesh;
+		cv::Mat m_src_face_normals;
+		IdentityCache m_src_identity, m_tgt_identity;
+		AtlasCache m_src_atlas;
+		cv::Mat m_flipped_src_img, m_flipped_src_seg;
+		RenderContext m_render_ctx;
+		cv::Mat m_tgt_coverage;
+		std::shared_ptr<RenderBackend> m_render_backend;
+		bool m_temporal_blending = false;
+		TemporalBlendState m_prev_blend;
+
 		bool m_with_gpu;
 		int m_gpu_device_id;
 	};
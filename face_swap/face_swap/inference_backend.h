@@ -0,0 +1,92 @@
+/** @file
+@brief Interchangeable neural network inference implementations.
+*/
+
+#ifndef FACE_SWAP_INFERENCE_BACKEND_H
+#define FACE_SWAP_INFERENCE_BACKEND_H
+
+#include "face_swap/face_swap_export.h"
+
+// std
+#include <memory>
+#include <string>
+#include <vector>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_swap
+{
+	/** Neural network inference interface.
+	All the backends load the same Caffe network files (.prototxt and .caffemodel)
+	with a single input blob in NCHW layout. The input is written directly to the
+	backend's input buffer, see imageToBlob.
+	*/
+	class FACE_SWAP_EXPORT InferenceBackend
+	{
+	public:
+		virtual ~InferenceBackend() {}
+
+		/** Get the shape of the input blob [N, C, H, W].
+		*/
+		virtual std::vector<int> inputShape() const = 0;
+
+		/** Reshape the input blob, the change is forwarded to all the layers.
+		The input buffer is only reallocated if the shape changed.
+		@param shape The new input shape [N, C, H, W].
+		*/
+		virtual void reshapeInput(const std::vector<int>& shape) = 0;
+
+		/** Get the input buffer, it holds the product of inputShape() floats.
+		The pointer is valid until the next call to reshapeInput.
+		*/
+		virtual float* inputData() = 0;
+
+		/** Run the network on the input buffer.
+		@param output_name The name of the blob to output, if empty the network's output is used.
+		@return The output blob [CV_32F] with as many dimensions as the blob's shape.
+		It may refer to the backend's memory, which is only valid until the next forward pass.
+		*/
+		virtual cv::Mat forward(const std::string& output_name = std::string()) = 0;
+
+		/** Quantize the network to 8-bit integer weights and activations.
+		The activation ranges are calibrated by running the network on the calibration
+		inputs. The input and output blobs remain floating point, but only the network's
+		outputs can be requested from forward afterwards.
+		@param calib_data Calibration input blobs, each in the input blob's shape.
+		@return false if the backend doesn't support quantization.
+		*/
+		virtual bool quantize(const std::vector<cv::Mat>& calib_data) { return false; }
+
+		/** Get the name of the backend.
+		*/
+		virtual std::string name() const = 0;
+
+		/** Create an inference backend by name.
+		@param name The backend's name: "caffe" or "opencv" (requires building with WITH_OPENCV_DNN).
+		The Caffe backend selects the device for the whole thread while the OpenCV backend
+		keeps all its state in the instance, so instances can run concurrently from different threads.
+		@param deploy_file Network definition file for deployment (.prototxt).
+		@param model_file Network weights model file (.caffemodel).
+		@param with_gpu Toggle GPU\CPU execution, the OpenCV backend uses OpenCL for the GPU.
+		@param gpu_device_id Set the GPU's device id.
+		@return The backend or nullptr if it's not available in this build.
+		*/
+		static std::shared_ptr<InferenceBackend> create(const std::string& name,
+			const std::string& deploy_file, const std::string& model_file,
+			bool with_gpu = false, int gpu_device_id = 0);
+
+		/** Get the names of the backends available in this build.
+		*/
+		static std::vector<std::string> available();
+	};
+
+	/** Read the input shape [N, C, H, W] of a Caffe network definition file (.prototxt).
+	The shape may be given by input_shape, input_dim or an Input layer.
+	@param deploy_file Network definition file for deployment (.prototxt).
+	*/
+	FACE_SWAP_EXPORT std::vector<int> readCaffeInputShape(const std::string& deploy_file);
+
+}   // namespace face_swap
+
+#endif // FACE_SWAP_INFERENCE_BACKEND_H
@@ -0,0 +1,61 @@
+/** @file
+@brief Mesh topology utility functions.
+*/
+
+#ifndef FACE_SWAP_MESH_UTILITIES_H
+#define FACE_SWAP_MESH_UTILITIES_H
+
+#include "face_swap/face_swap_export.h"
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_swap
+{
+	/** Vertex to face adjacency of a triangle mesh in compressed sparse row format.
+	The faces adjacent to vertex i are face_indices[offsets[i]] to
+	face_indices[offsets[i + 1] - 1].
+	*/
+	struct FACE_SWAP_EXPORT MeshAdjacency
+	{
+		/** Build the vertex to face adjacency of a triangle mesh.
+		@param faces Triangle vertex indices [F x 3, CV_16U].
+		@param total_vertices The number of vertices in the mesh.
+		*/
+		static MeshAdjacency create(const cv::Mat& faces, int total_vertices);
+
+		cv::Mat offsets;		///< Per-vertex offsets into face_indices [N + 1, CV_32S].
+		cv::Mat face_indices;	///< Adjacent face indices [3F, CV_32S].
+	};
+
+	/** Simplify a triangle mesh by quadric error metric edge collapses.
+	Based on the paper:
+	Surface Simplification Using Quadric Error Metrics,
+	M. Garland and P. S. Heckbert.
+	Each edge is collapsed onto one of its end points (half edge collapse), so
+	the vertices of the simplified mesh are a subset of the input vertices.
+	Collapses that would flip a face or break the manifold connectivity are
+	rejected and boundary edges are preserved.
+	@param vertices Mesh vertices [N x 3, CV_32F].
+	@param faces Triangle vertex indices [F x 3, CV_16U].
+	@param target_faces The number of faces to simplify the mesh to.
+	@param out_faces Output faces [F' x 3, CV_16U] indexing the input vertices.
+	*/
+	FACE_SWAP_EXPORT void decimateMesh(const cv::Mat& vertices, const cv::Mat& faces,
+		int target_faces, cv::Mat& out_faces);
+
+	/** Generate texture atlas coordinates by a cylindrical projection of a face mesh.
+	The cylinder's axis is vertical (y) and placed behind the front of the mesh
+	by half its width. The coordinates are scaled to fill [margin, 1 - margin].
+	The projection folds over where the surface turns away from the axis, such as
+	under the nose and the chin, see generateTextureAtlas for how overlaps are resolved.
+	@param vertices Mesh vertices [N x 3, CV_32F].
+	@param uv Output texture coordinates [N x 2, CV_32F].
+	@param margin The margin to leave around the coordinates.
+	*/
+	FACE_SWAP_EXPORT void generateCylindricalUV(const cv::Mat& vertices, cv::Mat& uv,
+		float margin = 0.01f);
+
+}   // namespace face_swap
+
+#endif	// FACE_SWAP_MESH_UTILITIES_H
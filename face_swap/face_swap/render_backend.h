@@ -0,0 +1,60 @@
+/** @file
+@brief Interchangeable mesh rendering implementations.
+*/
+
+#ifndef FACE_SWAP_RENDER_BACKEND_H
+#define FACE_SWAP_RENDER_BACKEND_H
+
+#include "face_swap/render_utilities.h"
+
+// std
+#include <memory>
+#include <string>
+#include <vector>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_swap
+{
+	/** Mesh rendering interface.
+	All the backends produce the same output as renderMesh: the mesh is rendered
+	into the image and its depth map is stored in the render context.
+	*/
+	class FACE_SWAP_EXPORT RenderBackend
+	{
+	public:
+		virtual ~RenderBackend() {}
+
+		/** @brief Render a textured mesh.
+		All the polygons must be triangles. The texture can be either in BGR or BGRA format.
+		@param img The image to render the mesh to.
+		@param mesh The mesh to render.
+		@param rvec Euler angles (Pitch, Yaw, Roll) [3x1].
+		@param tvec translation vector [3x1].
+		@param K Intrinsic camera matrix [3x3].
+		@param ctx Render context, the output depth map is stored in ctx.depthbuf.
+		@param antialias The antialiasing mode, backends that don't support it ignore it.
+		*/
+		virtual void renderMesh(cv::Mat& img, const Mesh& mesh,
+			const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+			RenderContext& ctx, AntialiasMode antialias = ANTIALIAS_NONE) = 0;
+
+		/** Get the name of the backend.
+		*/
+		virtual std::string name() const = 0;
+
+		/** Create a render backend by name.
+		@param name The backend's name: "cpu" or "osmesa" (requires building with WITH_OSMESA).
+		@return The backend or nullptr if it's not available in this build.
+		*/
+		static std::shared_ptr<RenderBackend> create(const std::string& name = "cpu");
+
+		/** Get the names of the backends available in this build.
+		*/
+		static std::vector<std::string> available();
+	};
+
+}   // namespace face_swap
+
+#endif // FACE_SWAP_RENDER_BACKEND_H
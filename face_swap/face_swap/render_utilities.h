@@ -3,9 +3,67 @@
 
 #include "face_swap/face_swap_engine.h"
 #include <opencv2/core.hpp>
+#include <vector>
 
 namespace face_swap
 {
+	/** @brief Get a view of a reusable buffer.
+	The buffer is reallocated only if it is smaller than the view or of a different
+	type, otherwise the view is its top left part.
+	@param buf The backing buffer.
+	@param size The size of the view.
+	@param type The type of the view.
+	@return The view, it is continuous only if it is as wide as the buffer.
+	*/
+	FACE_SWAP_EXPORT cv::Mat bufferView(cv::Mat& buf, const cv::Size& size, int type);
+
+	/** Antialiasing modes of renderMesh.
+	*/
+	enum AntialiasMode
+	{
+		ANTIALIAS_NONE,		///< Only the pixel centers are tested for coverage.
+		/** The coverage of each pixel is estimated from 4 samples during rasterization
+		and partially covered pixels are blended with the image.
+		*/
+		ANTIALIAS_COVERAGE
+	};
+
+	/// Coarsest texture mipmap level used by renderMesh
+	const int MAX_MIPMAP_LEVEL = 7;
+
+	/** @brief Buffers used for rendering meshes.
+	Keeping a context between calls to renderMesh allows the buffers to be reused.
+	The image and vertex buffers are views of backing buffers (see bufferView), which
+	are only reallocated when the image size or the number of vertices grows. The
+	texture's mipmaps are kept with a copy of the texture they were built from, and
+	only rebuilt when the texture's contents change.
+	*/
+	struct FACE_SWAP_EXPORT RenderContext
+	{
+		cv::Mat depthbuf;						///< Depth buffer of the last rendering [CV_32F]
+		cv::Mat vertices_proj;					///< Projected vertices [N x 2]
+		cv::Mat vertices_depth;					///< Vertices depth [N x 1]
+		cv::Mat depthbuf_storage;				///< Backing buffer of depthbuf
+		cv::Mat vertices_proj_storage;			///< Backing buffer of vertices_proj
+		cv::Mat vertices_depth_storage;			///< Backing buffer of vertices_depth
+		cv::Mat uvbuf;							///< Texture coordinates backing buffer [CV_32FC2]
+		cv::Mat coveragebuf;					///< Antialiasing sample masks backing buffer [CV_8U]
+		cv::Mat levelbuf;						///< Texture mipmap level backing buffer [CV_8U]
+		cv::Mat mipmaps[MAX_MIPMAP_LEVEL + 1];	///< Texture mipmaps in BGRA format with premultiplied alpha
+		cv::Mat mipmaps_tex;					///< The texture the mipmaps were built from
+		int mipmaps_level = -1;					///< The coarsest mipmap level built, -1 if none
+		std::vector<unsigned char> face_visible;///< Per face visibility flags
+		std::vector<int> faces_visible;			///< Visible faces in storage order
+		std::vector<float> faces_depth;			///< Mean depth of the visible faces
+		std::vector<int> face_buckets;			///< Depth bucket of the visible faces
+		std::vector<int> bucket_offsets;		///< Depth buckets offsets
+		std::vector<int> visible;				///< Visible faces ordered from front to back
+		std::vector<cv::Rect> tri_bboxes;		///< Bounding boxes of the visible faces
+		std::vector<int> tile_offsets;			///< Offsets of each tile in tile_tris
+		std::vector<int> tile_tris;				///< Visible faces binned by tile
+		std::vector<int> tile_pos;				///< Tile binning positions
+	};
+
 	FACE_SWAP_EXPORT void renderWireframe(cv::Mat& img, const Mesh& mesh, const cv::Mat& P,
         float scale = 1, const cv::Scalar& color = cv::Scalar(0, 255, 0));
 
@@ -31,10 +89,57 @@ namespace face_swap
 	@param tvec translation vector [3x1].
 	@param K Intrinsic camera matrix [3x3].
 	@param depth Output depth map (same size as img, in floating point format).
+	@param antialias The antialiasing mode.
+	*/
+	FACE_SWAP_EXPORT void renderMesh(cv::Mat& img, const Mesh& mesh,
+		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+		cv::Mat& depthbuf, AntialiasMode antialias = ANTIALIAS_NONE);
+
+	/** @brief Render a textured mesh using the buffers of a render context.
+	All the polygons must be triangles. The texture can be either in BGR or BGRA format.
+	@param img The image to render the mesh to.
+	@param mesh The mesh to render.
+	@param rvec Euler angles (Pitch, Yaw, Roll) [3x1].
+	@param tvec translation vector [3x1].
+	@param K Intrinsic camera matrix [3x3].
+	@param ctx Render context, the output depth map is stored in ctx.depthbuf.
+	@param antialias The antialiasing mode.
 	*/
 	FACE_SWAP_EXPORT void renderMesh(cv::Mat& img, const Mesh& mesh,
 		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
-		cv::Mat& depthbuf, int ss = 1);
+		RenderContext& ctx, AntialiasMode antialias = ANTIALIAS_NONE);
+
+	/** @brief Render the coverage mask of a mesh.
+	Only the coverage is rasterized, without depth, texture coordinates or colors.
+	All the polygons must be triangles.
+	@param mask Output mask [CV_8U], 255 for covered pixels and 0 elsewhere.
+	If bit_packed is true, each row holds (size.width + 7) / 8 bytes and pixel x
+	is bit (x % 8) of byte (x / 8).
+	@param size The size of the image to render the mesh to.
+	@param mesh The mesh to render.
+	@param rvec Euler angles (Pitch, Yaw, Roll) [3x1].
+	@param tvec translation vector [3x1].
+	@param K Intrinsic camera matrix [3x3].
+	@param ctx Render context.
+	@param bit_packed Toggle packing 8 pixels per byte.
+	*/
+	FACE_SWAP_EXPORT void renderMeshMask(cv::Mat& mask, const cv::Size& size, const Mesh& mesh,
+		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+		RenderContext& ctx, bool bit_packed = false);
+
+	/** @brief Render the depth map of a mesh.
+	Only the depth is rasterized, without texture coordinates or colors.
+	All the polygons must be triangles.
+	@param size The size of the image to render the mesh to.
+	@param mesh The mesh to render.
+	@param rvec Euler angles (Pitch, Yaw, Roll) [3x1].
+	@param tvec translation vector [3x1].
+	@param K Intrinsic camera matrix [3x3].
+	@param ctx Render context, the output depth map is stored in ctx.depthbuf
+	and the projected vertices and their depth in ctx.vertices_proj and ctx.vertices_depth.
+	*/
+	FACE_SWAP_EXPORT void renderMeshDepth(const cv::Size& size, const Mesh& mesh,
+		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K, RenderContext& ctx);
 
 	/** @brief Render depth map.
 	The depth values are inversed and rendered as a heat map, hotter values correspond to closer pixels.
@@ -71,6 +176,27 @@ namespace face_swap
 
 	FACE_SWAP_EXPORT cv::Mat computeVertexNormals(const Mesh& mesh);
 
+	/** @brief Compute the unit face normals of a mesh in structure of arrays layout.
+	The normals are (v3 - v1) x (v2 - v1), so for the Basel meshes they point into
+	the mesh.
+	@param mesh The mesh to compute the normals for.
+	@param face_normals Output face normals [3 x F], the rows are the x, y and z
+	components. The buffer is reused if it's already allocated.
+	*/
+	FACE_SWAP_EXPORT void computeFaceNormals(const Mesh& mesh, cv::Mat& face_normals);
+
+	/** @brief Compute the unit vertex normals of a mesh.
+	Each vertex normal is the normalized sum of its adjacent face normals. The
+	output buffers are reused if they are already allocated.
+	@param mesh The mesh to compute the normals for.
+	@param adjacency Vertex to face adjacency of the mesh's faces, for a fixed
+	topology such as Basel3DMM::adjacency it only has to be built once.
+	@param vertex_normals Output vertex normals [N x 3].
+	@param face_normals Output face normals [3 x F], see computeFaceNormals.
+	*/
+	FACE_SWAP_EXPORT void computeVertexNormals(const Mesh& mesh, const MeshAdjacency& adjacency,
+		cv::Mat& vertex_normals, cv::Mat& face_normals);
+
 }   // namespace face_swap
 
 #endif // FACE_SWAP_RENDER_UTILITIES_H
@@ -22,6 +22,19 @@ namespace face_swap
 		bool holes = true, bool smooth = true, int smooth_iterations = 1,
 		int smooth_kernel_radius = 2);
 
+	/**	Upsample a segmentation by thresholding the bilinear interpolation of its scores.
+	The boundary therefore follows the zero crossing of the scores between pixels instead
+	of the blocky edges of nearest neighbor interpolation. Where the segmentation
+	disagrees with the sign of the scores, such as after postprocessing, the
+	segmentation takes precedence.
+	@param seg The segmentation [CV_8U], non-zero for foreground pixels.
+	@param scores Foreground scores [CV_32F], same size as seg, positive for foreground.
+	@param size The output size.
+	@param out The upsampled segmentation [CV_8U], 255 for foreground pixels and 0 elsewhere.
+	*/
+	FACE_SWAP_EXPORT void upsampleSegmentation(const cv::Mat& seg, const cv::Mat& scores,
+		const cv::Size& size, cv::Mat& out);
+
 }   // namespace face_swap
 
 #endif	// FACE_SWAP_SEGMENTATION_UTILITIES_H
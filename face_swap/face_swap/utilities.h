@@ -3,6 +3,7 @@
 
 #include "face_swap/render_utilities.h"
 #include "face_swap/basel_3dmm.h"
+#include "face_swap/blending_utilities.h"
 #include <opencv2/core.hpp>
 
 namespace face_swap
@@ -29,6 +30,33 @@ namespace face_swap
 	FACE_SWAP_EXPORT cv::Mat createPerspectiveProj3x4(const cv::Mat& euler,
         const cv::Mat& translation, const cv::Mat& K);
 
+	/**	Create a perspective projection matrix in a fixed size matrix, without allocating.
+	@param[in] euler Euler angles (Pitch, Yaw, Roll) [3x1].
+	@param[in] translation Translation vector [3x1].
+	@param[in] K Intrinsic camera matrix [3x3].
+	@param[out] P Perspective projection matrix.
+	*/
+	FACE_SWAP_EXPORT void createPerspectiveProj3x4(const cv::Mat& euler,
+		const cv::Mat& translation, const cv::Mat& K, cv::Matx34f& P);
+
+	/**	Project vertices to the image plane in a single pass.
+	@param[in] vertices The vertices to project [N x 3, CV_32F].
+	@param[in] P Perspective projection matrix [3 x 4].
+	@param[out] proj If not null, the projected image points [N x 2, CV_32F].
+	@param[out] depth If not null, the depth of each vertex [N x 1, CV_32F].
+	@param[out] uv If not null, the projected points normalized by uv_size,
+	to be used as texture coordinates [N x 2, CV_32F].
+	@param[in] uv_size The image size that the texture coordinates will be
+	relative to.
+	*/
+	FACE_SWAP_EXPORT void projectVertices(const cv::Mat& vertices, const cv::Mat& P,
+		cv::Mat* proj, cv::Mat* depth = nullptr, cv::Mat* uv = nullptr,
+		const cv::Size& uv_size = cv::Size());
+
+	FACE_SWAP_EXPORT void projectVertices(const cv::Mat& vertices, const cv::Matx34f& P,
+		cv::Mat* proj, cv::Mat* depth = nullptr, cv::Mat* uv = nullptr,
+		const cv::Size& uv_size = cv::Size());
+
 	FACE_SWAP_EXPORT cv::Mat refineMask(const cv::Mat& img, const cv::Mat& mask);
 
 	FACE_SWAP_EXPORT void horFlipLandmarks(std::vector<cv::Point>& landmarks, int width);
@@ -49,6 +77,31 @@ namespace face_swap
 		const cv::Mat& vecR, const cv::Mat& vecT, const cv::Mat& K,
 		cv::Mat& tex, cv::Mat& uv);
 
+	/**	Generate a fixed size texture atlas for the mesh from an image.
+	Each texel of the atlas is mapped to a point on the mesh by the atlas
+	coordinates, and its color is sampled from the projection of that point
+	in the image. Texels of points that are occluded in the image are transparent,
+	so the texture's size and content don't depend on the image's resolution.
+	Where the atlas coordinates fold over, the texels are taken from the most
+	frontal of the overlapping surfaces, by the interpolated vertex normals.
+	@param[in] mesh The mesh to generate the texture for. Its vertex normals
+	(see computeVertexNormals) are used if they are set, otherwise they are computed.
+	@param[in] atlas_uv Atlas texture coordinates of the mesh [N x 2, CV_32F].
+	@param[in] img The image for the texture [CV_8UC3].
+	@param[in] seg The segmentation for the texture (will be used as the
+	texture's alpha channel together with the visibility).
+	@param[in] vecR Mesh's rotation vector [Euler angles].
+	@param[in] vecT Mesh's translation vector.
+	@param[in] K Camera intrinsic parameters.
+	@param[in,out] ctx Render context used for rendering the mesh's depth in the image.
+	@param[out] tex Generated texture image [atlas_size x atlas_size, CV_8UC4].
+	@param[in] atlas_size The width and height of the texture.
+	*/
+	FACE_SWAP_EXPORT void generateTextureAtlas(const Mesh& mesh, const cv::Mat& atlas_uv,
+		const cv::Mat& img, const cv::Mat& seg,
+		const cv::Mat& vecR, const cv::Mat& vecT, const cv::Mat& K,
+		RenderContext& ctx, cv::Mat& tex, int atlas_size = 512);
+
 	/**	Generate texture coordinates for the mesh based on the image size,
 	intrinsic and extrinsic transformations.
 	@param[in] mesh The mesh to generate the texture coordinates for.
@@ -67,10 +120,13 @@ namespace face_swap
 	@param[in] src The source image.
 	@param[in] dst The destination image.
 	@param[in] mask Object segmentation mask.
+	@param[in] mode The blending method.
+	@param[in] mask_bbox The bounding box of the mask, computed from the mask if empty.
 	@return The src and dst blended image.
 	*/
 	FACE_SWAP_EXPORT cv::Mat blend(const cv::Mat& src, const cv::Mat& dst,
-		const cv::Mat& mask = cv::Mat());
+		const cv::Mat& mask = cv::Mat(), BlendMode mode = BLEND_POISSON,
+		const cv::Rect& mask_bbox = cv::Rect());
 
 	/**	Read saved face data.
 	@param[in] path Path to an image or a directory. If the path is an image,
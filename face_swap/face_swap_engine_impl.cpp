@@ -2,6 +2,9 @@
 #include "face_swap/utilities.h"
 #include "face_swap/landmarks_utilities.h"
 
+// iris_sfs
+#include <BaselFace.h>
+
 // std
 #include <limits>
 #include <iostream> // debug
@@ -9,23 +12,35 @@
 // OpenCV
 #include <opencv2/photo.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
 #include <opencv2/highgui.hpp>  // Debug
 
 namespace face_swap
 {
+	// Number of precomputed levels of detail
+	const int LOD_LEVELS = 5;
+
+	// Minimum number of mesh faces per pixel of the face's bounding box
+	const float LOD_FACES_PER_PIXEL = 0.5f;
+
+	// Maximum RMS error of the landmarks' motion model for temporal blending,
+	// relative to the width of the target face's bounding box
+	const float TEMPORAL_BLEND_MAX_LANDMARKS_ERROR = 0.02f;
+
 	std::shared_ptr<FaceSwapEngine> FaceSwapEngine::createInstance(
 		const std::string& landmarks_path, const std::string& model_3dmm_h5_path,
 		const std::string& model_3dmm_dat_path, const std::string& reg_model_path,
 		const std::string& reg_deploy_path, const std::string& reg_mean_path,
 		const std::string& seg_model_path, const std::string& seg_deploy_path,
-		bool generic, bool with_expr, bool with_gpu, int gpu_device_id)
+		bool generic, bool with_expr, bool with_gpu, int gpu_device_id,
+		const std::string& inference_backend, const std::string& reg_calib_path)
 	{
 		return std::make_shared<FaceSwapEngineImpl>(
 			landmarks_path, model_3dmm_h5_path,
 			model_3dmm_dat_path, reg_model_path,
 			reg_deploy_path, reg_mean_path,
 			seg_model_path, seg_deploy_path,
-			generic, with_expr, with_gpu, gpu_device_id);
+			generic, with_expr, with_gpu, gpu_device_id, inference_backend, reg_calib_path);
 	}
 
 	FaceSwapEngineImpl::FaceSwapEngineImpl(
@@ -33,7 +48,8 @@ namespace face_swap
 		const std::string& model_3dmm_dat_path, const std::string& reg_model_path,
 		const std::string& reg_deploy_path, const std::string& reg_mean_path,
 		const std::string& seg_model_path, const std::string& seg_deploy_path,
-		bool generic, bool with_expr, bool with_gpu, int gpu_device_id) :
+		bool generic, bool with_expr, bool with_gpu, int gpu_device_id,
+		const std::string& inference_backend, const std::string& reg_calib_path) :
 		m_with_gpu(with_gpu),
 		m_gpu_device_id(gpu_device_id)
 	{
@@ -46,121 +62,141 @@ namespace face_swap
 		// Initialize CNN 3DMM with exression
 		m_cnn_3dmm_expr = std::make_unique<CNN3DMMExpr>(
 			reg_deploy_path, reg_model_path, reg_mean_path, model_3dmm_dat_path,
-			generic, with_expr, with_gpu, gpu_device_id);
+			generic, with_expr, with_gpu, gpu_device_id, inference_backend);
+		if (!reg_calib_path.empty())
+			m_cnn_3dmm_expr->quantize(reg_calib_path);
 
 		// Initialize segmentation model
 		if (!(seg_model_path.empty() || seg_deploy_path.empty()))
 			m_face_seg = std::make_unique<FaceSeg>(seg_deploy_path,
-				seg_model_path, with_gpu, gpu_device_id, true, true);
+				seg_model_path, with_gpu, gpu_device_id, true, true, false, inference_backend);
+
+		// Initialize render backend
+		m_render_backend = RenderBackend::create();
 
 		// Load Basel 3DMM
 		m_basel_3dmm = std::make_unique<Basel3DMM>();
 		*m_basel_3dmm = Basel3DMM::load(model_3dmm_h5_path);
+
+		// Create the face region model used for swapping. The vertex mask is
+		// loaded with the 3DMM data file (.dat), if it doesn't match the
+		// vertices of the h5 model the full model is used instead
+		m_basel_3dmm_face = std::make_unique<Basel3DMM>();
+		int total_keep = BaselFace::BaselFace_keepV_h * BaselFace::BaselFace_keepV_w;
+		if (BaselFace::BaselFace_keepV != nullptr && total_keep == m_basel_3dmm->shapeMU.rows / 3)
+		{
+			cv::Mat keep_mask(total_keep, 1, CV_8S, BaselFace::BaselFace_keepV);
+			*m_basel_3dmm_face = m_basel_3dmm->submodel(keep_mask);
+		}
+		if (m_basel_3dmm_face->faces.empty())
+			*m_basel_3dmm_face = *m_basel_3dmm;
+
+		// Decimate the levels of detail up front so swapping a face never pays for it,
+		// each level halves the faces of the previous one
+		m_basel_3dmm_lods.reserve(LOD_LEVELS);
+		m_basel_3dmm_lods.push_back(*m_basel_3dmm_face);
+		for (int l = 1; l < LOD_LEVELS; ++l)
+			m_basel_3dmm_lods.push_back(m_basel_3dmm_lods.back().decimate(0.5f));
 	}
 
-	cv::Mat FaceSwapEngineImpl::swap(FaceData& src_data, FaceData& tgt_data)
+	cv::Mat FaceSwapEngineImpl::swap(FaceData& src_data, FaceData& tgt_data,
+		BlendMode blend_mode)
 	{
-		// Process images
+		// Process images, the source and target are segmented in a single batch
+		segmentFaces({ &src_data, &tgt_data });
 		process(src_data);
 		process(tgt_data);
 
 		// Check if horizontal flip is required
 		float src_angle = getFaceApproxHorAngle(src_data.cropped_landmarks);
 		float tgt_angle = getFaceApproxHorAngle(tgt_data.cropped_landmarks);
-		cv::Mat cropped_src, cropped_src_seg;
-		std::vector<cv::Point> cropped_src_landmarks = src_data.cropped_landmarks;
-		cv::Mat src_shape_coefficients, src_tex_coefficients, src_expr_coefficients;
-		cv::Mat src_vecR, src_vecT;
-		cv::Mat src_K = src_data.K;
-		if ((src_angle * tgt_angle) < 0 && std::abs(src_angle - tgt_angle) > (CV_PI / 18.0f) &&
-            std::abs(src_angle) > (CV_PI / 36.0f))
+		const bool flip = (src_angle * tgt_angle) < 0 && std::abs(src_angle - tgt_angle) > (CV_PI / 18.0f) &&
+            std::abs(src_angle) > (CV_PI / 36.0f);
+		if (flip && (src_data.shape_coefficients_flipped.empty() || src_data.expr_coefficients_flipped.empty()))
 		{
-			// Horizontal flip the source image
-			cv::flip(src_data.cropped_img, cropped_src, 1);
-			if (!src_data.cropped_seg.empty())
-				cv::flip(src_data.cropped_seg, cropped_src_seg, 1);
-
-			// Horizontal flip the source landmarks
-			horFlipLandmarks(cropped_src_landmarks, cropped_src.cols);
+			// Horizontal flip the source image and landmarks
+			cv::flip(src_data.cropped_img, m_flipped_src_img, 1);
+			std::vector<cv::Point> cropped_src_landmarks = src_data.cropped_landmarks;
+			horFlipLandmarks(cropped_src_landmarks, m_flipped_src_img.cols);
 
 			// Recalculate source coefficients
-			if (src_data.shape_coefficients_flipped.empty() || src_data.expr_coefficients_flipped.empty())
-			{
-				m_cnn_3dmm_expr->process(cropped_src, cropped_src_landmarks,
-					src_data.shape_coefficients_flipped,
-					src_data.tex_coefficients_flipped, src_data.expr_coefficients_flipped,
-					src_data.vecR_flipped, src_data.vecT_flipped, src_data.K);
-			}
-
-			src_shape_coefficients = src_data.shape_coefficients_flipped;
-			src_tex_coefficients = src_data.tex_coefficients_flipped;
-			src_expr_coefficients = src_data.expr_coefficients_flipped;
-			src_vecR = src_data.vecR_flipped;
-			src_vecT = src_data.vecT_flipped;
-		}
-		else
-		{
-			cropped_src = src_data.cropped_img;
-			cropped_src_seg = src_data.cropped_seg;
-			src_shape_coefficients = src_data.shape_coefficients;
-			src_tex_coefficients = src_data.tex_coefficients;
-			src_expr_coefficients = src_data.expr_coefficients;
-			src_vecR = src_data.vecR;
-			src_vecT = src_data.vecT;
+			m_cnn_3dmm_expr->process(m_flipped_src_img, cropped_src_landmarks,
+				src_data.shape_coefficients_flipped,
+				src_data.tex_coefficients_flipped, src_data.expr_coefficients_flipped,
+				src_data.vecR_flipped, src_data.vecT_flipped, src_data.K);
 		}
 
-		// Source mesh
-		Mesh src_mesh;
-		cv::Mat src_tex, src_uv;
+		// Select the level of detail by the target face size
+		const Basel3DMM& model = selectLOD(tgt_data.scaled_bbox);
+
+		// Create target mesh (the colors are replaced by the source texture)
+		Mesh& tgt_mesh = m_tgt_mesh;
+		sampleVertices(model, tgt_data.shape_coefficients,
+			tgt_data.expr_coefficients, m_tgt_identity, tgt_mesh);
+
+		// Check that the target mesh covers some of the target segmentation, using only
+		// the mesh's coverage, before unwrapping the source face and rendering the texture
+		cv::Mat seg_roi = tgt_data.scaled_seg.empty() ? cv::Mat() : tgt_data.scaled_seg(tgt_data.scaled_bbox);
+		renderMeshMask(m_tgt_coverage, tgt_data.cropped_img.size(), tgt_mesh,
+			tgt_data.vecR, tgt_data.vecT, tgt_data.K, m_render_ctx);
+		if (!seg_roi.empty()) m_tgt_coverage.setTo(0, seg_roi < 128);
+		if (cv::countNonZero(m_tgt_coverage) == 0)
 		{
-			// Create source mesh
-			src_mesh = m_basel_3dmm->sample(src_shape_coefficients, src_tex_coefficients,
-				src_expr_coefficients);
-
-			// Texture source mesh
-			generateTexture(src_mesh, cropped_src, cropped_src_seg, src_vecR, src_vecT, src_K,
-				src_tex, src_uv);
+			m_prev_blend = TemporalBlendState();
+			return cv::Mat();
 		}
 
-
-		// Create target mesh
-		Mesh tgt_mesh = m_basel_3dmm->sample(tgt_data.shape_coefficients,
-			tgt_data.tex_coefficients, tgt_data.expr_coefficients);
-		tgt_mesh.tex = src_tex;
-		tgt_mesh.uv = src_uv;
+		// Unwrap the source face into the model's texture atlas
+		tgt_mesh.tex = sourceAtlas(model, src_data, flip);
+		tgt_mesh.uv = model.atlas_uv;
 
 		////////////////////////////////////////
 		// Actual swap
 		////////////////////////////////////////
 
-		// Render
+		// Render, antialiased so the partially covered pixels along the face's outline
+		// are blended with the target instead of being stair stepped
 		cv::Mat rendered_img = tgt_data.cropped_img.clone();
-		cv::Mat depthbuf;
-		renderMesh(rendered_img, tgt_mesh, tgt_data.vecR, tgt_data.vecT, tgt_data.K, depthbuf);
+		m_render_backend->renderMesh(rendered_img, tgt_mesh,
+			tgt_data.vecR, tgt_data.vecT, tgt_data.K, m_render_ctx, ANTIALIAS_COVERAGE);
+		const cv::Mat& depthbuf = m_render_ctx.depthbuf;
 
 		// Copy back to original target image
 		cv::Mat tgt_rendered_img = tgt_data.scaled_img.clone();
 		rendered_img.copyTo(tgt_rendered_img(tgt_data.scaled_bbox));
-		cv::Mat tgt_depthbuf(tgt_data.scaled_img.size(), CV_32F, std::numeric_limits<float>::max());
-		depthbuf.copyTo(tgt_depthbuf(tgt_data.scaled_bbox));
-
-		// Create binary mask from the rendered depth buffer
-		cv::Mat mask(tgt_depthbuf.size(), CV_8U);
-		unsigned char* mask_data = mask.data;
-		float* tgt_depthbuf_data = (float*)tgt_depthbuf.data;
-		for (int i = 0; i < tgt_depthbuf.total(); ++i)
+
+		// Create binary mask from the rendered depth buffer combined with the
+		// segmentation, only the rendered region can be part of the mask. Unlike
+		// the coverage, it also leaves out the pixels where the texture's alpha is low
+		cv::Mat mask = cv::Mat::zeros(tgt_data.scaled_img.size(), CV_8U);
+		cv::Mat mask_roi = mask(tgt_data.scaled_bbox);
+		cv::Rect mask_bbox = createBlendMask(depthbuf, seg_roi, mask_roi);
+		if (mask_bbox.area() == 0)
 		{
-			if ((*tgt_depthbuf_data++ - 1e-6f) < std::numeric_limits<float>::max())
-				*mask_data++ = 255;
-			else *mask_data++ = 0;
+			m_prev_blend = TemporalBlendState();
+			return cv::Mat();
+		}
+		mask_bbox += tgt_data.scaled_bbox.tl();
+
+		// Blend images, warm starting from the previous frame for temporal blending
+		cv::Mat guess, out;
+		if (m_temporal_blending && blend_mode == BLEND_POISSON &&
+			temporalBlendGuess(tgt_data, mask_bbox, guess))
+			poissonBlend(tgt_rendered_img, tgt_data.scaled_img, mask, out, mask_bbox, guess);
+		else out = blend(tgt_rendered_img, tgt_data.scaled_img, mask, blend_mode, mask_bbox);
+
+		// Keep the blended region for the next frame
+		if (!m_temporal_blending || out.empty())
+			m_prev_blend = TemporalBlendState();
+		else
+		{
+			out(mask_bbox).copyTo(m_prev_blend.blended);
+			m_prev_blend.roi = mask_bbox;
+			m_prev_blend.img_size = out.size();
+			m_prev_blend.landmarks.assign(tgt_data.scaled_landmarks.begin(), tgt_data.scaled_landmarks.end());
 		}
 
-		// Combine the segmentation with the mask
-		if (!tgt_data.scaled_seg.empty())
-			cv::bitwise_and(mask, tgt_data.scaled_seg, mask);
-
-		// Blend images
-		return blend(tgt_rendered_img, tgt_data.scaled_img, mask);
+		return out;
 	}
 
 	bool FaceSwapEngineImpl::process(FaceData& face_data, bool process_flipped)
@@ -212,6 +248,37 @@ namespace face_swap
 		return true;
 	}
 
+	void FaceSwapEngineImpl::segmentFaces(const std::vector<FaceData*>& faces)
+	{
+		if (m_face_seg == nullptr) return;
+
+		// Collect the faces that need a segmentation
+		std::vector<FaceData*> seg_faces;
+		std::vector<cv::Mat> cropped_imgs;
+		for (FaceData* face_data : faces)
+		{
+			if (!face_data->enable_seg) continue;
+			if (face_data->scaled_landmarks.empty() && !preprocessImages(*face_data))
+				continue;
+
+			// Preprocessing sets the segmentation if one was given with the face data
+			if (!face_data->scaled_seg.empty()) continue;
+			seg_faces.push_back(face_data);
+			cropped_imgs.push_back(face_data->cropped_img);
+		}
+		if (seg_faces.empty()) return;
+
+		// Segment all the faces in a single forward pass
+		std::vector<cv::Mat> cropped_segs = m_face_seg->process(cropped_imgs);
+		for (size_t i = 0; i < seg_faces.size(); ++i)
+		{
+			FaceData& face_data = *seg_faces[i];
+			face_data.cropped_seg = cropped_segs[i];
+			face_data.scaled_seg = cv::Mat::zeros(face_data.scaled_img.size(), CV_8U);
+			face_data.cropped_seg.copyTo(face_data.scaled_seg(face_data.scaled_bbox));
+		}
+	}
+
 	cv::Mat FaceSwapEngineImpl::renderFaceData(const FaceData& face_data, float scale)
 	{
 		cv::Mat out = face_data.scaled_img.clone();
@@ -259,8 +326,10 @@ namespace face_swap
 			cv::resize(wireframe_render, wireframe_render, cv::Size(), scale, scale, cv::INTER_CUBIC);
 		cv::Mat wireframe_render_cropped = face_data.cropped_img.clone();
 		cv::Mat P = createPerspectiveProj3x4(face_data.vecR, face_data.vecT, face_data.K);
-		Mesh mesh = m_basel_3dmm->sample(face_data.shape_coefficients,
-			face_data.tex_coefficients, face_data.expr_coefficients);
+		Mesh mesh;
+		m_basel_3dmm->sample(face_data.shape_coefficients,
+			face_data.tex_coefficients, face_data.expr_coefficients, mesh,
+			Basel3DMM::SAMPLE_SHAPE | Basel3DMM::SAMPLE_EXPR);
 		renderWireframe(wireframe_render_cropped, mesh, P, scale);
 		wireframe_render_cropped.copyTo(wireframe_render(bbox));
 		cv::hconcat(out, wireframe_render, out);
@@ -276,6 +345,56 @@ namespace face_swap
 		return out;
 	}
 
+	void FaceSwapEngineImpl::setRenderBackend(const std::shared_ptr<RenderBackend>& backend)
+	{
+		CV_Assert(backend != nullptr);
+		m_render_backend = backend;
+	}
+
+	void FaceSwapEngineImpl::setTemporalBlending(bool enable)
+	{
+		m_temporal_blending = enable;
+		m_prev_blend = TemporalBlendState();
+	}
+
+	bool FaceSwapEngineImpl::temporalBlendGuess(const FaceData& tgt_data,
+		const cv::Rect& roi, cv::Mat& guess)
+	{
+		const TemporalBlendState& prev = m_prev_blend;
+		if (prev.blended.empty() || prev.img_size != tgt_data.scaled_img.size() ||
+			prev.landmarks.size() != tgt_data.scaled_landmarks.size())
+			return false;
+
+		// Estimate the landmarks' motion
+		std::vector<cv::Point2f> landmarks(tgt_data.scaled_landmarks.begin(),
+			tgt_data.scaled_landmarks.end());
+		cv::Mat M = cv::estimateAffinePartial2D(prev.landmarks, landmarks);
+		if (M.empty()) return false;
+
+		// The previous region is not a good guess if the face moved non rigidly
+		std::vector<cv::Point2f> warped_landmarks;
+		cv::transform(prev.landmarks, warped_landmarks, M);
+		double sq_error = 0.0;
+		for (size_t i = 0; i < landmarks.size(); ++i)
+		{
+			cv::Point2f d = warped_landmarks[i] - landmarks[i];
+			sq_error += d.dot(d);
+		}
+		double max_error = TEMPORAL_BLEND_MAX_LANDMARKS_ERROR * tgt_data.scaled_bbox.width;
+		if (sq_error > max_error * max_error * landmarks.size()) return false;
+
+		// Express the motion between the previous and current regions
+		M.at<double>(0, 2) += M.at<double>(0, 0) * prev.roi.x + M.at<double>(0, 1) * prev.roi.y - roi.x;
+		M.at<double>(1, 2) += M.at<double>(1, 0) * prev.roi.x + M.at<double>(1, 1) * prev.roi.y - roi.y;
+
+		// Warp the previous blended region
+		guess.create(tgt_data.scaled_img.size(), CV_8UC3);
+		cv::Mat guess_roi = guess(roi);
+		cv::warpAffine(prev.blended, guess_roi, M, roi.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+		return true;
+	}
+
 	bool FaceSwapEngineImpl::preprocessImages(FaceData& face_data)
 	{
 		// Calculate landmarks
@@ -344,4 +463,95 @@ namespace face_swap
 		return true;
 	}
 
+	const Basel3DMM& FaceSwapEngineImpl::selectLOD(const cv::Rect& bbox) const
+	{
+		float min_faces = bbox.area() * LOD_FACES_PER_PIXEL;
+		size_t level = 0;
+		while (level + 1 < m_basel_3dmm_lods.size() &&
+			m_basel_3dmm_lods[level + 1].faces.rows >= min_faces)
+			++level;
+		return m_basel_3dmm_lods[level];
+	}
+
+	void FaceSwapEngineImpl::sampleVertices(const Basel3DMM& model,
+		const cv::Mat& shape_coefficients, const cv::Mat& expr_coefficients,
+		IdentityCache& cache, Mesh& mesh)
+	{
+		// Resample the identity only if the model or the shape coefficients changed
+		bool valid = cache.model == &model && !cache.vertices.empty() &&
+			cache.shape_coefficients.size() == shape_coefficients.size() &&
+			cv::norm(cache.shape_coefficients, shape_coefficients, cv::NORM_INF) == 0.0;
+		if (!valid)
+		{
+			Mesh identity_mesh;
+			identity_mesh.vertices = cache.vertices;
+			model.sample(shape_coefficients, cv::Mat(), cv::Mat(), identity_mesh,
+				Basel3DMM::SAMPLE_SHAPE);
+			cache.model = &model;
+			cache.vertices = identity_mesh.vertices;
+			shape_coefficients.copyTo(cache.shape_coefficients);
+		}
+
+		// Apply the expression on top of the identity
+		model.sampleExpression(cache.vertices, expr_coefficients, mesh);
+	}
+
+	static bool equalMats(const cv::Mat& a, const cv::Mat& b)
+	{
+		return a.size() == b.size() && a.type() == b.type() &&
+			(a.empty() || cv::norm(a, b, cv::NORM_INF) == 0.0);
+	}
+
+	const cv::Mat& FaceSwapEngineImpl::sourceAtlas(const Basel3DMM& model,
+		const FaceData& src_data, bool flipped)
+	{
+		const cv::Mat& shape_coefficients = flipped ?
+			src_data.shape_coefficients_flipped : src_data.shape_coefficients;
+		const cv::Mat& expr_coefficients = flipped ?
+			src_data.expr_coefficients_flipped : src_data.expr_coefficients;
+		const cv::Mat& vecR = flipped ? src_data.vecR_flipped : src_data.vecR;
+		const cv::Mat& vecT = flipped ? src_data.vecT_flipped : src_data.vecT;
+		const cv::Mat& K = src_data.K;
+
+		AtlasCache& cache = m_src_atlas;
+		bool valid = cache.model == &model && cache.flipped == flipped && !cache.tex.empty() &&
+			equalMats(cache.img, src_data.cropped_img) && equalMats(cache.seg, src_data.cropped_seg) &&
+			equalMats(cache.shape_coefficients, shape_coefficients) &&
+			equalMats(cache.expr_coefficients, expr_coefficients) &&
+			equalMats(cache.vecR, vecR) && equalMats(cache.vecT, vecT) && equalMats(cache.K, K);
+		if (valid) return cache.tex;
+
+		// The flipped source is only created when the atlas has to be generated
+		cv::Mat img = src_data.cropped_img, seg = src_data.cropped_seg;
+		if (flipped)
+		{
+			cv::flip(img, m_flipped_src_img, 1);
+			img = m_flipped_src_img;
+			if (!seg.empty())
+			{
+				cv::flip(seg, m_flipped_src_seg, 1);
+				seg = m_flipped_src_seg;
+			}
+		}
+
+		// Create source mesh, its vertex normals resolve where the atlas folds over
+		sampleVertices(model, shape_coefficients, expr_coefficients, m_src_identity, m_src_mesh);
+		computeVertexNormals(m_src_mesh, model.adjacency, m_src_mesh.normals, m_src_face_normals);
+
+		// Texture source mesh
+		generateTextureAtlas(m_src_mesh, model.atlas_uv, img, seg, vecR, vecT, K,
+			m_render_ctx, cache.tex);
+		cache.model = &model;
+		cache.flipped = flipped;
+		src_data.cropped_img.copyTo(cache.img);
+		src_data.cropped_seg.copyTo(cache.seg);
+		shape_coefficients.copyTo(cache.shape_coefficients);
+		expr_coefficients.copyTo(cache.expr_coefficients);
+		vecR.copyTo(cache.vecR);
+		vecT.copyTo(cache.vecT);
+		K.copyTo(cache.K);
+
+		return cache.tex;
+	}
+
 }   // namespace face_swap
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "face_swap/inference_backend.h"
+
+// std
+#include <stdexcept>
+
+// Caffe
+#include <caffe/caffe.hpp>
+#include <caffe/util/upgrade_proto.hpp>
+
+using namespace caffe;
+
+namespace face_swap
+{
+#ifdef WITH_OPENCV_DNN
+	// Defined in inference_backend_opencv.cpp
+	std::shared_ptr<InferenceBackend> createOpenCVInferenceBackend(
+		const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id);
+#endif
+
+	/** Inference backend using Caffe.
+	Caffe's device mode is a per thread setting, it's selected when the backend is created.
+	*/
+	class CaffeInferenceBackend : public InferenceBackend
+	{
+	public:
+		CaffeInferenceBackend(const std::string& deploy_file, const std::string& model_file,
+			bool with_gpu, int gpu_device_id)
+		{
+			if (with_gpu)
+			{
+				Caffe::SetDevice(gpu_device_id);
+				Caffe::set_mode(Caffe::GPU);
+			}
+			else Caffe::set_mode(Caffe::CPU);
+
+			// Load the network
+			m_net.reset(new Net<float>(deploy_file, caffe::TEST));
+			m_net->CopyTrainedLayersFrom(model_file);
+
+			CHECK_EQ(m_net->num_inputs(), 1) << "Network should have exactly one input.";
+			CHECK_EQ(m_net->num_outputs(), 1) << "Network should have exactly one output.";
+		}
+
+		std::vector<int> inputShape() const
+		{
+			return m_net->input_blobs()[0]->shape();
+		}
+
+		void reshapeInput(const std::vector<int>& shape)
+		{
+			Blob<float>* input_layer = m_net->input_blobs()[0];
+			if (input_layer->shape() == shape) return;
+			input_layer->Reshape(shape);
+
+			// Forward dimension change to all layers
+			m_net->Reshape();
+		}
+
+		float* inputData()
+		{
+			return m_net->input_blobs()[0]->mutable_cpu_data();
+		}
+
+		cv::Mat forward(const std::string& output_name)
+		{
+			m_net->Forward();
+			Blob<float>* output_layer = m_net->output_blobs()[0];
+			if (!output_name.empty())
+			{
+				if (!m_net->has_blob(output_name))
+					throw std::runtime_error("Network has no blob named \"" + output_name + "\"!");
+				output_layer = m_net->blob_by_name(output_name).get();
+			}
+
+			const std::vector<int>& shape = output_layer->shape();
+			return cv::Mat((int)shape.size(), shape.data(), CV_32F, (void*)output_layer->cpu_data());
+		}
+
+		std::string name() const
+		{
+			return "caffe";
+		}
+
+	private:
+		std::shared_ptr<Net<float>> m_net;
+	};
+
+	std::shared_ptr<InferenceBackend> InferenceBackend::create(const std::string& name,
+		const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id)
+	{
+		if (name == "caffe")
+			return std::make_shared<CaffeInferenceBackend>(deploy_file, model_file, with_gpu, gpu_device_id);
+#ifdef WITH_OPENCV_DNN
+		if (name == "opencv")
+			return createOpenCVInferenceBackend(deploy_file, model_file, with_gpu, gpu_device_id);
+#endif
+		return nullptr;
+	}
+
+	std::vector<std::string> InferenceBackend::available()
+	{
+		std::vector<std::string> names = { "caffe" };
+#ifdef WITH_OPENCV_DNN
+		names.push_back("opencv");
+#endif
+		return names;
+	}
+
+	std::vector<int> readCaffeInputShape(const std::string& deploy_file)
+	{
+		NetParameter param;
+		ReadNetParamsFromTextFileOrDie(deploy_file, &param);
+
+		// Deprecated input fields, newer versions upgrade them to an Input layer
+		std::vector<int> shape;
+		if (param.input_shape_size() > 0)
+		{
+			for (int i = 0; i < param.input_shape(0).dim_size(); ++i)
+				shape.push_back((int)param.input_shape(0).dim(i));
+		}
+		else if (param.input_dim_size() > 0)
+		{
+			for (int i = 0; i < param.input_dim_size(); ++i)
+				shape.push_back(param.input_dim(i));
+		}
+		else
+		{
+			for (int i = 0; i < param.layer_size(); ++i)
+			{
+				const LayerParameter& layer = param.layer(i);
+				if (layer.type() != "Input" || layer.input_param().shape_size() == 0) continue;
+				for (int j = 0; j < layer.input_param().shape(0).dim_size(); ++j)
+					shape.push_back((int)layer.input_param().shape(0).dim(j));
+				break;
+			}
+		}
+
+		if (shape.size() != 4)
+			throw std::runtime_error("Failed to read the input shape of \"" + deploy_file + "\"!");
+		return shape;
+	}
+
+}   // namespace face_swap
@@ -0,0 +1,92 @@
+#include "face_swap/inference_backend.h"
+
+// std
+#include <stdexcept>
+
+// OpenCV
+#include <opencv2/dnn.hpp>
+
+namespace face_swap
+{
+	/** Inference backend using OpenCV's dnn module.
+	The Caffe network files are imported by cv::dnn::readNetFromCaffe. Unlike Caffe,
+	all the state is kept in the instance, so instances can be created and run
+	concurrently from different threads. The layers are parallelized by OpenCV's
+	thread pool (see cv::setNumThreads). The GPU is used through OpenCL,
+	on the device selected by OpenCV (see OPENCV_OPENCL_DEVICE).
+	Quantization requires OpenCV 4.5.4 or later, the 8-bit kernels use VNNI
+	instructions on CPUs that support them.
+	*/
+	class OpenCVInferenceBackend : public InferenceBackend
+	{
+	public:
+		OpenCVInferenceBackend(const std::string& deploy_file, const std::string& model_file,
+			bool with_gpu)
+		{
+			m_net = cv::dnn::readNetFromCaffe(deploy_file, model_file);
+			if (m_net.empty())
+				throw std::runtime_error("Failed to load network \"" + deploy_file + "\"!");
+			m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_DEFAULT);
+			m_net.setPreferableTarget(with_gpu ? cv::dnn::DNN_TARGET_OPENCL : cv::dnn::DNN_TARGET_CPU);
+
+			// The importer doesn't expose the input shape, read it from the definition
+			reshapeInput(readCaffeInputShape(deploy_file));
+		}
+
+		std::vector<int> inputShape() const
+		{
+			return std::vector<int>(m_input.size.p, m_input.size.p + m_input.dims);
+		}
+
+		void reshapeInput(const std::vector<int>& shape)
+		{
+			m_input.create((int)shape.size(), shape.data(), CV_32F);
+		}
+
+		float* inputData()
+		{
+			return (float*)m_input.data;
+		}
+
+		cv::Mat forward(const std::string& output_name)
+		{
+			m_net.setInput(m_input);
+			cv::Mat output = output_name.empty() ? m_net.forward() : m_net.forward(output_name);
+
+			// The internal blobs of quantized networks are 8-bit
+			if (output.depth() != CV_32F)
+				throw std::runtime_error("Blob \"" + output_name + "\" is not an output of the quantized network!");
+			return output;
+		}
+
+		bool quantize(const std::vector<cv::Mat>& calib_data)
+		{
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || \
+	(CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 4)))
+			m_net = m_net.quantize(calib_data, CV_32F, CV_32F);
+			m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_DEFAULT);
+			m_net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		std::string name() const
+		{
+			return "opencv";
+		}
+
+	private:
+		cv::dnn::Net m_net;
+		cv::Mat m_input;
+	};
+
+	std::shared_ptr<InferenceBackend> createOpenCVInferenceBackend(
+		const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id)
+	{
+		return std::make_shared<OpenCVInferenceBackend>(deploy_file, model_file, with_gpu);
+	}
+
+}   // namespace face_swap
@@ -0,0 +1,358 @@
+#include "face_swap/mesh_utilities.h"
+
+// std
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cfloat>
+#include <limits>
+
+namespace face_swap
+{
+	MeshAdjacency MeshAdjacency::create(const cv::Mat& faces, int total_vertices)
+	{
+		MeshAdjacency adj;
+		adj.offsets = cv::Mat::zeros(total_vertices + 1, 1, CV_32S);
+		adj.face_indices.create(faces.rows * 3, 1, CV_32S);
+		int* offsets_data = (int*)adj.offsets.data;
+		int* face_indices_data = (int*)adj.face_indices.data;
+		const unsigned short* faces_data = (const unsigned short*)faces.data;
+		const int total_indices = faces.rows * 3;
+
+		// Count the faces of each vertex
+		for (int i = 0; i < total_indices; ++i)
+			++offsets_data[faces_data[i] + 1];
+
+		// Prefix sum
+		for (int i = 0; i < total_vertices; ++i)
+			offsets_data[i + 1] += offsets_data[i];
+
+		// Fill the face indices, faces are listed in ascending order per vertex
+		std::vector<int> pos(offsets_data, offsets_data + total_vertices);
+		for (int i = 0; i < total_indices; ++i)
+			face_indices_data[pos[faces_data[i]]++] = i / 3;
+
+		return adj;
+	}
+
+	/** Symmetric 4x4 error quadric, stored as its upper triangle.
+	*/
+	struct ErrorQuadric
+	{
+		double a[10] = {};	// a00 a01 a02 a03 a11 a12 a13 a22 a23 a33
+
+		void addPlane(double nx, double ny, double nz, double d, double w)
+		{
+			a[0] += w * nx * nx; a[1] += w * nx * ny; a[2] += w * nx * nz; a[3] += w * nx * d;
+			a[4] += w * ny * ny; a[5] += w * ny * nz; a[6] += w * ny * d;
+			a[7] += w * nz * nz; a[8] += w * nz * d;
+			a[9] += w * d * d;
+		}
+
+		ErrorQuadric& operator+=(const ErrorQuadric& q)
+		{
+			for (int i = 0; i < 10; ++i) a[i] += q.a[i];
+			return *this;
+		}
+
+		double error(const float* p) const
+		{
+			double x = p[0], y = p[1], z = p[2];
+			return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x +
+				a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y +
+				a[7] * z * z + 2 * a[8] * z + a[9];
+		}
+	};
+
+	/** Candidate collapse of vertex "from" onto vertex "to".
+	*/
+	struct EdgeCollapse
+	{
+		double cost;
+		int from, to;
+		int from_version, to_version;
+
+		// Reversed for a min-heap
+		bool operator<(const EdgeCollapse& other) const { return cost > other.cost; }
+	};
+
+	static inline void triangleNormal(const float* p1, const float* p2, const float* p3, double* n)
+	{
+		double ax = p2[0] - p1[0], ay = p2[1] - p1[1], az = p2[2] - p1[2];
+		double bx = p3[0] - p1[0], by = p3[1] - p1[1], bz = p3[2] - p1[2];
+		n[0] = ay * bz - az * by;
+		n[1] = az * bx - ax * bz;
+		n[2] = ax * by - ay * bx;
+	}
+
+	void decimateMesh(const cv::Mat& vertices, const cv::Mat& faces,
+		int target_faces, cv::Mat& out_faces)
+	{
+		// Minimal cosine between a face normal before and after a collapse
+		const double MIN_NORMAL_COS = 0.2;
+
+		// Weight of the planes that preserve the boundary edges
+		const double BOUNDARY_WEIGHT = 1000.0;
+
+		const int total_vertices = vertices.rows;
+		const int total_faces = faces.rows;
+		const float* vert_data = (const float*)vertices.data;
+		const unsigned short* faces_data = (const unsigned short*)faces.data;
+
+		// Copy faces and build the vertex to face lists
+		std::vector<int> tris(faces_data, faces_data + total_faces * 3);
+		std::vector<char> face_alive(total_faces, 1);
+		std::vector<std::vector<int>> vert_faces(total_vertices);
+		for (int f = 0; f < total_faces; ++f)
+			for (int k = 0; k < 3; ++k)
+				vert_faces[tris[3 * f + k]].push_back(f);
+
+		// Accumulate the area weighted plane quadrics of the faces
+		std::vector<ErrorQuadric> quadrics(total_vertices);
+		std::vector<double> face_normals(total_faces * 3);
+		for (int f = 0; f < total_faces; ++f)
+		{
+			const float* p1 = vert_data + 3 * tris[3 * f];
+			double* n = &face_normals[3 * f];
+			triangleNormal(p1, vert_data + 3 * tris[3 * f + 1], vert_data + 3 * tris[3 * f + 2], n);
+			double len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			if (len <= 0.0) continue;
+			n[0] /= len; n[1] /= len; n[2] /= len;
+			double d = -(n[0] * p1[0] + n[1] * p1[1] + n[2] * p1[2]);
+			for (int k = 0; k < 3; ++k)
+				quadrics[tris[3 * f + k]].addPlane(n[0], n[1], n[2], d, 0.5 * len);
+		}
+
+		// Find the edges, boundary edges are used by a single face
+		std::vector<std::pair<uint64_t, int>> edges;
+		edges.reserve(total_faces * 3);
+		for (int f = 0; f < total_faces; ++f)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				uint64_t a = (uint64_t)tris[3 * f + k], b = (uint64_t)tris[3 * f + (k + 1) % 3];
+				edges.push_back(std::make_pair(std::min(a, b) << 32 | std::max(a, b), f));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+
+		std::vector<char> boundary(total_vertices, 0);
+		std::vector<std::pair<int, int>> unique_edges;
+		for (size_t i = 0; i < edges.size();)
+		{
+			size_t j = i + 1;
+			while (j < edges.size() && edges[j].first == edges[i].first) ++j;
+			int a = (int)(edges[i].first >> 32), b = (int)(edges[i].first & 0xffffffff);
+			unique_edges.push_back(std::make_pair(a, b));
+			if (j - i == 1)
+			{
+				// Add a plane perpendicular to the face through the boundary edge
+				const double* n = &face_normals[3 * edges[i].second];
+				const float* pa = vert_data + 3 * a;
+				const float* pb = vert_data + 3 * b;
+				double ex = pb[0] - pa[0], ey = pb[1] - pa[1], ez = pb[2] - pa[2];
+				double mx = ey * n[2] - ez * n[1];
+				double my = ez * n[0] - ex * n[2];
+				double mz = ex * n[1] - ey * n[0];
+				double len = std::sqrt(mx * mx + my * my + mz * mz);
+				if (len > 0.0)
+				{
+					mx /= len; my /= len; mz /= len;
+					double d = -(mx * pa[0] + my * pa[1] + mz * pa[2]);
+					double w = BOUNDARY_WEIGHT * (ex * ex + ey * ey + ez * ez);
+					quadrics[a].addPlane(mx, my, mz, d, w);
+					quadrics[b].addPlane(mx, my, mz, d, w);
+				}
+				boundary[a] = boundary[b] = 1;
+			}
+			i = j;
+		}
+
+		// Initialize the candidate collapses
+		std::vector<int> version(total_vertices, 0);
+		std::priority_queue<EdgeCollapse> heap;
+		auto pushEdge = [&](int a, int b)
+		{
+			ErrorQuadric q = quadrics[a];
+			q += quadrics[b];
+			heap.push({ q.error(vert_data + 3 * b), a, b, version[a], version[b] });
+			heap.push({ q.error(vert_data + 3 * a), b, a, version[b], version[a] });
+		};
+		for (const auto& e : unique_edges)
+			pushEdge(e.first, e.second);
+
+		// Collect the vertices adjacent to a vertex through its alive faces
+		auto neighbors = [&](int v, std::vector<int>& out)
+		{
+			out.clear();
+			for (int f : vert_faces[v])
+			{
+				if (!face_alive[f]) continue;
+				for (int k = 0; k < 3; ++k)
+					if (tris[3 * f + k] != v) out.push_back(tris[3 * f + k]);
+			}
+			std::sort(out.begin(), out.end());
+			out.erase(std::unique(out.begin(), out.end()), out.end());
+		};
+
+		// Check whether collapsing "from" onto "to" keeps the mesh valid
+		std::vector<int> from_neighbors, to_neighbors;
+		auto isValid = [&](int from, int to)
+		{
+			// Count the faces shared by the edge
+			int shared = 0;
+			for (int f : vert_faces[from])
+			{
+				if (!face_alive[f]) continue;
+				const int* t = &tris[3 * f];
+				if (t[0] == to || t[1] == to || t[2] == to) ++shared;
+			}
+			if (shared == 0) return false;
+
+			// Boundary vertices may only move along boundary edges
+			if (boundary[from] && shared != 1) return false;
+
+			// Link condition: the only common neighbors are the opposite vertices
+			// of the shared faces
+			neighbors(from, from_neighbors);
+			neighbors(to, to_neighbors);
+			int common = 0;
+			for (size_t i = 0, j = 0; i < from_neighbors.size() && j < to_neighbors.size();)
+			{
+				if (from_neighbors[i] < to_neighbors[j]) ++i;
+				else if (from_neighbors[i] > to_neighbors[j]) ++j;
+				else { ++common; ++i; ++j; }
+			}
+			if (common != shared) return false;
+
+			// Reject collapses that flip or degenerate the remaining faces
+			for (int f : vert_faces[from])
+			{
+				if (!face_alive[f]) continue;
+				const int* t = &tris[3 * f];
+				if (t[0] == to || t[1] == to || t[2] == to) continue;
+				const float* p[3];
+				for (int k = 0; k < 3; ++k)
+					p[k] = vert_data + 3 * t[k];
+				double n_before[3], n_after[3];
+				triangleNormal(p[0], p[1], p[2], n_before);
+				for (int k = 0; k < 3; ++k)
+					if (t[k] == from) p[k] = vert_data + 3 * to;
+				triangleNormal(p[0], p[1], p[2], n_after);
+				double dot = n_before[0] * n_after[0] + n_before[1] * n_after[1] + n_before[2] * n_after[2];
+				double len_before = std::sqrt(n_before[0] * n_before[0] + n_before[1] * n_before[1] + n_before[2] * n_before[2]);
+				double len_after = std::sqrt(n_after[0] * n_after[0] + n_after[1] * n_after[1] + n_after[2] * n_after[2]);
+				if (len_after <= 0.0 || dot < MIN_NORMAL_COS * len_before * len_after)
+					return false;
+			}
+
+			return true;
+		};
+
+		// Collapse the cheapest edges until the target number of faces is reached
+		int alive_faces = total_faces;
+		std::vector<int> to_faces;
+		while (alive_faces > target_faces && !heap.empty())
+		{
+			EdgeCollapse c = heap.top();
+			heap.pop();
+			if (version[c.from] != c.from_version || version[c.to] != c.to_version)
+				continue;	// Stale
+			if (!isValid(c.from, c.to)) continue;
+
+			// Remove the faces of the edge and move the rest of the faces to "to"
+			for (int f : vert_faces[c.from])
+			{
+				if (!face_alive[f]) continue;
+				int* t = &tris[3 * f];
+				if (t[0] == c.to || t[1] == c.to || t[2] == c.to)
+				{
+					face_alive[f] = 0;
+					--alive_faces;
+					continue;
+				}
+				for (int k = 0; k < 3; ++k)
+					if (t[k] == c.from) t[k] = c.to;
+				vert_faces[c.to].push_back(f);
+			}
+			quadrics[c.to] += quadrics[c.from];
+			vert_faces[c.from].clear();
+			version[c.from] = -1;
+			++version[c.to];
+
+			// Drop the removed faces from the list of "to"
+			to_faces.clear();
+			for (int f : vert_faces[c.to])
+				if (face_alive[f]) to_faces.push_back(f);
+			vert_faces[c.to].swap(to_faces);
+
+			// Update the costs of the edges around "to"
+			neighbors(c.to, to_neighbors);
+			for (int n : to_neighbors)
+				pushEdge(c.to, n);
+		}
+
+		// Output the remaining faces
+		out_faces.create(alive_faces, 3, CV_16U);
+		unsigned short* out_faces_data = (unsigned short*)out_faces.data;
+		for (int f = 0; f < total_faces; ++f)
+		{
+			if (!face_alive[f]) continue;
+			for (int k = 0; k < 3; ++k)
+				*out_faces_data++ = (unsigned short)tris[3 * f + k];
+		}
+	}
+
+	void generateCylindricalUV(const cv::Mat& vertices, cv::Mat& uv, float margin)
+	{
+		CV_Assert(vertices.type() == CV_32F && vertices.cols == 3 && vertices.isContinuous());
+		const int total_vertices = vertices.rows;
+		const float* vertices_data = (const float*)vertices.data;
+
+		// Calculate bounding box
+		float min_p[3], max_p[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			min_p[k] = std::numeric_limits<float>::max();
+			max_p[k] = -std::numeric_limits<float>::max();
+		}
+		for (int i = 0; i < total_vertices; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				min_p[k] = std::min(min_p[k], vertices_data[3 * i + k]);
+				max_p[k] = std::max(max_p[k], vertices_data[3 * i + k]);
+			}
+		}
+
+		// Project the vertices on the cylinder
+		const float cx = 0.5f * (min_p[0] + max_p[0]);
+		const float cz = max_p[2] - 0.5f * (max_p[0] - min_p[0]);
+		uv.create(total_vertices, 2, CV_32F);
+		float* uv_data = (float*)uv.data;
+		float min_angle = std::numeric_limits<float>::max();
+		float max_angle = -std::numeric_limits<float>::max();
+		for (int i = 0; i < total_vertices; ++i)
+		{
+			const float* v = vertices_data + 3 * i;
+			const float angle = std::atan2(v[0] - cx, v[2] - cz);
+			min_angle = std::min(min_angle, angle);
+			max_angle = std::max(max_angle, angle);
+			uv_data[2 * i] = angle;
+			uv_data[2 * i + 1] = max_p[1] - v[1];	// Image rows go down
+		}
+
+		// Normalize
+		const float scale = 1.0f - 2.0f * margin;
+		const float u_scale = scale / std::max(max_angle - min_angle, FLT_EPSILON);
+		const float v_scale = scale / std::max(max_p[1] - min_p[1], FLT_EPSILON);
+		for (int i = 0; i < total_vertices; ++i)
+		{
+			uv_data[2 * i] = margin + (uv_data[2 * i] - min_angle) * u_scale;
+			uv_data[2 * i + 1] = margin + uv_data[2 * i + 1] * v_scale;
+		}
+	}
+
+}   // namespace face_swap
@@ -0,0 +1,46 @@
+#include "face_swap/render_backend.h"
+
+namespace face_swap
+{
+#ifdef WITH_OSMESA
+	// Defined in render_backend_osmesa.cpp
+	std::shared_ptr<RenderBackend> createOSMesaRenderBackend();
+#endif
+
+	/** Render backend using the tile based CPU rasterizer of renderMesh.
+	*/
+	class CPURenderBackend : public RenderBackend
+	{
+	public:
+		void renderMesh(cv::Mat& img, const Mesh& mesh,
+			const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+			RenderContext& ctx, AntialiasMode antialias)
+		{
+			face_swap::renderMesh(img, mesh, rvec, tvec, K, ctx, antialias);
+		}
+
+		std::string name() const
+		{
+			return "cpu";
+		}
+	};
+
+	std::shared_ptr<RenderBackend> RenderBackend::create(const std::string& name)
+	{
+		if (name == "cpu") return std::make_shared<CPURenderBackend>();
+#ifdef WITH_OSMESA
+		if (name == "osmesa") return createOSMesaRenderBackend();
+#endif
+		return nullptr;
+	}
+
+	std::vector<std::string> RenderBackend::available()
+	{
+		std::vector<std::string> names = { "cpu" };
+#ifdef WITH_OSMESA
+		names.push_back("osmesa");
+#endif
+		return names;
+	}
+
+}   // namespace face_swap
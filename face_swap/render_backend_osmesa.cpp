@@ -0,0 +1,188 @@
+#include "face_swap/render_backend.h"
+#include "face_swap/utilities.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+// OSMesa
+#include <GL/osmesa.h>
+
+namespace face_swap
+{
+	/** Render backend using the headless OSMesa software OpenGL implementation.
+	With the llvmpipe driver rasterization is multithreaded (see LP_NUM_THREADS)
+	and requires neither a GPU nor a display. The mesh is projected on the CPU and
+	drawn in normalized device coordinates, so the texture coordinates are
+	interpolated in screen space like the CPU rasterizer. Antialiasing is not supported.
+	*/
+	class OSMesaRenderBackend : public RenderBackend
+	{
+	public:
+		OSMesaRenderBackend()
+		{
+			m_context = OSMesaCreateContextExt(OSMESA_RGBA, 24, 0, 0, nullptr);
+			if (m_context == nullptr)
+				throw std::runtime_error("Failed to create OSMesa context!");
+		}
+
+		~OSMesaRenderBackend()
+		{
+			OSMesaDestroyContext(m_context);
+		}
+
+		void renderMesh(cv::Mat& img, const Mesh& mesh,
+			const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+			RenderContext& ctx, AntialiasMode antialias)
+		{
+			CV_Assert(mesh.tex.depth() == CV_8U &&
+				(mesh.tex.channels() == 3 || mesh.tex.channels() == 4));
+
+			// Calculate image coordinates and depth
+			cv::Matx34f P;
+			createPerspectiveProj3x4(rvec, tvec, K, P);
+			ctx.vertices_proj = bufferView(ctx.vertices_proj_storage, cv::Size(2, mesh.vertices.rows), CV_32F);
+			ctx.vertices_depth = bufferView(ctx.vertices_depth_storage, cv::Size(1, mesh.vertices.rows), CV_32F);
+			projectVertices(mesh.vertices, P, &ctx.vertices_proj, &ctx.vertices_depth);
+			const cv::Point2f* proj_data = (const cv::Point2f*)ctx.vertices_proj.data;
+			const float* depth_data = (const float*)ctx.vertices_depth.data;
+
+			// Select the front facing triangles
+			const unsigned short* faces_data = (const unsigned short*)mesh.faces.data;
+			m_indices.clear();
+			for (int f = 0; f < mesh.faces.rows; ++f)
+			{
+				const unsigned short* face = faces_data + 3 * f;
+				if (!is_ccw(proj_data[face[0]], proj_data[face[1]], proj_data[face[2]])) continue;
+				m_indices.insert(m_indices.end(), face, face + 3);
+			}
+
+			// Convert the vertices to normalized device coordinates, the depth is
+			// mapped linearly to the depth range of the mesh
+			float min_depth = std::numeric_limits<float>::max();
+			float max_depth = -std::numeric_limits<float>::max();
+			for (int i = 0; i < ctx.vertices_depth.rows; ++i)
+			{
+				min_depth = std::min(min_depth, depth_data[i]);
+				max_depth = std::max(max_depth, depth_data[i]);
+			}
+			const float depth_margin = std::max((max_depth - min_depth) * 1e-3f, 1e-3f);
+			min_depth -= depth_margin;
+			max_depth += depth_margin;
+			const float depth_range = max_depth - min_depth;
+			m_vertices.create(mesh.vertices.rows, 3, CV_32F);
+			float* vertices_data = (float*)m_vertices.data;
+			for (int i = 0; i < mesh.vertices.rows; ++i)
+			{
+				*vertices_data++ = 2.0f * proj_data[i].x / img.cols - 1.0f;
+				*vertices_data++ = 2.0f * proj_data[i].y / img.rows - 1.0f;
+				*vertices_data++ = 2.0f * (depth_data[i] - min_depth) / depth_range - 1.0f;
+			}
+
+			// Bind the color buffer, with OSMesa's default bottom to top row order
+			// the buffer's rows match the image rows
+			m_colorbuf.create(img.size(), CV_8UC4);
+			if (!OSMesaMakeCurrent(m_context, m_colorbuf.data, GL_UNSIGNED_BYTE, img.cols, img.rows))
+				throw std::runtime_error("Failed to bind OSMesa buffer!");
+
+			// Initialize state
+			glViewport(0, 0, img.cols, img.rows);
+			glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+			glClearDepth(1.0);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glEnable(GL_DEPTH_TEST);
+			glDepthFunc(GL_LESS);
+			glDisable(GL_CULL_FACE);
+			glDisable(GL_LIGHTING);
+			glDisable(GL_BLEND);
+			glMatrixMode(GL_PROJECTION);
+			glLoadIdentity();
+			glMatrixMode(GL_MODELVIEW);
+			glLoadIdentity();
+
+			// Upload texture. Texel centers are shifted by half a texel to match
+			// the integer texel centers used by the CPU rasterizer
+			if (m_texture == 0) glGenTextures(1, &m_texture);
+			glEnable(GL_TEXTURE_2D);
+			glBindTexture(GL_TEXTURE_2D, m_texture);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)(mesh.tex.step / mesh.tex.elemSize()));
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, mesh.tex.cols, mesh.tex.rows, 0,
+				mesh.tex.channels() == 4 ? GL_BGRA : GL_BGR, GL_UNSIGNED_BYTE, mesh.tex.data);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+			glMatrixMode(GL_TEXTURE);
+			glLoadIdentity();
+			glTranslatef(0.5f / mesh.tex.cols, 0.5f / mesh.tex.rows, 0.0f);
+
+			// Draw
+			glEnableClientState(GL_VERTEX_ARRAY);
+			glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+			glVertexPointer(3, GL_FLOAT, 0, m_vertices.data);
+			glTexCoordPointer(2, GL_FLOAT, 0, mesh.uv.data);
+			glDrawElements(GL_TRIANGLES, (GLsizei)m_indices.size(), GL_UNSIGNED_SHORT, m_indices.data());
+			glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+			glDisableClientState(GL_VERTEX_ARRAY);
+
+			// Read depth
+			m_gl_depthbuf.create(img.size(), CV_32F);
+			glReadPixels(0, 0, img.cols, img.rows, GL_DEPTH_COMPONENT, GL_FLOAT, m_gl_depthbuf.data);
+			glFinish();
+
+			// Write the rendered pixels and their depth to the output
+			ctx.depthbuf = bufferView(ctx.depthbuf_storage, img.size(), CV_32F);
+			const bool with_alpha = mesh.tex.channels() == 4;
+			for (int r = 0; r < img.rows; ++r)
+			{
+				const float* gl_depth = m_gl_depthbuf.ptr<float>(r);
+				const cv::Vec4b* color = m_colorbuf.ptr<cv::Vec4b>(r);
+				float* depth = ctx.depthbuf.ptr<float>(r);
+				cv::Vec3b* img_data = img.ptr<cv::Vec3b>(r);
+				for (int c = 0; c < img.cols; ++c)
+				{
+					if (gl_depth[c] >= 1.0f)
+					{
+						depth[c] = std::numeric_limits<float>::max();
+						continue;
+					}
+					depth[c] = min_depth + gl_depth[c] * depth_range;
+
+					// The color buffer is in RGBA order
+					const float alpha = with_alpha ? color[c][3] / 255.0f : 1.0f;
+					cv::Vec3b& img_color = img_data[c];
+					img_color[0] = (uchar)std::round(alpha*color[c][2] + (1 - alpha)*img_color[0]);
+					img_color[1] = (uchar)std::round(alpha*color[c][1] + (1 - alpha)*img_color[1]);
+					img_color[2] = (uchar)std::round(alpha*color[c][0] + (1 - alpha)*img_color[2]);
+
+					// Set background depth for small alpha values
+					if (alpha < 0.1f) depth[c] = std::numeric_limits<float>::max();
+				}
+			}
+		}
+
+		std::string name() const
+		{
+			return "osmesa";
+		}
+
+	private:
+		OSMesaContext m_context = nullptr;
+		GLuint m_texture = 0;
+		cv::Mat m_colorbuf;
+		cv::Mat m_gl_depthbuf;
+		cv::Mat m_vertices;
+		std::vector<unsigned short> m_indices;
+	};
+
+	std::shared_ptr<RenderBackend> createOSMesaRenderBackend()
+	{
+		return std::make_shared<OSMesaRenderBackend>();
+	}
+
+}   // namespace face_swap
@@ -1,8 +1,16 @@
 #include "face_swap/render_utilities.h"
 #include "face_swap/utilities.h"
+#include "face_swap/mesh_utilities.h"
 #include <iostream>	// Debug
 
+// std
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
 // OpenCV
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/highgui.hpp>	// Debug
@@ -12,10 +20,8 @@ namespace face_swap
     void renderWireframe(cv::Mat& img, const Mesh& mesh, const cv::Mat& P, 
         float scale, const cv::Scalar& color)
     {
-        cv::Mat vertices = mesh.vertices.t();
-        vertices.push_back(cv::Mat::ones(1, vertices.cols, CV_32F));
-        cv::Mat proj = P * vertices;
-        proj = proj / cv::repeat(proj.row(2), 3, 1);
+        cv::Mat proj;
+        projectVertices(mesh.vertices, P, &proj);
 
         if (scale != 1.0f)
             cv::resize(img, img, cv::Size(), scale, scale, cv::INTER_CUBIC);
@@ -28,9 +34,9 @@ namespace face_swap
             int i1 = (int)*faces_data++;
             int i2 = (int)*faces_data++;
             int i3 = (int)*faces_data++;
-            cv::Point p1(std::round(proj.at<float>(0, i1))*scale, std::round(proj.at<float>(1, i1))*scale);
-            cv::Point p2(std::round(proj.at<float>(0, i2))*scale, std::round(proj.at<float>(1, i2))*scale);
-            cv::Point p3(std::round(proj.at<float>(0, i3))*scale, std::round(proj.at<float>(1, i3))*scale);
+            cv::Point p1(std::round(proj.at<float>(i1, 0))*scale, std::round(proj.at<float>(i1, 1))*scale);
+            cv::Point p2(std::round(proj.at<float>(i2, 0))*scale, std::round(proj.at<float>(i2, 1))*scale);
+            cv::Point p3(std::round(proj.at<float>(i3, 0))*scale, std::round(proj.at<float>(i3, 1))*scale);
             if (is_ccw(p1, p2, p3))
             {
                 // Draw face
@@ -46,9 +52,10 @@ namespace face_swap
         float scale, const cv::Scalar& color)
     {
         // Project points to image plane
-        cv::Mat distCoef = cv::Mat::zeros(1, 4, CV_32F);
-        std::vector<cv::Point2f> proj;
-        cv::projectPoints(mesh.vertices, rvec, tvec, K, distCoef, proj);
+        cv::Mat P = createPerspectiveProj3x4(rvec, tvec, K);
+        cv::Mat proj_mat;
+        projectVertices(mesh.vertices, P, &proj_mat);
+        const cv::Point2f* proj = (const cv::Point2f*)proj_mat.data;
 
         if (scale != 1.0f)
             cv::resize(img, img, cv::Size(), scale, scale, cv::INTER_CUBIC);
@@ -107,169 +114,802 @@ namespace face_swap
     {
     }
 
+	// Rasterizer tile size in pixels (must be a multiple of 8 for bit-packed masks)
+	const int RASTER_TILE_SIZE = 32;
+
+	// Number of depth buckets used for ordering the triangles from front to back
+	const int SORT_DEPTH_BUCKETS = 256;
+
+	// Minimum texture mipmap size
+	const int MIN_MIPMAP_SIZE = 4;
+
+	cv::Mat bufferView(cv::Mat& buf, const cv::Size& size, int type)
+	{
+		if (buf.type() != type || buf.rows < size.height || buf.cols < size.width)
+		{
+			const bool grow = buf.type() == type;
+			buf.create(grow ? std::max(buf.rows, size.height) : size.height,
+				grow ? std::max(buf.cols, size.width) : size.width, type);
+		}
+		return buf(cv::Rect(cv::Point(), size));
+	}
+
+	/** Project the vertices of a mesh to views of the render context's vertex buffers.
+	@param mesh The mesh to project.
+	@param rvec Euler angles (Pitch, Yaw, Roll) [3x1].
+	@param tvec translation vector [3x1].
+	@param K Intrinsic camera matrix [3x3].
+	@param ctx Render context, the projected vertices are written to ctx.vertices_proj
+	and, if with_depth is true, their depth to ctx.vertices_depth.
+	@param with_depth Toggle calculating the depth of the vertices.
+	*/
+	static void projectMesh(const Mesh& mesh, const cv::Mat& rvec, const cv::Mat& tvec,
+		const cv::Mat& K, RenderContext& ctx, bool with_depth)
+	{
+		cv::Matx34f P;
+		createPerspectiveProj3x4(rvec, tvec, K, P);
+		const int n = mesh.vertices.rows;
+		ctx.vertices_proj = bufferView(ctx.vertices_proj_storage, cv::Size(2, n), CV_32F);
+		if (with_depth)
+			ctx.vertices_depth = bufferView(ctx.vertices_depth_storage, cv::Size(1, n), CV_32F);
+		projectVertices(mesh.vertices, P, &ctx.vertices_proj,
+			with_depth ? &ctx.vertices_depth : nullptr);
+	}
+
 	inline float barycentric_weight(const cv::Point2f& p1, const cv::Point2f& p2, const cv::Point2f& p3)
 	{
 		return (p3.x - p1.x) * (p2.y - p1.y) - (p3.y - p1.y) * (p2.x - p1.x);
 	};
 
-	void renderMesh(cv::Mat& img, const Mesh& mesh,
-		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
-		cv::Mat& depthbuf, int ss)
+#if CV_SIMD128
+	/// Per lane select, returns a where mask is set and b otherwise.
+	inline cv::v_float32x4 selectf(const cv::v_float32x4& mask,
+		const cv::v_float32x4& a, const cv::v_float32x4& b)
 	{
-		if (ss > 1)
-			cv::resize(img, img, cv::Size(), (double)ss, (double)ss, cv::INTER_CUBIC);
+		return (a & mask) | (b & ~mask);
+	}
+#endif
 
-		// Project points to image plane
-		cv::Mat P = createPerspectiveProj3x4(rvec, tvec, K);
-		cv::Mat vertices_h;		// 4 X N
-		cv::vconcat(mesh.vertices.t(), cv::Mat::ones(1, mesh.vertices.rows, CV_32F), vertices_h);
-		cv::Mat proj = P * vertices_h;	// 3 X N
+	// Antialiasing sample offsets from the pixel center (rotated grid)
+	const int AA_SAMPLES = 4;
+	const float AA_SAMPLE_X[AA_SAMPLES] = { -0.125f, 0.375f, -0.375f, 0.125f };
+	const float AA_SAMPLE_Y[AA_SAMPLES] = { -0.375f, -0.125f, 0.125f, 0.375f };
 
-		//cv::Mat M = P(cv::Rect(0, 0, 3, 3));
-		//double dM = cv::determinant(M);
-		//float m3 = cv::norm(M.rowRange(2, 3));	
+	/** Edge functions of a triangle: w[k](x, y) = w0[k] + dx[k] * (x - bbox.x) + dy[k] * (y - bbox.y).
+	They are evaluated relative to the first pixel center of the bounding box for precision.
+	*/
+	struct EdgeFunctions
+	{
+		EdgeFunctions(const cv::Point2f* p, const cv::Rect& bbox)
+		{
+			const cv::Point2f origin(bbox.x + 0.5f, bbox.y + 0.5f);
+			for (int k = 0; k < 3; ++k)
+			{
+				const cv::Point2f& a = p[(k + 1) % 3];
+				const cv::Point2f& b = p[(k + 2) % 3];
+				w0[k] = barycentric_weight(a, b, origin);
+				dx[k] = b.y - a.y;
+				dy[k] = a.x - b.x;
+			}
+		}
 
-		// Calculate image coordinates and depth
-		cv::Mat vertices_proj(mesh.vertices.rows, 2, CV_32F);
-		cv::Mat vertices_depth(mesh.vertices.rows, 1, CV_32F);
-		float* vertices_proj_data = (float*)vertices_proj.data;
-		float* vertices_depth_data = (float*)vertices_depth.data;
-		for (int i = 0; i < mesh.vertices.rows; ++i)
+		float w0[3], dx[3], dy[3];
+	};
+
+	/** Rasterize a single front facing triangle's coverage into a mask.
+	@param p The triangle's projected points.
+	@param bbox The pixels to rasterize, must be inside the mask.
+	@param mask Coverage mask [CV_8U], either a byte per pixel or bit-packed.
+	@param bit_packed If true, pixel x is bit (x % 8) of byte (x / 8) in each row.
+	*/
+	static void rasterizeTriangleCoverage(const cv::Point2f* p, const cv::Rect& bbox,
+		cv::Mat& mask, bool bit_packed)
+	{
+		if (!(barycentric_weight(p[0], p[1], p[2]) > 0.0f) || bbox.width <= 0 || bbox.height <= 0)
+			return;
+		const EdgeFunctions edges(p, bbox);
+		const float* dx = edges.dx;
+
+#if CV_SIMD128
+		const cv::v_float32x4 steps(0.0f, 1.0f, 2.0f, 3.0f);
+		const cv::v_float32x4 zero = cv::v_setzero_f32();
+		const cv::v_float32x4 vdx0 = cv::v_setall_f32(dx[0]), vdx1 = cv::v_setall_f32(dx[1]);
+		const cv::v_float32x4 vdx2 = cv::v_setall_f32(dx[2]);
+#endif
+		for (int r = 0; r < bbox.height; ++r)
 		{
-			float x = proj.at<float>(0, i);
-			float y = proj.at<float>(1, i);
-			float w = proj.at<float>(2, i);
-			*vertices_proj_data++ = x / w;
-			*vertices_proj_data++ = y / w;
-			*vertices_depth_data++ = -w;
+			const float fr = (float)r;
+			const float w1 = edges.w0[0] + edges.dy[0] * fr;
+			const float w2 = edges.w0[1] + edges.dy[1] * fr;
+			const float w3 = edges.w0[2] + edges.dy[2] * fr;
+			unsigned char* mask_data = mask.ptr<unsigned char>(bbox.y + r);
+
+			int c = 0;
+#if CV_SIMD128
+			const cv::v_float32x4 vw1 = cv::v_setall_f32(w1), vw2 = cv::v_setall_f32(w2);
+			const cv::v_float32x4 vw3 = cv::v_setall_f32(w3);
+			for (; c <= bbox.width - 4; c += 4)
+			{
+				const cv::v_float32x4 vc = cv::v_setall_f32((float)c) + steps;
+				const int inside = cv::v_signmask((vdx0 * vc + vw1 >= zero) &
+					(vdx1 * vc + vw2 >= zero) & (vdx2 * vc + vw3 >= zero));
+				for (int j = 0; j < 4; ++j)
+				{
+					if ((inside & (1 << j)) == 0) continue;
+					const int x = bbox.x + c + j;
+					if (bit_packed) mask_data[x >> 3] |= (unsigned char)(1 << (x & 7));
+					else mask_data[x] = 255;
+				}
+			}
+#endif
+			for (; c < bbox.width; ++c)
+			{
+				const float fc = (float)c;
+				if (w1 + dx[0] * fc < 0.0f || w2 + dx[1] * fc < 0.0f || w3 + dx[2] * fc < 0.0f)
+					continue;
+				const int x = bbox.x + c;
+				if (bit_packed) mask_data[x >> 3] |= (unsigned char)(1 << (x & 7));
+				else mask_data[x] = 255;
+			}
 		}
+	}
 
-		if (ss > 1)
-			vertices_proj *= (float)ss;
+	/** Rasterize a single front facing triangle into the depth and texture coordinates buffers.
+	The edge functions and the depth and texture coordinates planes are set up once per triangle
+	and then evaluated for several pixels at a time. The depth and texture coordinates are
+	always evaluated at the pixel centers.
+	@param p The triangle's projected points.
+	@param depth The depth of each of the triangle's points.
+	@param uv The texture coordinates of each of the triangle's points (in pixels).
+	@param bbox The pixels to rasterize, must be inside the buffers.
+	@param depthbuf Depth buffer [CV_32F].
+	@param uvbuf Texture coordinates buffer [CV_32FC2].
+	@param coveragebuf Per pixel antialiasing sample mask [CV_8U], same size as uvbuf.
+	If empty, only the pixel centers are tested for coverage.
+	@param levelbuf Per pixel texture mipmap level [CV_8U], same size as uvbuf.
+	@param buf_tl The image position of the top left pixel of uvbuf, coveragebuf and levelbuf.
+	@param max_level The coarsest mipmap level available.
+	@return The mipmap level selected for the triangle or -1 if it was skipped.
+	*/
+	static int rasterizeTriangle(const cv::Point2f* p, const float* depth, const cv::Point2f* uv,
+		const cv::Rect& bbox, cv::Mat& depthbuf, cv::Mat& uvbuf, cv::Mat& coveragebuf,
+		cv::Mat& levelbuf, const cv::Point& buf_tl, int max_level)
+	{
+		const float area = barycentric_weight(p[0], p[1], p[2]);
+		if (!(area > 0.0f) || bbox.width <= 0 || bbox.height <= 0) return -1;
+		const float inv_area = 1.0f / area;
+		const EdgeFunctions edges(p, bbox);
+		const float* w0 = edges.w0;
+		const float* dx = edges.dx;
+		const float* dy = edges.dy;
 
-		// Initialize buffers
-		depthbuf = cv::Mat(img.size(), CV_32F, std::numeric_limits<float>::max());
-		cv::Mat uvbuf(img.size(), CV_32FC2, -1.0f);
+		// Edge function offsets of the antialiasing samples relative to the pixel center
+		const bool antialias = !coveragebuf.empty();
+		const int samples = antialias ? AA_SAMPLES : 1;
+		float sample_offset[AA_SAMPLES][3] = {};
+		if (antialias)
+		{
+			for (int s = 0; s < AA_SAMPLES; ++s)
+				for (int k = 0; k < 3; ++k)
+					sample_offset[s][k] = dx[k] * AA_SAMPLE_X[s] + dy[k] * AA_SAMPLE_Y[s];
+		}
+
+		// Attribute planes: attr(x, y) = attr0 + attr_dx * (x - bbox.x) + attr_dy * (y - bbox.y)
+		float z0 = 0, z_dx = 0, z_dy = 0, u0 = 0, u_dx = 0, u_dy = 0, v0 = 0, v_dx = 0, v_dy = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			const float g0 = w0[k] * inv_area, g_dx = dx[k] * inv_area, g_dy = dy[k] * inv_area;
+			z0 += g0 * depth[k]; z_dx += g_dx * depth[k]; z_dy += g_dy * depth[k];
+			u0 += g0 * uv[k].x; u_dx += g_dx * uv[k].x; u_dy += g_dy * uv[k].x;
+			v0 += g0 * uv[k].y; v_dx += g_dx * uv[k].y; v_dy += g_dy * uv[k].y;
+		}
+
+		// Select the mipmap level from the texture footprint of a pixel
+		const float footprint_sqr = std::max(u_dx * u_dx + v_dx * v_dx, u_dy * u_dy + v_dy * v_dy);
+		const int level = footprint_sqr > 1.0f ?
+			std::min((int)std::floor(0.5f * std::log2(footprint_sqr) + 0.5f), max_level) : 0;
+
+#if CV_SIMD128
+		const cv::v_float32x4 steps(0.0f, 1.0f, 2.0f, 3.0f);
+		const cv::v_float32x4 zero = cv::v_setzero_f32();
+		const cv::v_float32x4 vdx0 = cv::v_setall_f32(dx[0]), vdx1 = cv::v_setall_f32(dx[1]);
+		const cv::v_float32x4 vdx2 = cv::v_setall_f32(dx[2]), vz_dx = cv::v_setall_f32(z_dx);
+#endif
+		for (int r = 0; r < bbox.height; ++r)
+		{
+			// Row start values
+			const float fr = (float)r;
+			const float w1 = w0[0] + dy[0] * fr, w2 = w0[1] + dy[1] * fr, w3 = w0[2] + dy[2] * fr;
+			const float z = z0 + z_dy * fr, u = u0 + u_dy * fr, v = v0 + v_dy * fr;
+			float* depthbuf_data = depthbuf.ptr<float>(bbox.y + r, bbox.x);
+			float* uvbuf_data = (float*)uvbuf.ptr<cv::Point2f>(
+				bbox.y + r - buf_tl.y, bbox.x - buf_tl.x);
+			unsigned char* coveragebuf_data = antialias ? coveragebuf.ptr<unsigned char>(
+				bbox.y + r - buf_tl.y, bbox.x - buf_tl.x) : nullptr;
+			unsigned char* levelbuf_data = levelbuf.ptr<unsigned char>(
+				bbox.y + r - buf_tl.y, bbox.x - buf_tl.x);
+
+			int c = 0;
+#if CV_SIMD128
+			for (; c <= bbox.width - 4; c += 4)
+			{
+				// Sample coverage, one bit per sample for each of the pixels
+				const cv::v_float32x4 vc = cv::v_setall_f32((float)c) + steps;
+				cv::v_float32x4 inside = zero;
+				int sample_masks[AA_SAMPLES];
+				for (int s = 0; s < samples; ++s)
+				{
+					const cv::v_float32x4 sample_inside =
+						(vdx0 * vc + cv::v_setall_f32(w1 + sample_offset[s][0]) >= zero) &
+						(vdx1 * vc + cv::v_setall_f32(w2 + sample_offset[s][1]) >= zero) &
+						(vdx2 * vc + cv::v_setall_f32(w3 + sample_offset[s][2]) >= zero);
+					sample_masks[s] = cv::v_signmask(sample_inside);
+					inside = inside | sample_inside;
+				}
+				if (!cv::v_check_any(inside)) continue;
+				if (antialias)
+				{
+					for (int j = 0; j < 4; ++j)
+						for (int s = 0; s < AA_SAMPLES; ++s)
+							coveragebuf_data[c + j] |= ((sample_masks[s] >> j) & 1) << s;
+				}
+
+				// Depth test
+				const cv::v_float32x4 new_depth = vz_dx * vc + cv::v_setall_f32(z);
+				const cv::v_float32x4 old_depth = cv::v_load(depthbuf_data + c);
+				const cv::v_float32x4 pass = inside & (new_depth < old_depth);
+				const int pass_mask = cv::v_signmask(pass);
+				if (pass_mask == 0) continue;
+				cv::v_store(depthbuf_data + c, selectf(pass, new_depth, old_depth));
+
+				// Texture coordinates
+				for (int j = 0; j < 4; ++j)
+				{
+					if ((pass_mask & (1 << j)) == 0) continue;
+					const float fc = (float)(c + j);
+					uvbuf_data[2 * (c + j)] = u + u_dx * fc;
+					uvbuf_data[2 * (c + j) + 1] = v + v_dx * fc;
+					levelbuf_data[c + j] = (unsigned char)level;
+				}
+			}
+#endif
+			for (; c < bbox.width; ++c)
+			{
+				// Sample coverage
+				const float fc = (float)c;
+				int sample_mask = 0;
+				for (int s = 0; s < samples; ++s)
+				{
+					if (w1 + sample_offset[s][0] + dx[0] * fc >= 0.0f &&
+						w2 + sample_offset[s][1] + dx[1] * fc >= 0.0f &&
+						w3 + sample_offset[s][2] + dx[2] * fc >= 0.0f)
+						sample_mask |= 1 << s;
+				}
+				if (sample_mask == 0) continue;
+				if (antialias) coveragebuf_data[c] |= (unsigned char)sample_mask;
+
+				// Depth test
+				const float new_depth = z + z_dx * fc;
+				if (new_depth < depthbuf_data[c])
+				{
+					depthbuf_data[c] = new_depth;
+					uvbuf_data[2 * c] = u + u_dx * fc;
+					uvbuf_data[2 * c + 1] = v + v_dx * fc;
+					levelbuf_data[c] = (unsigned char)level;
+				}
+			}
+		}
+
+		return level;
+	}
+
+	/** Sample a BGRA texture with bilinear interpolation.
+	Texel centers are at integer coordinates and the texture is surrounded by a zero border.
+	@param tex The texture [CV_8UC4].
+	@param x Horizontal texture coordinate in texels.
+	@param y Vertical texture coordinate in texels.
+	@param out The sampled BGRA color.
+	*/
+	static inline void sampleBilinear(const cv::Mat& tex, float x, float y, float* out)
+	{
+		const int x0 = cvFloor(x), y0 = cvFloor(y);
+		const float fx = x - x0, fy = y - y0;
+
+		// Fast path for samples with all 4 texels inside the texture
+		if (x0 >= 0 && y0 >= 0 && x0 + 1 < tex.cols && y0 + 1 < tex.rows)
+		{
+			const unsigned char* p0 = tex.ptr<unsigned char>(y0, x0);
+			const unsigned char* p1 = tex.ptr<unsigned char>(y0 + 1, x0);
+#if CV_SIMD128
+			const cv::v_float32x4 c00 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::v_load_expand_q(p0)));
+			const cv::v_float32x4 c01 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::v_load_expand_q(p0 + 4)));
+			const cv::v_float32x4 c10 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::v_load_expand_q(p1)));
+			const cv::v_float32x4 c11 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::v_load_expand_q(p1 + 4)));
+			const cv::v_float32x4 vfx = cv::v_setall_f32(fx), vfy = cv::v_setall_f32(fy);
+			const cv::v_float32x4 top = c00 + (c01 - c00) * vfx;
+			const cv::v_float32x4 bottom = c10 + (c11 - c10) * vfx;
+			cv::v_store(out, top + (bottom - top) * vfy);
+#else
+			for (int k = 0; k < 4; ++k)
+			{
+				const float top = p0[k] + (p0[k + 4] - p0[k]) * fx;
+				const float bottom = p1[k] + (p1[k + 4] - p1[k]) * fx;
+				out[k] = top + (bottom - top) * fy;
+			}
+#endif
+			return;
+		}
+
+		// Border samples
+		out[0] = out[1] = out[2] = out[3] = 0.0f;
+		for (int dy = 0; dy < 2; ++dy)
+		{
+			const int yi = y0 + dy;
+			if (yi < 0 || yi >= tex.rows) continue;
+			const float wy = dy ? fy : 1.0f - fy;
+			for (int dx = 0; dx < 2; ++dx)
+			{
+				const int xi = x0 + dx;
+				if (xi < 0 || xi >= tex.cols) continue;
+				const float w = wy * (dx ? fx : 1.0f - fx);
+				const unsigned char* texel = tex.ptr<unsigned char>(yi, xi);
+				for (int k = 0; k < 4; ++k)
+					out[k] += w * texel[k];
+			}
+		}
+	}
+
+	/** Check if two images have the same size, type and contents.
+	*/
+	static bool sameContents(const cv::Mat& a, const cv::Mat& b)
+	{
+		if (a.size() != b.size() || a.type() != b.type()) return false;
+		const size_t row_size = a.cols * a.elemSize();
+		for (int r = 0; r < a.rows; ++r)
+			if (memcmp(a.ptr(r), b.ptr(r), row_size) != 0) return false;
+		return true;
+	}
+
+	/** Convert a BGR or BGRA texture to BGRA with premultiplied alpha.
+	*/
+	static void premultiplyAlpha(const cv::Mat& tex, cv::Mat& out)
+	{
+		if (tex.channels() == 3)
+		{
+			cv::cvtColor(tex, out, cv::COLOR_BGR2BGRA);
+			return;
+		}
+		out.create(tex.size(), CV_8UC4);
+		for (int r = 0; r < tex.rows; ++r)
+		{
+			const unsigned char* tex_data = tex.ptr<unsigned char>(r);
+			unsigned char* out_data = out.ptr<unsigned char>(r);
+			for (int c = 0; c < 4 * tex.cols; c += 4)
+			{
+				const int alpha = tex_data[c + 3];
+				out_data[c] = (unsigned char)((tex_data[c] * alpha + 127) / 255);
+				out_data[c + 1] = (unsigned char)((tex_data[c + 1] * alpha + 127) / 255);
+				out_data[c + 2] = (unsigned char)((tex_data[c + 2] * alpha + 127) / 255);
+				out_data[c + 3] = (unsigned char)alpha;
+			}
+		}
+	}
+
+	/** Cull the back facing and off screen triangles of a projected mesh.
+	The remaining triangles are coarsely sorted from front to back by their mean depth.
+	@param proj Projected vertices.
+	@param depth Vertices depth. If null, the triangles are kept in storage order.
+	@param faces Mesh faces [F x 3].
+	@param size Image size.
+	@param ctx Render context, the indices of the visible faces are written to ctx.visible.
+	*/
+	static void cullTriangles(const cv::Point2f* proj, const float* depth, const cv::Mat& faces,
+		const cv::Size& size, RenderContext& ctx)
+	{
+		// Mark the front facing triangles overlapping the image
+		const int total_faces = faces.rows;
+		const unsigned short* faces_data = (const unsigned short*)faces.data;
+		const float max_x = (float)size.width, max_y = (float)size.height;
+		std::vector<unsigned char>& face_visible = ctx.face_visible;
+		face_visible.resize(total_faces);
+		cv::parallel_for_(cv::Range(0, total_faces), [&](const cv::Range& range)
+		{
+			int f = range.start;
+#if CV_SIMD128
+			const cv::v_float32x4 zero = cv::v_setzero_f32(), one = cv::v_setall_f32(1.0f);
+			const cv::v_float32x4 vmax_x = cv::v_setall_f32(max_x), vmax_y = cv::v_setall_f32(max_y);
+			for (; f <= range.end - 4; f += 4)
+			{
+				const unsigned short* fd = faces_data + 3 * f;
+				const cv::v_float32x4 x1(proj[fd[0]].x, proj[fd[3]].x, proj[fd[6]].x, proj[fd[9]].x);
+				const cv::v_float32x4 y1(proj[fd[0]].y, proj[fd[3]].y, proj[fd[6]].y, proj[fd[9]].y);
+				const cv::v_float32x4 x2(proj[fd[1]].x, proj[fd[4]].x, proj[fd[7]].x, proj[fd[10]].x);
+				const cv::v_float32x4 y2(proj[fd[1]].y, proj[fd[4]].y, proj[fd[7]].y, proj[fd[10]].y);
+				const cv::v_float32x4 x3(proj[fd[2]].x, proj[fd[5]].x, proj[fd[8]].x, proj[fd[11]].x);
+				const cv::v_float32x4 y3(proj[fd[2]].y, proj[fd[5]].y, proj[fd[8]].y, proj[fd[11]].y);
+				const cv::v_float32x4 ccw = (x2 - x1) * (y3 - y1) - (x3 - x1) * (y2 - y1) < zero;
+				const cv::v_float32x4 on_screen =
+					(cv::v_max(x1, cv::v_max(x2, x3)) >= zero - one) &
+					(cv::v_min(x1, cv::v_min(x2, x3)) <= vmax_x) &
+					(cv::v_max(y1, cv::v_max(y2, y3)) >= zero - one) &
+					(cv::v_min(y1, cv::v_min(y2, y3)) <= vmax_y);
+				const int mask = cv::v_signmask(ccw & on_screen);
+				for (int j = 0; j < 4; ++j)
+					face_visible[f + j] = (mask >> j) & 1;
+			}
+#endif
+			for (; f < range.end; ++f)
+			{
+				const cv::Point2f& p1 = proj[faces_data[3 * f]];
+				const cv::Point2f& p2 = proj[faces_data[3 * f + 1]];
+				const cv::Point2f& p3 = proj[faces_data[3 * f + 2]];
+				face_visible[f] = is_ccw(p1, p2, p3) &&
+					std::max(p1.x, std::max(p2.x, p3.x)) >= -1.0f &&
+					std::min(p1.x, std::min(p2.x, p3.x)) <= max_x &&
+					std::max(p1.y, std::max(p2.y, p3.y)) >= -1.0f &&
+					std::min(p1.y, std::min(p2.y, p3.y)) <= max_y;
+			}
+		});
+
+		// Compact the visible triangles and calculate their depth range
+		std::vector<int>& faces_visible = ctx.faces_visible;
+		std::vector<float>& faces_depth = ctx.faces_depth;
+		faces_visible.clear();
+		faces_depth.clear();
+		float min_depth = std::numeric_limits<float>::max();
+		float max_depth = -std::numeric_limits<float>::max();
+		for (int f = 0; f < total_faces; ++f)
+		{
+			if (!face_visible[f]) continue;
+			if (depth == nullptr)
+			{
+				faces_visible.push_back(f);
+				continue;
+			}
+			const float d = (depth[faces_data[3 * f]] + depth[faces_data[3 * f + 1]] +
+				depth[faces_data[3 * f + 2]]) / 3.0f;
+			faces_visible.push_back(f);
+			faces_depth.push_back(d);
+			min_depth = std::min(min_depth, d);
+			max_depth = std::max(max_depth, d);
+		}
 
-		// For each triangle
-		unsigned short* faces_data = (unsigned short*)mesh.faces.data;
-		cv::Point2f* proj_points_data = (cv::Point2f*)vertices_proj.data;
-		for (int f = 0; f < mesh.faces.rows; ++f)
+		// Coarse front to back sort by bucketing the depth
+		std::vector<int>& visible = ctx.visible;
+		if (depth == nullptr)
 		{
-			// Get triangle points
-			int i1 = (int)*faces_data++;
-			int i2 = (int)*faces_data++;
-			int i3 = (int)*faces_data++;
+			visible.assign(faces_visible.begin(), faces_visible.end());
+			return;
+		}
+		visible.resize(faces_visible.size());
+		if (faces_visible.empty()) return;
+		const float scale = max_depth > min_depth ?
+			(SORT_DEPTH_BUCKETS - 1) / (max_depth - min_depth) : 0.0f;
+		std::vector<int>& bucket_offsets = ctx.bucket_offsets;
+		std::vector<int>& face_buckets = ctx.face_buckets;
+		bucket_offsets.assign(SORT_DEPTH_BUCKETS + 1, 0);
+		face_buckets.resize(faces_visible.size());
+		for (size_t i = 0; i < faces_visible.size(); ++i)
+		{
+			const int bucket = std::min(std::max(
+				(int)((faces_depth[i] - min_depth) * scale), 0), SORT_DEPTH_BUCKETS - 1);
+			face_buckets[i] = bucket;
+			++bucket_offsets[bucket + 1];
+		}
+		for (int b = 0; b < SORT_DEPTH_BUCKETS; ++b)
+			bucket_offsets[b + 1] += bucket_offsets[b];
+		for (size_t i = 0; i < faces_visible.size(); ++i)
+			visible[bucket_offsets[face_buckets[i]]++] = faces_visible[i];
+	}
 
-			cv::Point2f& p1 = proj_points_data[i1];
-			cv::Point2f& p2 = proj_points_data[i2];
-			cv::Point2f& p3 = proj_points_data[i3];
-			if (!is_ccw(p1, p2, p3)) continue;
+	/** Bin the visible triangles of a projected mesh into screen tiles.
+	@param proj_points_data Projected vertices.
+	@param faces_data Mesh faces.
+	@param size Image size.
+	@param ctx Render context, ctx.visible are binned into ctx.tile_offsets and ctx.tile_tris
+	and their bounding boxes are written to ctx.tri_bboxes.
+	@return The bounding box of all the binned triangles.
+	*/
+	static cv::Rect binTriangles(const cv::Point2f* proj_points_data, const unsigned short* faces_data,
+		const cv::Size& size, RenderContext& ctx)
+	{
+		const std::vector<int>& visible = ctx.visible;
+		const int total_visible = (int)visible.size();
+		const int tiles_x = (size.width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		const int tiles_y = (size.height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		std::vector<cv::Rect>& tri_bboxes = ctx.tri_bboxes;
+		std::vector<int>& tile_offsets = ctx.tile_offsets;
+		tri_bboxes.resize(total_visible);
+		tile_offsets.assign(tiles_x * tiles_y + 1, 0);
+		cv::Rect mesh_bbox;
+		for (int i = 0; i < total_visible; ++i)
+		{
+			const int f = visible[i];
+			const cv::Point2f& p1 = proj_points_data[faces_data[3 * f]];
+			const cv::Point2f& p2 = proj_points_data[faces_data[3 * f + 1]];
+			const cv::Point2f& p3 = proj_points_data[faces_data[3 * f + 2]];
 
-			// Calculate triangle's bounding box
+			// Calculate triangle's bounding box (inclusive)
 			const int min_x = std::max(std::min(std::floor(p1.x), std::min(std::floor(p2.x), std::floor(p3.x))), 0.0f);
-			const int max_x = std::min(std::max(std::ceil(p1.x), std::max(std::ceil(p2.x), std::ceil(p3.x))), (float)(img.cols - 1));
+			const int max_x = std::min(std::max(std::ceil(p1.x), std::max(std::ceil(p2.x), std::ceil(p3.x))), (float)(size.width - 1));
 			const int min_y = std::max(std::min(std::floor(p1.y), std::min(std::floor(p2.y), std::floor(p3.y))), 0.0f);
-			const int max_y = std::min(std::max(std::ceil(p1.y), std::max(std::ceil(p2.y), std::ceil(p3.y))), (float)(img.rows - 1));
+			const int max_y = std::min(std::max(std::ceil(p1.y), std::max(std::ceil(p2.y), std::ceil(p3.y))), (float)(size.height - 1));
+			cv::Rect& bbox = tri_bboxes[i];
+			bbox = cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+			if (bbox.width <= 0 || bbox.height <= 0) continue;
+			mesh_bbox |= bbox;
+
+			// Count the triangle in each of the tiles it overlaps
+			for (int ty = min_y / RASTER_TILE_SIZE; ty <= max_y / RASTER_TILE_SIZE; ++ty)
+				for (int tx = min_x / RASTER_TILE_SIZE; tx <= max_x / RASTER_TILE_SIZE; ++tx)
+					++tile_offsets[ty * tiles_x + tx + 1];
+		}
+		for (int i = 0; i < tiles_x * tiles_y; ++i)
+			tile_offsets[i + 1] += tile_offsets[i];
+		std::vector<int>& tile_tris = ctx.tile_tris;
+		std::vector<int>& tile_pos = ctx.tile_pos;
+		tile_tris.resize(tile_offsets.back());
+		tile_pos.assign(tile_offsets.begin(), tile_offsets.end() - 1);
+		for (int i = 0; i < total_visible; ++i)
+		{
+			const cv::Rect& bbox = tri_bboxes[i];
+			if (bbox.width <= 0 || bbox.height <= 0) continue;
+			const int max_x = bbox.x + bbox.width - 1, max_y = bbox.y + bbox.height - 1;
+			for (int ty = bbox.y / RASTER_TILE_SIZE; ty <= max_y / RASTER_TILE_SIZE; ++ty)
+				for (int tx = bbox.x / RASTER_TILE_SIZE; tx <= max_x / RASTER_TILE_SIZE; ++tx)
+					tile_tris[tile_pos[ty * tiles_x + tx]++] = i;
+		}
+
+		return mesh_bbox;
+	}
+
+	void renderMesh(cv::Mat& img, const Mesh& mesh,
+		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+		cv::Mat& depthbuf, AntialiasMode antialias)
+	{
+		RenderContext ctx;
+		renderMesh(img, mesh, rvec, tvec, K, ctx, antialias);
+		depthbuf = ctx.depthbuf;
+	}
+
+	void renderMesh(cv::Mat& img, const Mesh& mesh,
+		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+		RenderContext& ctx, AntialiasMode antialias_mode)
+	{
+		const bool antialias = antialias_mode == ANTIALIAS_COVERAGE;
+
+		// Calculate image coordinates and depth
+		projectMesh(mesh, rvec, tvec, K, ctx, true);
+
+		// Initialize buffers
+		ctx.depthbuf = bufferView(ctx.depthbuf_storage, img.size(), CV_32F);
+		ctx.depthbuf.setTo(std::numeric_limits<float>::max());
+		cv::Mat& depthbuf = ctx.depthbuf;
+
+		// Cull the hidden triangles and order the rest from front to back
+		const unsigned short* faces_data = (const unsigned short*)mesh.faces.data;
+		const cv::Point2f* proj_points_data = (const cv::Point2f*)ctx.vertices_proj.data;
+		const float* vertices_depth_data = (const float*)ctx.vertices_depth.data;
+		cullTriangles(proj_points_data, vertices_depth_data, mesh.faces, img.size(), ctx);
+		const std::vector<int>& visible = ctx.visible;
 
-			// For each pixel in the triangle's bounding box
-			for (int yi = min_y; yi <= max_y; ++yi)
+		// Bin the visible triangles into screen tiles
+		const int tiles_x = (img.cols + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		const int tiles_y = (img.rows + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		const cv::Rect mesh_bbox = binTriangles(proj_points_data, faces_data, img.size(), ctx);
+		const std::vector<cv::Rect>& tri_bboxes = ctx.tri_bboxes;
+		const std::vector<int>& tile_offsets = ctx.tile_offsets;
+		const std::vector<int>& tile_tris = ctx.tile_tris;
+
+		// Only the part of the buffers covering the projected mesh is used
+		if (mesh_bbox.area() == 0) return;
+		cv::Mat uvbuf = bufferView(ctx.uvbuf, mesh_bbox.size(), CV_32FC2);
+		cv::Mat levelbuf = bufferView(ctx.levelbuf, mesh_bbox.size(), CV_8U);
+		cv::Mat coveragebuf;
+		if (antialias)
+		{
+			coveragebuf = bufferView(ctx.coveragebuf, mesh_bbox.size(), CV_8U);
+			coveragebuf.setTo(0);
+		}
+
+		// Rasterize the tiles in parallel. The triangles of each tile are processed
+		// from front to back so most occluded pixels fail the depth test early
+		const float* uv_data = (const float*)mesh.uv.data;
+		const float tex_width = (float)mesh.tex.cols, tex_height = (float)mesh.tex.rows;
+		int max_level = 0;
+		for (int w = std::min(mesh.tex.cols, mesh.tex.rows);
+			w >= 2 * MIN_MIPMAP_SIZE && max_level < MAX_MIPMAP_LEVEL; w /= 2)
+			++max_level;
+		std::atomic<int> used_level(0);
+		cv::parallel_for_(cv::Range(0, tiles_x * tiles_y), [&](const cv::Range& range)
+		{
+			int range_level = 0;
+			for (int tile = range.start; tile < range.end; ++tile)
 			{
-				float* depthbuf_data = depthbuf.ptr<float>(yi, min_x);
-				cv::Point2f* uvbuf_data = uvbuf.ptr<cv::Point2f>(yi, min_x);
-				for (int xi = min_x; xi <= max_x; ++xi)
+				cv::Rect tile_rect((tile % tiles_x) * RASTER_TILE_SIZE, (tile / tiles_x) * RASTER_TILE_SIZE,
+					RASTER_TILE_SIZE, RASTER_TILE_SIZE);
+				for (int i = tile_offsets[tile]; i < tile_offsets[tile + 1]; ++i)
 				{
-					// We want centers of pixels to be used in computations. Todo: Do we?
-					const float x = static_cast<float>(xi) + 0.5f;
-					const float y = static_cast<float>(yi) + 0.5f;
-					const cv::Point2f p(x, y);
-
-					// Calculate affine barycentric weights
-					float g1 = barycentric_weight(p2, p3, p);
-					float g2 = barycentric_weight(p3, p1, p);
-					float g3 = barycentric_weight(p1, p2, p);
-					if (g1 >= 0.0f && g2 >= 0.0f && g3 >= 0.0f)
+					// Get triangle vertices and attributes
+					const int t = tile_tris[i], f = visible[t];
+					const int i1 = (int)faces_data[3 * f];
+					const int i2 = (int)faces_data[3 * f + 1];
+					const int i3 = (int)faces_data[3 * f + 2];
+					const cv::Point2f p[3] = {
+						proj_points_data[i1], proj_points_data[i2], proj_points_data[i3] };
+					const float depth[3] = {
+						vertices_depth_data[i1], vertices_depth_data[i2], vertices_depth_data[i3] };
+					const cv::Point2f uv[3] = {
+						cv::Point2f(uv_data[2 * i1] * tex_width, uv_data[2 * i1 + 1] * tex_height),
+						cv::Point2f(uv_data[2 * i2] * tex_width, uv_data[2 * i2 + 1] * tex_height),
+						cv::Point2f(uv_data[2 * i3] * tex_width, uv_data[2 * i3 + 1] * tex_height) };
+
+					// Rasterize the triangle within the tile
+					const int level = rasterizeTriangle(p, depth, uv, tri_bboxes[t] & tile_rect,
+						depthbuf, uvbuf, coveragebuf, levelbuf, mesh_bbox.tl(), max_level);
+					range_level = std::max(range_level, level);
+				}
+			}
+			int prev_level = used_level.load();
+			while (range_level > prev_level &&
+				!used_level.compare_exchange_weak(prev_level, range_level));
+		});
+
+		// Build the texture's mipmaps up to the coarsest level used, in BGRA format with
+		// premultiplied alpha so the colors of transparent texels don't bleed into the
+		// coarser levels. The levels are kept in the context until the texture changes
+		if (ctx.mipmaps_level < 0 || !sameContents(mesh.tex, ctx.mipmaps_tex))
+		{
+			mesh.tex.copyTo(ctx.mipmaps_tex);
+			premultiplyAlpha(mesh.tex, ctx.mipmaps[0]);
+			ctx.mipmaps_level = 0;
+		}
+		for (; ctx.mipmaps_level < used_level; ++ctx.mipmaps_level)
+			cv::pyrDown(ctx.mipmaps[ctx.mipmaps_level], ctx.mipmaps[ctx.mipmaps_level + 1]);
+		const cv::Mat* mipmaps = ctx.mipmaps;
+
+		// Sample the texture for the pixels that passed the depth test and write the
+		// colors to the output image, partially covered pixels are blended with the background
+		cv::parallel_for_(cv::Range(0, mesh_bbox.height), [&](const cv::Range& range)
+		{
+			float color[4];
+			for (int r = range.start; r < range.end; ++r)
+			{
+				float* depthbuf_data = depthbuf.ptr<float>(mesh_bbox.y + r, mesh_bbox.x);
+				const cv::Point2f* uvbuf_data = uvbuf.ptr<cv::Point2f>(r);
+				const unsigned char* levelbuf_data = levelbuf.ptr<unsigned char>(r);
+				const unsigned char* coveragebuf_data =
+					antialias ? coveragebuf.ptr<unsigned char>(r) : nullptr;
+				cv::Vec3b* img_data = img.ptr<cv::Vec3b>(mesh_bbox.y + r, mesh_bbox.x);
+				for (int c = 0; c < mesh_bbox.width; ++c)
+				{
+					if (depthbuf_data[c] >= std::numeric_limits<float>::max()) continue;
+
+					// Sample texture, the texel centers of level l are at (uv + 0.5) / 2^l - 0.5
+					// in the coordinates of level 0
+					const int level = levelbuf_data[c];
+					const float scale = 1.0f / (1 << level), offset = 0.5f * scale - 0.5f;
+					sampleBilinear(mipmaps[level], uvbuf_data[c].x * scale + offset,
+						uvbuf_data[c].y * scale + offset, color);
+
+					// Composite the premultiplied color by the pixel's coverage
+					const float alpha = color[3] / 255.0f;
+					float coverage = 1.0f;
+					if (antialias)
 					{
-						float inv_area = 1.0f / barycentric_weight(p1, p2, p3);
-						g1 *= inv_area;
-						g2 *= inv_area;
-						g3 *= inv_area;
-
-						// Calculate depth
-						float depth = g1 * vertices_depth.at<float>(i1) +
-							g2 * vertices_depth.at<float>(i2) +
-							g3 * vertices_depth.at<float>(i3);
-
-						if (depth < *depthbuf_data)
-						{
-							*depthbuf_data = depth;
-
-							// Calculate texture coordinates
-							float u = g1 * mesh.uv.at<float>(i1, 0) +
-								g2 * mesh.uv.at<float>(i2, 0) +
-								g3 * mesh.uv.at<float>(i3, 0);
-							float v = g1 * mesh.uv.at<float>(i1, 1) +
-								g2 * mesh.uv.at<float>(i2, 1) +
-								g3 * mesh.uv.at<float>(i3, 1);
-							*uvbuf_data = cv::Point2f(u*mesh.tex.cols, v*mesh.tex.rows);
-						}
+						int covered = 0;
+						for (int s = 0; s < AA_SAMPLES; ++s)
+							covered += (coveragebuf_data[c] >> s) & 1;
+						coverage = covered / (float)AA_SAMPLES;
 					}
+					const float blend_alpha = coverage * alpha;
+					cv::Vec3b& img_color = img_data[c];
+					img_color[0] = cv::saturate_cast<uchar>(coverage*color[0] + (1 - blend_alpha)*img_color[0]);
+					img_color[1] = cv::saturate_cast<uchar>(coverage*color[1] + (1 - blend_alpha)*img_color[1]);
+					img_color[2] = cv::saturate_cast<uchar>(coverage*color[2] + (1 - blend_alpha)*img_color[2]);
 
-					++depthbuf_data;
-					++uvbuf_data;
+					// Set background depth for small alpha values
+					if (alpha < 0.1f) depthbuf_data[c] = std::numeric_limits<float>::max();
 				}
 			}
-		}
+		});
+	}
 
-		// Interpolate source texture
-		cv::Mat colorbuf;
-		cv::remap(mesh.tex, colorbuf, uvbuf, cv::Mat(), cv::INTER_CUBIC, cv::BORDER_CONSTANT);
-		
-		// Write colorbuf to output image
-		float* depthbuf_data = (float*)depthbuf.data;
-		if (colorbuf.channels() == 3)
+	void renderMeshMask(cv::Mat& mask, const cv::Size& size, const Mesh& mesh,
+		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+		RenderContext& ctx, bool bit_packed)
+	{
+		// Initialize mask
+		if (bit_packed) mask.create(size.height, (size.width + 7) / 8, CV_8U);
+		else mask.create(size, CV_8U);
+		mask.setTo(0);
+
+		// Calculate image coordinates
+		projectMesh(mesh, rvec, tvec, K, ctx, false);
+
+		// Cull the hidden triangles, their order doesn't matter for coverage
+		const unsigned short* faces_data = (const unsigned short*)mesh.faces.data;
+		const cv::Point2f* proj_points_data = (const cv::Point2f*)ctx.vertices_proj.data;
+		cullTriangles(proj_points_data, nullptr, mesh.faces, size, ctx);
+
+		// Bin the visible triangles into screen tiles
+		const int tiles_x = (size.width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		const int tiles_y = (size.height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		const cv::Rect mesh_bbox = binTriangles(proj_points_data, faces_data, size, ctx);
+		if (mesh_bbox.area() == 0) return;
+
+		// Rasterize the tiles in parallel. The tile size is a multiple of 8 so
+		// the tiles don't share bytes of a bit-packed mask
+		cv::parallel_for_(cv::Range(0, tiles_x * tiles_y), [&](const cv::Range& range)
 		{
-			cv::Vec3b* colorbuf_data = (cv::Vec3b*)colorbuf.data;
-			for (int r = 0; r < img.rows; ++r)
+			for (int tile = range.start; tile < range.end; ++tile)
 			{
-				cv::Vec3b* img_data = img.ptr<cv::Vec3b>(r);
-				for (int c = 0; c < img.cols; ++c)
+				cv::Rect tile_rect((tile % tiles_x) * RASTER_TILE_SIZE, (tile / tiles_x) * RASTER_TILE_SIZE,
+					RASTER_TILE_SIZE, RASTER_TILE_SIZE);
+				for (int i = ctx.tile_offsets[tile]; i < ctx.tile_offsets[tile + 1]; ++i)
 				{
-					if (*depthbuf_data++ < std::numeric_limits<float>::max())
-						*img_data = *colorbuf_data;
-					++img_data;
-					++colorbuf_data;
+					const int t = ctx.tile_tris[i], f = ctx.visible[t];
+					const cv::Point2f p[3] = {
+						proj_points_data[faces_data[3 * f]],
+						proj_points_data[faces_data[3 * f + 1]],
+						proj_points_data[faces_data[3 * f + 2]] };
+					rasterizeTriangleCoverage(p, ctx.tri_bboxes[t] & tile_rect, mask, bit_packed);
 				}
 			}
-		}
-		else if (colorbuf.channels() == 4)
+		});
+	}
+
+	void renderMeshDepth(const cv::Size& size, const Mesh& mesh,
+		const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K, RenderContext& ctx)
+	{
+		// Calculate image coordinates and depth
+		projectMesh(mesh, rvec, tvec, K, ctx, true);
+
+		// Initialize buffers
+		ctx.depthbuf = bufferView(ctx.depthbuf_storage, size, CV_32F);
+		ctx.depthbuf.setTo(std::numeric_limits<float>::max());
+
+		// Cull the hidden triangles and order the rest from front to back
+		const unsigned short* faces_data = (const unsigned short*)mesh.faces.data;
+		const cv::Point2f* proj_points_data = (const cv::Point2f*)ctx.vertices_proj.data;
+		const float* vertices_depth_data = (const float*)ctx.vertices_depth.data;
+		cullTriangles(proj_points_data, vertices_depth_data, mesh.faces, size, ctx);
+
+		// Bin the visible triangles into screen tiles
+		const int tiles_x = (size.width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		const int tiles_y = (size.height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		const cv::Rect mesh_bbox = binTriangles(proj_points_data, faces_data, size, ctx);
+		if (mesh_bbox.area() == 0) return;
+
+		// The texture coordinates are constant so the rasterizer only writes
+		// zeros to the scratch buffers
+		cv::Mat uvbuf = bufferView(ctx.uvbuf, mesh_bbox.size(), CV_32FC2);
+		cv::Mat levelbuf = bufferView(ctx.levelbuf, mesh_bbox.size(), CV_8U);
+		cv::Mat coveragebuf;
+		const cv::Point2f uv[3];
+
+		// Rasterize the tiles in parallel
+		cv::parallel_for_(cv::Range(0, tiles_x * tiles_y), [&](const cv::Range& range)
 		{
-			float alpha = 0.0f;
-			cv::Vec4b* colorbuf_data = (cv::Vec4b*)colorbuf.data;
-			for (int r = 0; r < img.rows; ++r)
+			for (int tile = range.start; tile < range.end; ++tile)
 			{
-				cv::Vec3b* img_data = img.ptr<cv::Vec3b>(r);
-				for (int c = 0; c < img.cols; ++c)
+				cv::Rect tile_rect((tile % tiles_x) * RASTER_TILE_SIZE, (tile / tiles_x) * RASTER_TILE_SIZE,
+					RASTER_TILE_SIZE, RASTER_TILE_SIZE);
+				for (int i = ctx.tile_offsets[tile]; i < ctx.tile_offsets[tile + 1]; ++i)
 				{
-					float& depth = *depthbuf_data;
-					if (depth < std::numeric_limits<float>::max())
-					{
-						alpha = (*colorbuf_data)[3] / 255.0f;
-						cv::Vec3b& out_color = *((cv::Vec3b*)colorbuf_data);
-						cv::Vec3b& img_color = *img_data;
-						img_color[0] = (uchar)std::round(alpha*out_color[0] + (1 - alpha)*img_color[0]);
-						img_color[1] = (uchar)std::round(alpha*out_color[1] + (1 - alpha)*img_color[1]);
-						img_color[2] = (uchar)std::round(alpha*out_color[2] + (1 - alpha)*img_color[2]);
-
-						// Set background depth for small alpha values
-						if (alpha < 0.1f) depth = std::numeric_limits<float>::max();
-					}	
-					++img_data;
-					++depthbuf_data;
-					++colorbuf_data;
+					const int t = ctx.tile_tris[i], f = ctx.visible[t];
+					const int i1 = (int)faces_data[3 * f];
+					const int i2 = (int)faces_data[3 * f + 1];
+					const int i3 = (int)faces_data[3 * f + 2];
+					const cv::Point2f p[3] = {
+						proj_points_data[i1], proj_points_data[i2], proj_points_data[i3] };
+					const float depth[3] = {
+						vertices_depth_data[i1], vertices_depth_data[i2], vertices_depth_data[i3] };
+					rasterizeTriangle(p, depth, uv, ctx.tri_bboxes[t] & tile_rect,
+						ctx.depthbuf, uvbuf, coveragebuf, levelbuf, mesh_bbox.tl(), 0);
 				}
 			}
-		}
+		});
 	}
 
 	cv::Mat renderDepthMap(const cv::Mat& depth_map)
@@ -483,60 +1123,141 @@ namespace face_swap
         return ((p2.x - p1.x) * (p3.y - p1.y) - (p3.x - p1.x) * (p2.y - p1.y)) < 0;
     }
 
-    cv::Mat computeFaceNormals(const Mesh& mesh)
+    /** Normalize 3D vectors given in structure of arrays layout.
+    Zero length vectors are left as zero.
+    */
+    static void normalizeSoA(float* x, float* y, float* z, int n)
     {
-        cv::Mat v1, v2, v3, v21, v31, N;
-        cv::Mat face_normals = cv::Mat::zeros(mesh.faces.size(), CV_32F);
-        int i1, i2, i3;
-
-        // For each face
-        unsigned short* faces_data = (unsigned short*)mesh.faces.data;
-        for (int i = 0; i < mesh.faces.rows; ++i)
+        int i = 0;
+#if CV_SIMD128
+        const cv::v_float32x4 min_sqr_len = cv::v_setall_f32(FLT_MIN);
+        for (; i <= n - 4; i += 4)
+        {
+            cv::v_float32x4 vx = cv::v_load(x + i);
+            cv::v_float32x4 vy = cv::v_load(y + i);
+            cv::v_float32x4 vz = cv::v_load(z + i);
+            cv::v_float32x4 inv_len = cv::v_invsqrt(
+                cv::v_max(vx * vx + vy * vy + vz * vz, min_sqr_len));
+            cv::v_store(x + i, vx * inv_len);
+            cv::v_store(y + i, vy * inv_len);
+            cv::v_store(z + i, vz * inv_len);
+        }
+#endif
+        for (; i < n; ++i)
         {
-            i1 = (int)*faces_data++;
-            i2 = (int)*faces_data++;
-            i3 = (int)*faces_data++;
-            v1 = mesh.vertices.row(i1);
-            v2 = mesh.vertices.row(i2);
-            v3 = mesh.vertices.row(i3);
-            v21 = v2 - v1;
-            v31 = v3 - v1;
-            N = v31.cross(v21);
-            face_normals.row(i) = N / cv::norm(N);
+            float inv_len = 1.0f / std::sqrt(std::max(x[i] * x[i] + y[i] * y[i] + z[i] * z[i], FLT_MIN));
+            x[i] *= inv_len;
+            y[i] *= inv_len;
+            z[i] *= inv_len;
         }
+    }
 
-        return face_normals;
+    /** Normalize 3D vectors given in array of structures layout [x0 y0 z0 x1 y1 z1 ...].
+    Zero length vectors are left as zero.
+    */
+    static void normalizeAoS(float* xyz, int n)
+    {
+        int i = 0;
+#if CV_SIMD128
+        const cv::v_float32x4 min_sqr_len = cv::v_setall_f32(FLT_MIN);
+        for (; i <= n - 4; i += 4)
+        {
+            cv::v_float32x4 vx, vy, vz;
+            cv::v_load_deinterleave(xyz + 3 * i, vx, vy, vz);
+            cv::v_float32x4 inv_len = cv::v_invsqrt(
+                cv::v_max(vx * vx + vy * vy + vz * vz, min_sqr_len));
+            cv::v_store_interleave(xyz + 3 * i, vx * inv_len, vy * inv_len, vz * inv_len);
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            float* v = xyz + 3 * i;
+            float inv_len = 1.0f / std::sqrt(std::max(v[0] * v[0] + v[1] * v[1] + v[2] * v[2], FLT_MIN));
+            v[0] *= inv_len;
+            v[1] *= inv_len;
+            v[2] *= inv_len;
+        }
     }
 
-    cv::Mat computeVertexNormals(const Mesh& mesh)
+    void computeFaceNormals(const Mesh& mesh, cv::Mat& face_normals)
     {
-        cv::Mat face_normals = computeFaceNormals(mesh);
-        cv::Mat vert_normals = cv::Mat::zeros(mesh.vertices.size(), CV_32F);
-        cv::Mat N;
-        int i1, i2, i3;
+        const int total_faces = mesh.faces.rows;
+        face_normals.create(3, total_faces, CV_32F);
+        float* nx = face_normals.ptr<float>(0);
+        float* ny = face_normals.ptr<float>(1);
+        float* nz = face_normals.ptr<float>(2);
+        const float* vert_data = (const float*)mesh.vertices.data;
+        const unsigned short* faces_data = (const unsigned short*)mesh.faces.data;
 
-        // For each face
-        unsigned short* faces_data = (unsigned short*)mesh.faces.data;
-        for (int i = 0; i < mesh.faces.rows; ++i)
+        // Unnormalized normals: (v3 - v1) x (v2 - v1)
+        cv::parallel_for_(cv::Range(0, total_faces), [&](const cv::Range& range)
         {
-            int i1 = (int)*faces_data++;
-            int i2 = (int)*faces_data++;
-            int i3 = (int)*faces_data++;
+            for (int i = range.start; i < range.end; ++i)
+            {
+                const unsigned short* f = faces_data + 3 * i;
+                const float* v1 = vert_data + 3 * f[0];
+                const float* v2 = vert_data + 3 * f[1];
+                const float* v3 = vert_data + 3 * f[2];
+                float ax = v3[0] - v1[0], ay = v3[1] - v1[1], az = v3[2] - v1[2];
+                float bx = v2[0] - v1[0], by = v2[1] - v1[1], bz = v2[2] - v1[2];
+                nx[i] = ay * bz - az * by;
+                ny[i] = az * bx - ax * bz;
+                nz[i] = ax * by - ay * bx;
+            }
+            normalizeSoA(nx + range.start, ny + range.start, nz + range.start,
+                range.end - range.start);
+        });
+    }
 
-            N = face_normals.row(i);
-            vert_normals.row(i1) += N;
-            vert_normals.row(i2) += N;
-            vert_normals.row(i3) += N;
-        }
+    void computeVertexNormals(const Mesh& mesh, const MeshAdjacency& adjacency,
+        cv::Mat& vertex_normals, cv::Mat& face_normals)
+    {
+        CV_Assert(adjacency.offsets.total() == (size_t)mesh.vertices.rows + 1);
+        computeFaceNormals(mesh, face_normals);
+
+        const int total_vertices = mesh.vertices.rows;
+        vertex_normals.create(total_vertices, 3, CV_32F);
+        float* vn = (float*)vertex_normals.data;
+        const float* nx = face_normals.ptr<float>(0);
+        const float* ny = face_normals.ptr<float>(1);
+        const float* nz = face_normals.ptr<float>(2);
+        const int* offsets = (const int*)adjacency.offsets.data;
+        const int* face_indices = (const int*)adjacency.face_indices.data;
 
-        // For each vertex normal
-        for (int i = 0; i < vert_normals.rows; ++i)
+        // Gather the adjacent face normals of each vertex
+        cv::parallel_for_(cv::Range(0, total_vertices), [&](const cv::Range& range)
         {
-            N = vert_normals.row(i);
-            N /= cv::norm(N);
-        }
+            for (int i = range.start; i < range.end; ++i)
+            {
+                float x = 0.0f, y = 0.0f, z = 0.0f;
+                for (int j = offsets[i]; j < offsets[i + 1]; ++j)
+                {
+                    int f = face_indices[j];
+                    x += nx[f];
+                    y += ny[f];
+                    z += nz[f];
+                }
+                vn[3 * i] = x;
+                vn[3 * i + 1] = y;
+                vn[3 * i + 2] = z;
+            }
+            normalizeAoS(vn + 3 * range.start, range.end - range.start);
+        });
+    }
 
-        return vert_normals;
+    cv::Mat computeFaceNormals(const Mesh& mesh)
+    {
+        cv::Mat face_normals;
+        computeFaceNormals(mesh, face_normals);
+        return face_normals.t();
+    }
+
+    cv::Mat computeVertexNormals(const Mesh& mesh)
+    {
+        MeshAdjacency adjacency = MeshAdjacency::create(mesh.faces, mesh.vertices.rows);
+        cv::Mat vertex_normals, face_normals;
+        computeVertexNormals(mesh, adjacency, vertex_normals, face_normals);
+        return vertex_normals;
     }
 	
 }   // namespace face_swap
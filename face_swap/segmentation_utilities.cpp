@@ -1,28 +1,131 @@
 #include "face_swap/segmentation_utilities.h"
 
+// std
+#include <algorithm>
+#include <vector>
+
 // OpenCV
 #include <opencv2/imgproc.hpp>
 
 namespace face_swap
 {
+	/** Connected components of either the foreground or the background of a segmentation.
+	*/
+	struct SegComponents
+	{
+		cv::Mat labels;						///< Provisional label per pixel [CV_32S], -1 for other pixels.
+		std::vector<int> roots;				///< The component of each provisional label.
+		std::vector<int> areas;				///< Area per component, indexed by root.
+		std::vector<unsigned char> border;	///< Non-zero for components touching the image border, indexed by root.
+	};
+
+	static inline int findRoot(std::vector<int>& parent, int i)
+	{
+		while (parent[i] != i)
+		{
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	}
+
+	static inline void unite(std::vector<int>& parent, int a, int b)
+	{
+		a = findRoot(parent, a);
+		b = findRoot(parent, b);
+		if (a < b) parent[b] = a;
+		else if (b < a) parent[a] = b;
+	}
+
+	/** Label connected components in a single raster scan with union-find.
+	Each pixel is merged with its already visited neighbors, the areas and
+	border flags are accumulated per provisional label and then reduced to the roots.
+	@param seg The segmentation [CV_8U].
+	@param foreground Label the non-zero pixels if true, otherwise label the zero pixels.
+	@param eight_connected Use 8-connectivity if true, otherwise 4-connectivity.
+	@param comps Output components.
+	*/
+	static void labelComponents(const cv::Mat& seg, bool foreground, bool eight_connected,
+		SegComponents& comps)
+	{
+		CV_Assert(seg.type() == CV_8U);
+		comps.labels.create(seg.size(), CV_32S);
+		std::vector<int>& parent = comps.roots;
+		std::vector<int> areas;
+		std::vector<unsigned char> border;
+		parent.clear();
+		for (int r = 0; r < seg.rows; ++r)
+		{
+			const unsigned char* seg_data = seg.ptr<unsigned char>(r);
+			int* labels_data = comps.labels.ptr<int>(r);
+			const int* up = r > 0 ? comps.labels.ptr<int>(r - 1) : nullptr;
+			const bool border_row = r == 0 || r == seg.rows - 1;
+			for (int c = 0; c < seg.cols; ++c)
+			{
+				if ((seg_data[c] != 0) != foreground)
+				{
+					labels_data[c] = -1;
+					continue;
+				}
+
+				// Merge with the visited neighbors
+				int label = c > 0 ? labels_data[c - 1] : -1;
+				if (up != nullptr)
+				{
+					const int n[3] = { up[c],
+						eight_connected && c > 0 ? up[c - 1] : -1,
+						eight_connected && c < seg.cols - 1 ? up[c + 1] : -1 };
+					for (int k = 0; k < 3; ++k)
+					{
+						if (n[k] < 0) continue;
+						if (label < 0) label = n[k];
+						else if (n[k] != label) unite(parent, label, n[k]);
+					}
+				}
+				if (label < 0)
+				{
+					label = (int)parent.size();
+					parent.push_back(label);
+					areas.push_back(0);
+					border.push_back(0);
+				}
+				labels_data[c] = label;
+				++areas[label];
+				if (border_row || c == 0 || c == seg.cols - 1) border[label] = 1;
+			}
+		}
+
+		// Reduce the statistics to the roots
+		comps.areas.assign(parent.size(), 0);
+		comps.border.assign(parent.size(), 0);
+		for (size_t i = 0; i < parent.size(); ++i)
+		{
+			const int root = findRoot(parent, (int)i);
+			comps.areas[root] += areas[i];
+			comps.border[root] |= border[i];
+		}
+		for (size_t i = 0; i < parent.size(); ++i)
+			parent[i] = findRoot(parent, (int)i);
+	}
+
 	void removeSmallerComponents(cv::Mat& seg)
 	{
-		cv::Mat labels;
-		cv::Mat stats, centroids;
-		cv::connectedComponentsWithStats(seg, labels, stats, centroids);
-		if (stats.rows <= 2) return;
+		SegComponents comps;
+		labelComponents(seg, true, true, comps);
+		if (comps.areas.empty()) return;
 
-		// Find the label of the connected component with maximum area
-		cv::Mat areas = stats.colRange(4, 5).clone();
-		int* areas_data = (int*)areas.data;
-		int max_label = std::distance(areas_data,
-			std::max_element(areas_data + 1, areas_data + stats.rows));
+		// Find the component with maximum area
+		const int max_root = (int)std::distance(comps.areas.begin(),
+			std::max_element(comps.areas.begin(), comps.areas.end()));
 
 		// Clear smaller components
-		unsigned char* seg_data = seg.data;
-		int* labels_data = (int*)labels.data;
-		for (size_t i = 0; i < seg.total(); ++i, ++seg_data)
-			if (*labels_data++ != max_label) *seg_data = 0;
+		for (int r = 0; r < seg.rows; ++r)
+		{
+			unsigned char* seg_data = seg.ptr<unsigned char>(r);
+			const int* labels_data = comps.labels.ptr<int>(r);
+			for (int c = 0; c < seg.cols; ++c)
+				if (labels_data[c] >= 0 && comps.roots[labels_data[c]] != max_root) seg_data[c] = 0;
+		}
 	}
 
 	void smoothFlaws(cv::Mat& seg, int smooth_iterations, int smooth_kernel_radius)
@@ -41,12 +144,17 @@ namespace face_swap
 	{
 		double min_val, max_val;
 		cv::minMaxLoc(seg, &min_val, &max_val);
-		cv::Mat holes = seg.clone();
-		cv::floodFill(holes, cv::Point2i(0, 0), cv::Scalar(max_val));
-		for (size_t i = 0; i < seg.total(); ++i)
+
+		// Holes are the background components that don't touch the image border
+		SegComponents comps;
+		labelComponents(seg, false, false, comps);
+		for (int r = 0; r < seg.rows; ++r)
 		{
-			if (holes.data[i] == 0)
-				seg.data[i] = (unsigned char)max_val;
+			unsigned char* seg_data = seg.ptr<unsigned char>(r);
+			const int* labels_data = comps.labels.ptr<int>(r);
+			for (int c = 0; c < seg.cols; ++c)
+				if (labels_data[c] >= 0 && !comps.border[comps.roots[labels_data[c]]])
+					seg_data[c] = (unsigned char)max_val;
 		}
 	}
 
@@ -60,5 +168,29 @@ namespace face_swap
 		if (holes) fillHoles(seg);
 	}
 
+	void upsampleSegmentation(const cv::Mat& seg, const cv::Mat& scores,
+		const cv::Size& size, cv::Mat& out)
+	{
+		CV_Assert(seg.type() == CV_8U && scores.type() == CV_32F && seg.size() == scores.size());
+
+		// Force the sign of the scores to agree with the segmentation
+		const float min_score = 1e-3f;
+		cv::Mat field(seg.size(), CV_32F);
+		for (int r = 0; r < seg.rows; ++r)
+		{
+			const unsigned char* seg_data = seg.ptr<unsigned char>(r);
+			const float* scores_data = scores.ptr<float>(r);
+			float* field_data = field.ptr<float>(r);
+			for (int c = 0; c < seg.cols; ++c)
+				field_data[c] = seg_data[c] ? std::max(scores_data[c], min_score) :
+					std::min(scores_data[c], -min_score);
+		}
+
+		// Interpolate and threshold
+		cv::Mat field_scaled;
+		cv::resize(field, field_scaled, size, 0, 0, cv::INTER_LINEAR);
+		cv::compare(field_scaled, 0.0, out, cv::CMP_GT);
+	}
+
 }   // namespace face_swap
 
@@ -1,8 +1,11 @@
 #include "face_swap/utilities.h"
 #include <iostream>	// Debug
 #include <fstream>
+#include <cfloat>
+#include <limits>
 
 // OpenCV
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/photo.hpp>
 #include <opencv2/calib3d.hpp>
@@ -23,6 +26,23 @@ using namespace boost::filesystem;
 
 namespace face_swap
 {
+	// Number of atlas rows rasterized together by generateTextureAtlas
+	const int ATLAS_STRIPE_ROWS = 16;
+
+	// Number of texels the atlas colors are extended beyond the mesh's boundaries
+	const int ATLAS_PADDING = 2;
+
+	// Barycentric tolerance for texels on the edges between atlas triangles
+	const float ATLAS_EDGE_EPSILON = 1e-4f;
+
+	// Relative depth tolerance of the atlas visibility test
+	const float ATLAS_DEPTH_TOLERANCE = 0.005f;
+
+	static inline float edgeFunction(const cv::Point2f& a, const cv::Point2f& b, const cv::Point2f& q)
+	{
+		return (b.x - a.x) * (q.y - a.y) - (b.y - a.y) * (q.x - a.x);
+	}
+
     cv::Mat euler2RotMat(float x, float y, float z)
     {
         // Calculate rotation about x axis
@@ -100,6 +120,112 @@ namespace face_swap
         return P;
     }
 
+	void createPerspectiveProj3x4(const cv::Mat& euler,
+		const cv::Mat& translation, const cv::Mat& K, cv::Matx34f& P)
+	{
+		CV_Assert(euler.total() == 3 && translation.total() == 3 && K.rows == 3 && K.cols == 3);
+		cv::Vec3d r, t;
+		cv::Matx33d Kd, R;
+		euler.reshape(1, 3).convertTo(cv::Mat(3, 1, CV_64F, r.val), CV_64F);
+		translation.reshape(1, 3).convertTo(cv::Mat(3, 1, CV_64F, t.val), CV_64F);
+		K.convertTo(cv::Mat(3, 3, CV_64F, Kd.val), CV_64F);
+		cv::Rodrigues(r, R);
+		cv::Matx34d RT(
+			R(0, 0), R(0, 1), R(0, 2), t[0],
+			R(1, 0), R(1, 1), R(1, 2), t[1],
+			R(2, 0), R(2, 1), R(2, 2), t[2]);
+		P = cv::Matx34f(Kd * RT);
+	}
+
+	void projectVertices(const cv::Mat& vertices, const cv::Mat& P,
+		cv::Mat* proj, cv::Mat* depth, cv::Mat* uv, const cv::Size& uv_size)
+	{
+		CV_Assert(P.rows == 3 && P.cols == 4);
+		cv::Matx34f Pf;
+		P.convertTo(cv::Mat(3, 4, CV_32F, Pf.val), CV_32F);
+		projectVertices(vertices, Pf, proj, depth, uv, uv_size);
+	}
+
+	void projectVertices(const cv::Mat& vertices, const cv::Matx34f& P,
+		cv::Mat* proj, cv::Mat* depth, cv::Mat* uv, const cv::Size& uv_size)
+	{
+		CV_Assert(vertices.type() == CV_32F && vertices.cols == 3 && vertices.isContinuous());
+		CV_Assert(uv == nullptr || uv_size.area() > 0);
+		const float* p = P.val;
+
+		// Allocate output
+		const int n = vertices.rows;
+		if (proj != nullptr) proj->create(n, 2, CV_32F);
+		if (depth != nullptr) depth->create(n, 1, CV_32F);
+		if (uv != nullptr) uv->create(n, 2, CV_32F);
+		const float* vertices_data = (const float*)vertices.data;
+		float* proj_data = proj != nullptr ? (float*)proj->data : nullptr;
+		float* depth_data = depth != nullptr ? (float*)depth->data : nullptr;
+		float* uv_data = uv != nullptr ? (float*)uv->data : nullptr;
+		const float inv_width = uv != nullptr ? 1.0f / uv_size.width : 0.0f;
+		const float inv_height = uv != nullptr ? 1.0f / uv_size.height : 0.0f;
+
+		cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			int i = range.start;
+#if CV_SIMD128
+			const cv::v_float32x4 one = cv::v_setall_f32(1.0f);
+			for (; i <= range.end - 4; i += 4)
+			{
+				// Transform 4 vertices at once
+				cv::v_float32x4 vx, vy, vz;
+				cv::v_load_deinterleave(vertices_data + 3 * i, vx, vy, vz);
+				const cv::v_float32x4 x = cv::v_setall_f32(p[0]) * vx + cv::v_setall_f32(p[1]) * vy +
+					cv::v_setall_f32(p[2]) * vz + cv::v_setall_f32(p[3]);
+				const cv::v_float32x4 y = cv::v_setall_f32(p[4]) * vx + cv::v_setall_f32(p[5]) * vy +
+					cv::v_setall_f32(p[6]) * vz + cv::v_setall_f32(p[7]);
+				const cv::v_float32x4 w = cv::v_setall_f32(p[8]) * vx + cv::v_setall_f32(p[9]) * vy +
+					cv::v_setall_f32(p[10]) * vz + cv::v_setall_f32(p[11]);
+				const cv::v_float32x4 inv_w = one / w;
+
+				// Write output
+				float px[4], py[4];
+				cv::v_store(px, x * inv_w);
+				cv::v_store(py, y * inv_w);
+				for (int j = 0; j < 4; ++j)
+				{
+					if (proj_data != nullptr)
+					{
+						proj_data[2 * (i + j)] = px[j];
+						proj_data[2 * (i + j) + 1] = py[j];
+					}
+					if (uv_data != nullptr)
+					{
+						uv_data[2 * (i + j)] = px[j] * inv_width;
+						uv_data[2 * (i + j) + 1] = py[j] * inv_height;
+					}
+				}
+				if (depth_data != nullptr) cv::v_store(depth_data + i, cv::v_setzero_f32() - w);
+			}
+#endif
+			for (; i < range.end; ++i)
+			{
+				const float* v = vertices_data + 3 * i;
+				const float x = p[0] * v[0] + p[1] * v[1] + p[2] * v[2] + p[3];
+				const float y = p[4] * v[0] + p[5] * v[1] + p[6] * v[2] + p[7];
+				const float w = p[8] * v[0] + p[9] * v[1] + p[10] * v[2] + p[11];
+				const float inv_w = 1.0f / w;
+				const float px = x * inv_w, py = y * inv_w;
+				if (proj_data != nullptr)
+				{
+					proj_data[2 * i] = px;
+					proj_data[2 * i + 1] = py;
+				}
+				if (uv_data != nullptr)
+				{
+					uv_data[2 * i] = px * inv_width;
+					uv_data[2 * i + 1] = py * inv_height;
+				}
+				if (depth_data != nullptr) depth_data[i] = -w;
+			}
+		});
+	}
+
 	/*cv::Mat createPerspectiveProj4x4(const cv::Mat& euler,
 		const cv::Mat& translation, const cv::Mat& K)
 	{
@@ -231,14 +357,8 @@ namespace face_swap
 		const cv::Mat& seg, const cv::Mat& vecR, const cv::Mat& vecT,
 		const cv::Mat& K, cv::Mat& tex, cv::Mat& uv)
 	{
-		// Resize images to power of 2 size
-		cv::Size tex_size(nextPow2(img.cols), nextPow2(img.rows));
-		cv::Mat img_scaled, seg_scaled;
-		cv::resize(img, img_scaled, tex_size, 0.0, 0.0, cv::INTER_CUBIC);
-		if (!seg.empty())
-			cv::resize(seg, seg_scaled, tex_size, 0.0, 0.0, cv::INTER_NEAREST);
-
-		// Combine image and segmentation into one 4 channel texture
+		// Combine image and segmentation into one 4 channel texture. The texture
+		// coordinates are normalized so the texture doesn't need to be resized
 		if (!seg.empty())
 		{
 			std::vector<cv::Mat> channels;
@@ -246,63 +366,212 @@ namespace face_swap
 			channels.push_back(seg);
 			cv::merge(channels, tex);
 		}
-		else tex = img_scaled;
+		else tex = img;
 
 		uv = generateTextureCoordinates(mesh, img.size(), vecR, vecT, K);
 	}
 
+	void generateTextureAtlas(const Mesh& mesh, const cv::Mat& atlas_uv,
+		const cv::Mat& img, const cv::Mat& seg,
+		const cv::Mat& vecR, const cv::Mat& vecT, const cv::Mat& K,
+		RenderContext& ctx, cv::Mat& tex, int atlas_size)
+	{
+		CV_Assert(img.type() == CV_8UC3 && atlas_size > 0);
+		CV_Assert(atlas_uv.type() == CV_32F && atlas_uv.cols == 2 &&
+			atlas_uv.rows == mesh.vertices.rows && atlas_uv.isContinuous());
+		CV_Assert(seg.empty() || (seg.type() == CV_8U && seg.size() == img.size()));
+
+		// Render the depth of the mesh in the image for the visibility test
+		renderMeshDepth(img.size(), mesh, vecR, vecT, K, ctx);
+		const cv::Point2f* proj_data = (const cv::Point2f*)ctx.vertices_proj.data;
+		const float* depth_data = (const float*)ctx.vertices_depth.data;
+		const cv::Mat& depthbuf = ctx.depthbuf;
+
+		// Calculate the texel bounding box of each of the faces in the atlas
+		const unsigned short* faces_data = (const unsigned short*)mesh.faces.data;
+		const cv::Point2f* atlas_data = (const cv::Point2f*)atlas_uv.data;
+		const float size = (float)atlas_size;
+		const cv::Rect atlas_rect(0, 0, atlas_size, atlas_size);
+		std::vector<cv::Rect> bboxes(mesh.faces.rows);
+		for (int f = 0; f < mesh.faces.rows; ++f)
+		{
+			const unsigned short* face = faces_data + 3 * f;
+			float min_x = size, min_y = size, max_x = 0.0f, max_y = 0.0f;
+			for (int k = 0; k < 3; ++k)
+			{
+				const cv::Point2f a = atlas_data[face[k]] * size;
+				min_x = std::min(min_x, a.x); max_x = std::max(max_x, a.x);
+				min_y = std::min(min_y, a.y); max_y = std::max(max_y, a.y);
+			}
+			bboxes[f] = cv::Rect(cv::Point((int)std::ceil(min_x), (int)std::ceil(min_y)),
+				cv::Point((int)std::floor(max_x) + 1, (int)std::floor(max_y) + 1)) & atlas_rect;
+		}
+
+		// The atlas coordinates fold over where the surface turns away from the
+		// cylinder's axis, such as under the nose. Where faces overlap in the atlas,
+		// the most frontal surface, by the interpolated vertex normals, owns the texel.
+		// The normals point into the mesh, so the most frontal has the smallest z
+		cv::Mat vertex_normals = mesh.normals;
+		if (vertex_normals.empty()) vertex_normals = computeVertexNormals(mesh);
+		CV_Assert(vertex_normals.type() == CV_32F && vertex_normals.cols == 3 &&
+			vertex_normals.rows == mesh.vertices.rows && vertex_normals.isContinuous());
+		const cv::Vec3f* normals_data = (const cv::Vec3f*)vertex_normals.data;
+
+		// Rasterize the faces in the atlas, interpolating the image points and their
+		// depth at the texel centers. The atlas is split into row stripes so each
+		// texel is only written by a single thread
+		cv::Mat map_x(atlas_size, atlas_size, CV_32F, cv::Scalar(-1.0f));
+		cv::Mat map_y(atlas_size, atlas_size, CV_32F, cv::Scalar(-1.0f));
+		cv::Mat covered = cv::Mat::zeros(atlas_size, atlas_size, CV_8U);
+		cv::Mat visible = cv::Mat::zeros(atlas_size, atlas_size, CV_8U);
+		cv::Mat frontality(atlas_size, atlas_size, CV_32F, cv::Scalar(FLT_MAX));
+		const int stripes = (atlas_size + ATLAS_STRIPE_ROWS - 1) / ATLAS_STRIPE_ROWS;
+		cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range& range)
+		{
+			for (int s = range.start; s < range.end; ++s)
+			{
+				const cv::Rect stripe_rect(0, s * ATLAS_STRIPE_ROWS, atlas_size, ATLAS_STRIPE_ROWS);
+				for (int f = 0; f < mesh.faces.rows; ++f)
+				{
+					const cv::Rect bbox = bboxes[f] & stripe_rect;
+					if (bbox.area() == 0) continue;
+					const unsigned short* face = faces_data + 3 * f;
+					const cv::Point2f a[3] = { atlas_data[face[0]] * size,
+						atlas_data[face[1]] * size, atlas_data[face[2]] * size };
+					const cv::Point2f p[3] = {
+						proj_data[face[0]], proj_data[face[1]], proj_data[face[2]] };
+					const float depth[3] = {
+						depth_data[face[0]], depth_data[face[1]], depth_data[face[2]] };
+					const cv::Vec3f n[3] = {
+						normals_data[face[0]], normals_data[face[1]], normals_data[face[2]] };
+					const float area = edgeFunction(a[0], a[1], a[2]);
+					if (std::abs(area) < FLT_EPSILON) continue;
+					const float inv_area = 1.0f / area;
+
+					// Faces that are back facing in the image are never visible
+					const bool front_facing = is_ccw(p[0], p[1], p[2]);
+
+					for (int y = bbox.y; y < bbox.y + bbox.height; ++y)
+					{
+						float* map_x_data = map_x.ptr<float>(y);
+						float* map_y_data = map_y.ptr<float>(y);
+						unsigned char* covered_data = covered.ptr<unsigned char>(y);
+						unsigned char* visible_data = visible.ptr<unsigned char>(y);
+						float* frontality_data = frontality.ptr<float>(y);
+						for (int x = bbox.x; x < bbox.x + bbox.width; ++x)
+						{
+							// Barycentric coordinates of the texel center
+							const cv::Point2f q((float)x, (float)y);
+							const float w0 = edgeFunction(a[1], a[2], q) * inv_area;
+							const float w1 = edgeFunction(a[2], a[0], q) * inv_area;
+							const float w2 = 1.0f - w0 - w1;
+							if (w0 < -ATLAS_EDGE_EPSILON || w1 < -ATLAS_EDGE_EPSILON ||
+								w2 < -ATLAS_EDGE_EPSILON) continue;
+
+							// Keep the most frontal of the surfaces that fold over the texel
+							const cv::Vec3f normal = w0 * n[0] + w1 * n[1] + w2 * n[2];
+							const float normal_len = (float)cv::norm(normal);
+							const float normal_z = normal_len > 0.0f ? normal[2] / normal_len : 0.0f;
+							if (normal_z >= frontality_data[x]) continue;
+							frontality_data[x] = normal_z;
+
+							const cv::Point2f pt = w0 * p[0] + w1 * p[1] + w2 * p[2];
+							map_x_data[x] = pt.x;
+							map_y_data[x] = pt.y;
+							covered_data[x] = 255;
+							visible_data[x] = 0;
+							if (!front_facing) continue;
+
+							// Depth test against the closest surface in the image
+							const int px = (int)std::round(pt.x), py = (int)std::round(pt.y);
+							if (px < 0 || py < 0 || px >= depthbuf.cols || py >= depthbuf.rows)
+								continue;
+							const float z = w0 * depth[0] + w1 * depth[1] + w2 * depth[2];
+							const float surface_z = depthbuf.at<float>(py, px);
+							if (surface_z < std::numeric_limits<float>::max() &&
+								z <= surface_z * (1.0f + ATLAS_DEPTH_TOLERANCE))
+								visible_data[x] = 255;
+						}
+					}
+				}
+			}
+		});
+
+		// Sample the image and the segmentation
+		cv::Mat colors, alpha;
+		cv::remap(img, colors, map_x, map_y, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+		colors.setTo(cv::Scalar::all(0), covered == 0);
+		if (!seg.empty())
+		{
+			cv::remap(seg, alpha, map_x, map_y, cv::INTER_NEAREST, cv::BORDER_CONSTANT);
+			cv::bitwise_and(alpha, visible, alpha);
+		}
+		else alpha = visible;
+
+		// Extend the colors beyond the mesh's boundaries in the atlas, so filtering
+		// the texture doesn't blend in the empty texels
+		cv::Mat prev_covered;
+		for (int i = 0; i < ATLAS_PADDING; ++i)
+		{
+			covered.copyTo(prev_covered);
+			for (int y = 0; y < atlas_size; ++y)
+			{
+				cv::Vec3b* colors_data = colors.ptr<cv::Vec3b>(y);
+				unsigned char* covered_data = covered.ptr<unsigned char>(y);
+				for (int x = 0; x < atlas_size; ++x)
+				{
+					if (covered_data[x]) continue;
+					int sum[3] = {}, count = 0;
+					const cv::Point neighbors[4] = {
+						cv::Point(x - 1, y), cv::Point(x + 1, y), cv::Point(x, y - 1), cv::Point(x, y + 1) };
+					for (const cv::Point& n : neighbors)
+					{
+						if (!atlas_rect.contains(n) || !prev_covered.at<unsigned char>(n)) continue;
+						const cv::Vec3b& color = colors.at<cv::Vec3b>(n);
+						for (int k = 0; k < 3; ++k) sum[k] += color[k];
+						++count;
+					}
+					if (count == 0) continue;
+					for (int k = 0; k < 3; ++k)
+						colors_data[x][k] = (unsigned char)((sum[k] + count / 2) / count);
+					covered_data[x] = 255;
+				}
+			}
+		}
+
+		// Combine the colors and the alpha into one 4 channel texture
+		std::vector<cv::Mat> channels;
+		cv::split(colors, channels);
+		channels.push_back(alpha);
+		cv::merge(channels, tex);
+	}
+
 	cv::Mat generateTextureCoordinates(
 		const Mesh& mesh, const cv::Size& img_size,
 		const cv::Mat & vecR, const cv::Mat & vecT, const cv::Mat & K)
 	{
 		cv::Mat P = createPerspectiveProj3x4(vecR, vecT, K);
-		cv::Mat pts_3d;
-		cv::vconcat(mesh.vertices.t(), cv::Mat::ones(1, mesh.vertices.rows, CV_32F), pts_3d);
-		cv::Mat proj = P * pts_3d;
-
-		// Normalize projected points
-		cv::Mat uv(mesh.vertices.rows, 2, CV_32F);
-		float* uv_data = (float*)uv.data;
-		float z;
-		for (int i = 0; i < uv.rows; ++i)
-		{
-			z = proj.at<float>(2, i);
-			*uv_data++ = proj.at<float>(0, i) / (z * img_size.width);
-			*uv_data++ = proj.at<float>(1, i) / (z * img_size.height);
-		}
+		cv::Mat uv;
+		projectVertices(mesh.vertices, P, nullptr, nullptr, &uv, img_size);
 
 		return uv;
 	}
 
-	cv::Mat blend(const cv::Mat& src, const cv::Mat& dst, const cv::Mat& mask)
+	cv::Mat blend(const cv::Mat& src, const cv::Mat& dst, const cv::Mat& mask, BlendMode mode,
+		const cv::Rect& mask_bbox)
 	{
-		// Find center point
-		int minc = std::numeric_limits<int>::max(), minr = std::numeric_limits<int>::max();
-		int maxc = 0, maxr = 0;
-		unsigned char* mask_data = mask.data;
-		for (int r = 0; r < src.rows; ++r)
-			for (int c = 0; c < src.cols; ++c)
-			{
-				if (*mask_data++ < 255) continue;
-				minc = std::min(c, minc);
-				minr = std::min(r, minr);
-				maxc = std::max(c, maxc);
-				maxr = std::max(r, maxr);
-			}
-		if (minc >= maxc || minr >= maxr) return cv::Mat();
-		cv::Point center((minc + maxc) / 2, (minr + maxr) / 2);
-
-		/// Debug ///
-		//cv::Mat out = src.clone();
-		//cv::rectangle(out, cv::Point(minc, minr), cv::Point(maxc, maxr), cv::Scalar(255, 0, 0));
-		//cv::imshow("target", out);
-		//cv::imshow("mask", mask);
-		//cv::waitKey(0);
-		/////////////
+		// Find the mask's bounding box
+		cv::Rect bbox = mask_bbox.area() > 0 ? mask_bbox : cv::boundingRect(mask == 255);
+		if (bbox.width <= 1 || bbox.height <= 1) return cv::Mat();
 
 		// Do blending
 		cv::Mat blend;
-		cv::seamlessClone(src, dst, mask, center, blend, cv::NORMAL_CLONE);
+		switch (mode)
+		{
+		case BLEND_MULTIBAND: multibandBlend(src, dst, mask, blend, 5, bbox); break;
+		case BLEND_FEATHER: featherBlend(src, dst, mask, blend, 0.0f, bbox); break;
+		default: poissonBlend(src, dst, mask, blend, bbox);
+		}
 
 		return blend;
 	}
@@ -19,6 +19,7 @@
 #include <face_swap/face_swap_engine.h>
 #include <face_swap/utilities.h>
 #include <face_swap/render_utilities.h>
+#include <face_swap/render_backend.h>
 
 using std::cout;
 using std::endl;
@@ -100,6 +101,7 @@ int main(int argc, char* argv[])
 	string reg_model_path, reg_deploy_path, reg_mean_path;
 	string seg_model_path, seg_deploy_path;
     string log_path, cfg_path;
+    string render_backend;
     bool generic, with_expr, with_gpu;
     unsigned int gpu_device_id, verbose;
 	try {
@@ -122,6 +124,7 @@ int main(int argc, char* argv[])
             ("expressions,e", value<bool>(&with_expr)->default_value(true), "with expressions")
 			("gpu", value<bool>(&with_gpu)->default_value(true), "toggle GPU / CPU")
 			("gpu_id", value<unsigned int>(&gpu_device_id)->default_value(0), "GPU's device id")
+			("render_backend", value<string>(&render_backend)->default_value("cpu"), "mesh render backend (cpu or osmesa)")
             ("log", value<string>(&log_path)->default_value("face_swap_batch_log.csv"), "log file path")
             ("cfg", value<string>(&cfg_path)->default_value("face_swap_batch.cfg"), "configuration file (.cfg)")
 			;
@@ -188,6 +191,13 @@ int main(int argc, char* argv[])
 				reg_deploy_path, reg_mean_path, seg_model_path, seg_deploy_path,
 				generic, with_expr, with_gpu, gpu_device_id);
 
+		// Set the render backend
+		std::shared_ptr<face_swap::RenderBackend> backend =
+			face_swap::RenderBackend::create(render_backend);
+		if (!backend)
+			throw std::runtime_error("Render backend \"" + render_backend + "\" is not available!");
+		fs->setRenderBackend(backend);
+
         // Initialize timer
         boost::timer::cpu_timer timer;
         float total_time = 0.0f, fps = 0.0f;
@@ -0,0 +1,246 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <algorithm>
+#include <iomanip>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/regex.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_swap
+#include <face_swap/cnn_3dmm.h>
+#include <face_swap/basel_3dmm.h>
+#include <face_swap/inference_backend.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+const std::string IMAGE_FILTER =
+"(.*\\.(bmp|dib|jpeg|jpg|jpe|jp2|png|pbm|pgm|ppm|sr|ras))";
+
+void getImagesFromDir(const std::string& dir_path, std::vector<std::string>& img_paths)
+{
+    boost::regex filter(IMAGE_FILTER);
+    boost::smatch what;
+    directory_iterator end_itr; // Default ctor yields past-the-end
+    for (directory_iterator it(dir_path); it != end_itr; ++it)
+    {
+        // Skip if not a file
+        if (!boost::filesystem::is_regular_file(it->status())) continue;
+
+        // Get extension
+        std::string ext = it->path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+        // Skip if no match
+        if (!boost::regex_match(ext, what, filter)) continue;
+
+        img_paths.push_back(it->path().string());
+    }
+}
+
+/** Accumulated error statistics.
+*/
+struct ErrorStats
+{
+	double sum = 0.0, max = 0.0;
+	int count = 0;
+
+	void add(double error)
+	{
+		sum += error;
+		max = std::max(max, error);
+		++count;
+	}
+
+	double mean() const
+	{
+		return count > 0 ? sum / count : 0.0;
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string input_path, output_path;
+	string model_3dmm_h5_path;
+	string reg_model_path, reg_deploy_path, reg_mean_path;
+	string reference_backend;
+	string cfg_path;
+	unsigned int calib_images;
+	float tolerance;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("input,i", value<string>(&input_path)->required(), "directory of face crops")
+			("output,o", value<string>(&output_path)->required(), "output path for the calibration file (.binaryproto)")
+			("model_3dmm_h5", value<string>(&model_3dmm_h5_path)->required(), "path to 3DMM file (.h5)")
+			("reg_model,r", value<string>(&reg_model_path)->required(), "path to 3DMM regression CNN model file (.caffemodel)")
+			("reg_deploy,d", value<string>(&reg_deploy_path)->required(), "path to 3DMM regression CNN deploy file (.prototxt)")
+			("reg_mean,m", value<string>(&reg_mean_path)->required(), "path to 3DMM regression CNN mean file (.binaryproto)")
+			("calib_images,n", value<unsigned int>(&calib_images)->default_value(16), "number of crops used for calibration, the rest are used for validation (quantization uses at most 16)")
+			("reference", value<string>(&reference_backend)->default_value("caffe"), "inference backend of the floating point reference")
+			("tolerance,t", value<float>(&tolerance)->default_value(0.005f), "maximum mean vertex error, relative to the size of the mean face")
+			("cfg", value<string>(&cfg_path)->default_value("face_swap_calibrate.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", 1).add("output", 1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_swap_calibrate [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_directory(input_path)) throw error("input must be a path to a directory!");
+		if (!is_regular_file(model_3dmm_h5_path)) throw error("model_3dmm_h5 must be a path to a file!");
+		if (!is_regular_file(reg_model_path)) throw error("reg_model must be a path to a file!");
+		if (!is_regular_file(reg_deploy_path)) throw error("reg_deploy must be a path to a file!");
+		if (!is_regular_file(reg_mean_path)) throw error("reg_mean must be a path to a file!");
+		if (calib_images == 0) throw error("calib_images must be positive!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	// The calibration is written to a temporary file that only replaces the output
+	// once the quantized network passes the accuracy gate
+	const string tmp_path = output_path + ".tmp";
+	try
+	{
+		std::vector<string> backends = face_swap::InferenceBackend::available();
+		if (std::find(backends.begin(), backends.end(), "opencv") == backends.end())
+			throw runtime_error("Quantization requires the \"opencv\" inference backend (WITH_OPENCV_DNN)!");
+
+		// Read the face crops, the first are used for calibration and the rest for validation
+		std::vector<string> img_paths;
+		getImagesFromDir(input_path, img_paths);
+		std::sort(img_paths.begin(), img_paths.end());
+		std::vector<cv::Mat> calib_imgs, valid_imgs;
+		for (size_t i = 0; i < img_paths.size(); ++i)
+		{
+			cv::Mat img = cv::imread(img_paths[i]);
+			if (img.empty()) throw runtime_error("Failed to read image \"" + img_paths[i] + "\"!");
+			if (i < calib_images) calib_imgs.push_back(img);
+			else valid_imgs.push_back(img);
+		}
+		if (calib_imgs.empty()) throw runtime_error("No face crops found in \"" + input_path + "\"!");
+		if (valid_imgs.empty())
+		{
+			cout << "Warning: no crops left for validation, validating on the calibration crops" << endl;
+			valid_imgs = calib_imgs;
+		}
+
+		// Calibrate and quantize
+		cout << "Calibrating on " << calib_imgs.size() << " crops..." << endl;
+		face_swap::CNN3DMM cnn_fp32(reg_deploy_path, reg_model_path, reg_mean_path,
+			true, false, 0, reference_backend);
+		face_swap::CNN3DMM cnn_int8(reg_deploy_path, reg_model_path, reg_mean_path,
+			true, false, 0, "opencv");
+		cnn_int8.writeCalibration(tmp_path, calib_imgs);
+		cnn_int8.quantize(tmp_path);
+
+		// The vertex error is measured relative to the diagonal of the mean face's bounding box
+		face_swap::Basel3DMM basel_3dmm = face_swap::Basel3DMM::load(model_3dmm_h5_path);
+		cv::Mat mean_vertices = basel_3dmm.shapeMU.reshape(1, basel_3dmm.shapeMU.rows / 3);
+		cv::Mat min_vertex, max_vertex;
+		cv::reduce(mean_vertices, min_vertex, 0, cv::REDUCE_MIN);
+		cv::reduce(mean_vertices, max_vertex, 0, cv::REDUCE_MAX);
+		double face_size = cv::norm(max_vertex, min_vertex, cv::NORM_L2);
+
+		// Compare the INT8 outputs to the floating point outputs
+		cout << "Validating on " << valid_imgs.size() << " crops..." << endl;
+		cv::Mat shape_coefficients, tex_coefficients;
+		cnn_fp32.process(valid_imgs[0], shape_coefficients, tex_coefficients);	// Warm up
+		cnn_int8.process(valid_imgs[0], shape_coefficients, tex_coefficients);
+		ErrorStats shape_error, tex_error, vertex_error;
+		double fp32_ticks = 0.0, int8_ticks = 0.0;
+		face_swap::Mesh mesh_fp32, mesh_int8;
+		for (const cv::Mat& img : valid_imgs)
+		{
+			cv::Mat shape_fp32, tex_fp32, shape_int8, tex_int8;
+			int64 start = cv::getTickCount();
+			cnn_fp32.process(img, shape_fp32, tex_fp32);
+			int64 middle = cv::getTickCount();
+			cnn_int8.process(img, shape_int8, tex_int8);
+			int8_ticks += double(cv::getTickCount() - middle);
+			fp32_ticks += double(middle - start);
+
+			// Relative coefficient errors
+			shape_error.add(cv::norm(shape_int8, shape_fp32, cv::NORM_L2) /
+				std::max(cv::norm(shape_fp32, cv::NORM_L2), 1e-12));
+			tex_error.add(cv::norm(tex_int8, tex_fp32, cv::NORM_L2) /
+				std::max(cv::norm(tex_fp32, cv::NORM_L2), 1e-12));
+
+			// Mean vertex distance of the identity meshes
+			basel_3dmm.sample(shape_fp32, tex_fp32, cv::Mat(), mesh_fp32,
+				face_swap::Basel3DMM::SAMPLE_SHAPE);
+			basel_3dmm.sample(shape_int8, tex_int8, cv::Mat(), mesh_int8,
+				face_swap::Basel3DMM::SAMPLE_SHAPE);
+			cv::Mat diff = mesh_int8.vertices - mesh_fp32.vertices;
+			cv::Mat dist;
+			cv::reduce(diff.mul(diff), dist, 1, cv::REDUCE_SUM);
+			cv::sqrt(dist, dist);
+			vertex_error.add(cv::mean(dist)[0]);
+		}
+
+		// Report
+		double fp32_ms = fp32_ticks * 1000.0 / (cv::getTickFrequency() * valid_imgs.size());
+		double int8_ms = int8_ticks * 1000.0 / (cv::getTickFrequency() * valid_imgs.size());
+		cout << std::fixed << std::setprecision(2);
+		cout << "Latency: fp32 (" << reference_backend << ") " << fp32_ms << " ms, int8 " <<
+			int8_ms << " ms, speedup " << fp32_ms / std::max(int8_ms, 1e-6) << "x" << endl;
+		cout << std::scientific << std::setprecision(3);
+		cout << "Shape coefficients relative L2 error: mean " << shape_error.mean() <<
+			", max " << shape_error.max << endl;
+		cout << "Texture coefficients relative L2 error: mean " << tex_error.mean() <<
+			", max " << tex_error.max << endl;
+		cout << "Mean vertex error: mean " << vertex_error.mean() << ", max " << vertex_error.max <<
+			" (face size " << face_size << ")" << endl;
+
+		// Accuracy gate
+		double relative_vertex_error = vertex_error.mean() / face_size;
+		if (relative_vertex_error > tolerance)
+		{
+			cerr << "Accuracy gate failed: the relative vertex error " << relative_vertex_error <<
+				" exceeds the tolerance " << tolerance << endl;
+			remove(tmp_path);
+			return 1;
+		}
+		cout << "Accuracy gate passed: relative vertex error " << relative_vertex_error << endl;
+		rename(tmp_path, output_path);
+		cout << "Calibration file written to \"" << output_path << "\"" << endl;
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		boost::system::error_code ec;
+		remove(tmp_path, ec);
+		return 1;
+	}
+
+	return 0;
+}
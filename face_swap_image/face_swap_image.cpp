@@ -16,6 +16,7 @@
 // face_swap
 #include <face_swap/face_swap_engine.h>
 #include <face_swap/utilities.h>
+#include <face_swap/render_backend.h>
 
 using std::cout;
 using std::endl;
@@ -34,6 +35,7 @@ int main(int argc, char* argv[])
 	string reg_model_path, reg_deploy_path, reg_mean_path;
 	string seg_model_path, seg_deploy_path;
     string cfg_path;
+    string render_backend;
     bool generic, with_expr, with_gpu, cache;
     unsigned int gpu_device_id, verbose;
 	try {
@@ -57,6 +59,7 @@ int main(int argc, char* argv[])
 			("cache,c", value<bool>(&cache)->default_value(false), "cache intermediate face data")
 			("gpu", value<bool>(&with_gpu)->default_value(true), "toggle GPU / CPU")
 			("gpu_id", value<unsigned int>(&gpu_device_id)->default_value(0), "GPU's device id")
+			("render_backend", value<string>(&render_backend)->default_value("cpu"), "mesh render backend (cpu or osmesa)")
             ("cfg", value<string>(&cfg_path)->default_value("face_swap_image.cfg"), "configuration file (.cfg)")
 			;
 		variables_map vm;
@@ -108,6 +111,13 @@ int main(int argc, char* argv[])
 				reg_deploy_path, reg_mean_path, seg_model_path, seg_deploy_path,
 				generic, with_expr, with_gpu, gpu_device_id);
 
+		// Set the render backend
+		std::shared_ptr<face_swap::RenderBackend> backend =
+			face_swap::RenderBackend::create(render_backend);
+		if (!backend)
+			throw std::runtime_error("Render backend \"" + render_backend + "\" is not available!");
+		fs->setRenderBackend(backend);
+
         // Read source and target images
         //cv::Mat source_img = cv::imread(input_paths[0]);
         //cv::Mat target_img = cv::imread(input_paths[1]);
@@ -0,0 +1,192 @@
+// std
+#include <iostream>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/photo.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_swap
+#include <face_swap/blending_utilities.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+/** Mean absolute difference of two images inside a mask, per channel.
+*/
+double meanAbsDiff(const cv::Mat& a, const cv::Mat& b, const cv::Mat& mask)
+{
+	return cv::norm(a, b, cv::NORM_L1, mask) / (3.0 * std::max(cv::countNonZero(mask), 1));
+}
+
+/** Reference blending by OpenCV's Poisson cloning, as previously done by face_swap::blend.
+*/
+void seamlessCloneBlend(const cv::Mat& src, const cv::Mat& dst, const cv::Mat& mask, cv::Mat& out)
+{
+	cv::Rect bbox = cv::boundingRect(mask);
+	cv::Point center(bbox.x + (bbox.width - 1) / 2, bbox.y + (bbox.height - 1) / 2);
+	cv::seamlessClone(src, dst, mask, center, out, cv::NORMAL_CLONE);
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	std::vector<string> input_paths;
+	string output_path, mask_path;
+	string cfg_path;
+	unsigned int iterations;
+	float tolerance;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("input,i", value<std::vector<string>>(&input_paths)->required(), "image paths [source target]")
+			("output,o", value<string>(&output_path), "output path for the blended images")
+			("mask,m", value<string>(&mask_path), "mask path, an ellipse in the center is used if not specified")
+			("iterations,n", value<unsigned int>(&iterations)->default_value(10), "number of timed iterations per blend mode")
+			("tolerance,t", value<float>(&tolerance)->default_value(0.1f), "maximum difference of the Poisson blending from seamlessClone, relative to the difference of pasting the source without blending")
+			("cfg", value<string>(&cfg_path)->default_value("test_blend.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: test_blend [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (input_paths.size() != 2) throw error("Both source and target must be specified in input!");
+		if (!is_regular_file(input_paths[0])) throw error("source input must be a path to an image!");
+		if (!is_regular_file(input_paths[1])) throw error("target input must be a path to an image!");
+		if (!mask_path.empty() && !is_regular_file(mask_path)) throw error("mask must be a path to an image!");
+		if (iterations == 0) throw error("iterations must be positive!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// Read images, the source is resized to the target's size
+		cv::Mat dst = cv::imread(input_paths[1]);
+		cv::Mat src = cv::imread(input_paths[0]);
+		if (src.empty() || dst.empty()) throw runtime_error("Failed to read the input images!");
+		cv::resize(src, src, dst.size(), 0.0, 0.0, cv::INTER_LINEAR);
+
+		// Read or generate the mask
+		cv::Mat mask;
+		if (!mask_path.empty())
+		{
+			mask = cv::imread(mask_path, cv::IMREAD_GRAYSCALE);
+			if (mask.size() != dst.size()) throw runtime_error("The mask must be the same size as the target!");
+			mask = (mask >= 128) & 255;
+		}
+		else
+		{
+			mask = cv::Mat::zeros(dst.size(), CV_8U);
+			cv::ellipse(mask, cv::Point(dst.cols / 2, dst.rows / 2),
+				cv::Size(dst.cols / 4, dst.rows / 3), 0.0, 0.0, 360.0, cv::Scalar(255), -1);
+		}
+
+		// Pasting the source without blending sets the scale of the differences, so the
+		// tolerance doesn't depend on the contrast of the image pair
+		cv::Mat paste = dst.clone();
+		src.copyTo(paste, mask);
+
+		// Time each of the blend modes
+		typedef void(*BlendFunc)(const cv::Mat&, const cv::Mat&, const cv::Mat&, cv::Mat&);
+		const std::vector<std::pair<string, BlendFunc>> modes = {
+			{ "seamlessClone", seamlessCloneBlend },
+			{ "poisson", [](const cv::Mat& s, const cv::Mat& d, const cv::Mat& m, cv::Mat& o) { face_swap::poissonBlend(s, d, m, o); } },
+			{ "multiband", [](const cv::Mat& s, const cv::Mat& d, const cv::Mat& m, cv::Mat& o) { face_swap::multibandBlend(s, d, m, o); } },
+			{ "feather", [](const cv::Mat& s, const cv::Mat& d, const cv::Mat& m, cv::Mat& o) { face_swap::featherBlend(s, d, m, o); } }
+		};
+		std::vector<cv::Mat> outputs(modes.size());
+		cv::Mat reference;
+		seamlessCloneBlend(src, dst, mask, reference);
+		const double paste_diff = std::max(meanAbsDiff(paste, reference, mask), 1e-6);
+		cout << "Image size: " << dst.cols << " X " << dst.rows << ", mask area: " << cv::countNonZero(mask) << endl;
+		cout << std::left << std::setw(28) << "mode" << std::setw(12) << "time [ms]" << std::setw(16) <<
+			"mean abs diff" << "relative diff" << endl;
+		cout << std::left << std::setw(28) << "paste" << std::setw(12) << "" << std::fixed <<
+			std::setprecision(2) << std::setw(16) << paste_diff << std::setprecision(3) << 1.0 << endl;
+		bool passed = true;
+		for (size_t i = 0; i < modes.size(); ++i)
+		{
+			modes[i].second(src, dst, mask, outputs[i]);	// Warm up
+			int64 start = cv::getTickCount();
+			for (unsigned int j = 0; j < iterations; ++j)
+				modes[i].second(src, dst, mask, outputs[i]);
+			double ms = (cv::getTickCount() - start) * 1000.0 / (cv::getTickFrequency() * iterations);
+
+			// Difference from seamlessClone inside the mask
+			double diff = meanAbsDiff(outputs[i], reference, mask);
+			cout << std::left << std::setw(28) << modes[i].first << std::setw(12) << std::fixed <<
+				std::setprecision(2) << ms << std::setw(16) << diff << std::setprecision(3) <<
+				diff / paste_diff << endl;
+			if (modes[i].first == "poisson" && diff > tolerance * paste_diff) passed = false;
+		}
+
+		// Warm starting from the solution must stay close to it, and warm starting
+		// from a wrong guess must fall back to the solve without a guess
+		const std::vector<std::pair<string, cv::Mat>> guesses = {
+			{ "poisson (solution guess)", outputs[1] },
+			{ "poisson (white guess)", cv::Mat(dst.size(), CV_8UC3, cv::Scalar::all(255)) }
+		};
+		for (const auto& guess : guesses)
+		{
+			cv::Mat out;
+			face_swap::poissonBlend(src, dst, mask, out, cv::Rect(), guess.second);
+			double diff = meanAbsDiff(out, outputs[1], mask);
+			cout << std::left << std::setw(28) << guess.first << std::setw(12) << "" << std::fixed <<
+				std::setprecision(2) << std::setw(16) << diff << std::setprecision(3) <<
+				diff / paste_diff << endl;
+			if (diff > tolerance * paste_diff) passed = false;
+		}
+
+		// Write the outputs side by side
+		if (!output_path.empty())
+		{
+			cv::Mat out;
+			cv::hconcat(outputs, out);
+			cv::imwrite(output_path, out);
+		}
+
+		if (!passed)
+		{
+			cerr << "Poisson blending differs from the reference by more than " << tolerance <<
+				" of the pasted source's difference (" << tolerance * paste_diff << ")" << endl;
+			return 1;
+		}
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,193 @@
+// std
+#include <iostream>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_swap
+#include <face_swap/inference_backend.h>
+#include <face_swap/cnn_utilities.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+/** Run the network on each of the images and return the outputs.
+*/
+std::vector<cv::Mat> runBackend(face_swap::InferenceBackend& backend,
+	const std::vector<cv::Mat>& images, const cv::Scalar& mean_color,
+	const string& output_name, unsigned int iterations)
+{
+	std::vector<int> shape = backend.inputShape();
+	std::vector<cv::Mat> outputs(images.size());
+	for (unsigned int i = 0; i < iterations; ++i)
+	{
+		for (size_t j = 0; j < images.size(); ++j)
+		{
+			face_swap::imageToBlob(images[j], backend.inputData(), shape[1], mean_color);
+			outputs[j] = backend.forward(output_name);
+		}
+	}
+
+	// The outputs may refer to the backend's memory
+	for (cv::Mat& output : outputs) output = output.clone();
+	return outputs;
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	std::vector<string> input_paths;
+	string deploy_path, model_path, output_name;
+	string cfg_path;
+	std::vector<float> mean_color;
+	unsigned int iterations, threads;
+	float tolerance;
+	bool with_gpu;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("input,i", value<std::vector<string>>(&input_paths)->required(), "image paths")
+			("deploy,d", value<string>(&deploy_path)->required(), "network definition file (.prototxt)")
+			("model,m", value<string>(&model_path)->required(), "network weights file (.caffemodel)")
+			("output_name,o", value<string>(&output_name)->default_value(""), "name of the output blob, the network's output if empty")
+			("mean", value<std::vector<float>>(&mean_color)->multitoken(), "mean color subtracted from the input images [B G R]")
+			("iterations,n", value<unsigned int>(&iterations)->default_value(10), "number of timed iterations per backend")
+			("threads,t", value<unsigned int>(&threads)->default_value(4), "number of concurrent instances for the backends that support it")
+			("tolerance", value<float>(&tolerance)->default_value(1e-3f), "maximum relative L2 difference of the outputs from Caffe's")
+			("gpu,g", value<bool>(&with_gpu)->default_value(false), "toggle GPU / CPU")
+			("cfg", value<string>(&cfg_path)->default_value("test_inference_backend.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: test_inference_backend [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		for (const string& input_path : input_paths)
+			if (!is_regular_file(input_path)) throw error("input must be a path to an image!");
+		if (!is_regular_file(deploy_path)) throw error("deploy must be a path to a file!");
+		if (!is_regular_file(model_path)) throw error("model must be a path to a file!");
+		if (!mean_color.empty() && mean_color.size() != 3) throw error("mean must have 3 values!");
+		if (iterations == 0) throw error("iterations must be positive!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// Read images, resized to the network's input size
+		std::vector<int> input_shape = face_swap::readCaffeInputShape(deploy_path);
+		std::vector<cv::Mat> images;
+		for (const string& input_path : input_paths)
+		{
+			cv::Mat img = cv::imread(input_path);
+			if (img.empty()) throw runtime_error("Failed to read image \"" + input_path + "\"!");
+			cv::resize(img, img, cv::Size(input_shape[3], input_shape[2]), 0.0, 0.0, cv::INTER_CUBIC);
+			images.push_back(img);
+		}
+		cv::Scalar mean;
+		if (!mean_color.empty()) mean = cv::Scalar(mean_color[0], mean_color[1], mean_color[2]);
+
+		// Time each of the backends, the outputs are compared to the first (Caffe)
+		std::vector<string> names = face_swap::InferenceBackend::available();
+		std::vector<std::vector<cv::Mat>> outputs(names.size());
+		cout << "Input shape: " << input_shape[0] << " X " << input_shape[1] << " X " <<
+			input_shape[2] << " X " << input_shape[3] << ", images: " << images.size() << endl;
+		cout << std::left << std::setw(12) << "backend" << std::setw(16) << "load [ms]" <<
+			std::setw(16) << "forward [ms]" << std::setw(16) << "max abs diff" << "rel L2 diff" << endl;
+		bool passed = true;
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			int64 start = cv::getTickCount();
+			std::shared_ptr<face_swap::InferenceBackend> backend =
+				face_swap::InferenceBackend::create(names[i], deploy_path, model_path, with_gpu);
+			double load_ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+
+			runBackend(*backend, images, mean, output_name, 1);	// Warm up
+			start = cv::getTickCount();
+			outputs[i] = runBackend(*backend, images, mean, output_name, iterations);
+			double ms = (cv::getTickCount() - start) * 1000.0 /
+				(cv::getTickFrequency() * iterations * images.size());
+
+			// Difference from Caffe
+			double max_diff = 0.0, rel_diff = 0.0;
+			for (size_t j = 0; j < images.size(); ++j)
+			{
+				if (outputs[i][j].total() != outputs[0][j].total())
+					throw runtime_error("The output of \"" + names[i] + "\" has a different size than Caffe's!");
+				cv::Mat out = outputs[i][j].reshape(1, 1), ref = outputs[0][j].reshape(1, 1);
+				max_diff = std::max(max_diff, cv::norm(out, ref, cv::NORM_INF));
+				rel_diff = std::max(rel_diff, cv::norm(out, ref, cv::NORM_L2) /
+					std::max(cv::norm(ref, cv::NORM_L2), 1e-12));
+			}
+			cout << std::left << std::setw(12) << names[i] << std::fixed << std::setprecision(2) <<
+				std::setw(16) << load_ms << std::setw(16) << ms << std::scientific <<
+				std::setw(16) << max_diff << rel_diff << endl;
+			if (rel_diff > tolerance)
+			{
+				cerr << "The outputs of \"" << names[i] << "\" differ from Caffe's by more than " << tolerance << endl;
+				passed = false;
+			}
+		}
+
+		// Throughput of concurrent instances, Caffe's device mode is per
+		// thread and its networks aren't meant to run concurrently
+		for (size_t i = 0; i < names.size() && threads > 1; ++i)
+		{
+			if (names[i] == "caffe") continue;
+			std::vector<std::shared_ptr<face_swap::InferenceBackend>> backends(threads);
+			for (auto& backend : backends)
+			{
+				backend = face_swap::InferenceBackend::create(names[i], deploy_path, model_path, with_gpu);
+				runBackend(*backend, images, mean, output_name, 1);	// Warm up
+			}
+
+			int64 start = cv::getTickCount();
+			std::vector<std::thread> workers;
+			for (auto& backend : backends)
+				workers.emplace_back([&, backend]() { runBackend(*backend, images, mean, output_name, iterations); });
+			for (std::thread& worker : workers) worker.join();
+			double sec = (cv::getTickCount() - start) / cv::getTickFrequency();
+			cout << names[i] << " with " << threads << " concurrent instances: " << std::fixed <<
+				std::setprecision(2) << (threads * iterations * images.size()) / sec << " images / sec" << endl;
+		}
+
+		if (!passed) return 1;
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+// std
+#include <iostream>
+#include <exception>
+#include <fstream>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+// Boost
+#include <boost/program_options.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+// face_swap
+#include <face_swap/render_utilities.h>
+#include <face_swap/mesh_utilities.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+
+/** Return the maximum absolute difference between two matrices of the same size.
+*/
+double maxDiff(const cv::Mat& a, const cv::Mat& b)
+{
+	if (a.size() != b.size() || a.type() != b.type()) return std::numeric_limits<double>::max();
+	return cv::norm(a, b, cv::NORM_INF);
+}
+
+/** Check the adjacency and the face and vertex normals of a mesh against the expected ones.
+*/
+bool checkMesh(const string& name, const face_swap::Mesh& mesh, const cv::Mat& expected_offsets,
+	const cv::Mat& expected_face_indices, const cv::Mat& expected_face_normals,
+	const cv::Mat& expected_vertex_normals, float tolerance)
+{
+	face_swap::MeshAdjacency adjacency = face_swap::MeshAdjacency::create(mesh.faces, mesh.vertices.rows);
+	cv::Mat face_normals = face_swap::computeFaceNormals(mesh);
+	cv::Mat vertex_normals = face_swap::computeVertexNormals(mesh);
+
+	// The same normals from the precomputed adjacency, the face normals are [3 x F]
+	cv::Mat adj_vertex_normals, adj_face_normals;
+	face_swap::computeVertexNormals(mesh, adjacency, adj_vertex_normals, adj_face_normals);
+	adj_face_normals = adj_face_normals.t();
+
+	bool passed = true;
+	if (maxDiff(adjacency.offsets, expected_offsets) != 0.0 ||
+		maxDiff(adjacency.face_indices, expected_face_indices) != 0.0)
+	{
+		cerr << name << ": the adjacency differs from the expected one" << endl;
+		passed = false;
+	}
+	double face_diff = std::max(maxDiff(face_normals, expected_face_normals),
+		maxDiff(adj_face_normals, expected_face_normals));
+	double vertex_diff = std::max(maxDiff(vertex_normals, expected_vertex_normals),
+		maxDiff(adj_vertex_normals, expected_vertex_normals));
+	cout << name << ": faces = " << mesh.faces.rows << ", face normals diff = " << face_diff <<
+		", vertex normals diff = " << vertex_diff << endl;
+	if (face_diff > tolerance || vertex_diff > tolerance)
+	{
+		cerr << name << ": the normals differ from the expected ones by more than the tolerance" << endl;
+		passed = false;
+	}
+
+	return passed;
+}
+
+/** Tetrahedron with a vertex at the origin and one on each of the positive axes.
+The faces are wound so (v3 - v1) x (v2 - v1) points out of the tetrahedron.
+*/
+bool checkTetrahedron(float tolerance)
+{
+	face_swap::Mesh mesh;
+	mesh.vertices = (cv::Mat_<float>(4, 3) <<
+		0, 0, 0,
+		1, 0, 0,
+		0, 1, 0,
+		0, 0, 1);
+	mesh.faces = (cv::Mat_<unsigned short>(4, 3) <<
+		0, 1, 2,
+		0, 3, 1,
+		0, 2, 3,
+		1, 3, 2);
+
+	// Each vertex is adjacent to the three faces that contain it, in ascending order
+	cv::Mat offsets = (cv::Mat_<int>(5, 1) << 0, 3, 6, 9, 12);
+	cv::Mat face_indices = (cv::Mat_<int>(12, 1) <<
+		0, 1, 2,
+		0, 1, 3,
+		0, 2, 3,
+		1, 2, 3);
+
+	const float s = 1.0f / std::sqrt(3.0f);
+	cv::Mat face_normals = (cv::Mat_<float>(4, 3) <<
+		0, 0, -1,
+		0, -1, 0,
+		-1, 0, 0,
+		s, s, s);
+
+	// The vertex normals are the normalized sums of the adjacent face normals
+	cv::Mat vertex_normals(4, 3, CV_32F);
+	for (int i = 0; i < 4; ++i)
+	{
+		cv::Mat n = cv::Mat::zeros(1, 3, CV_32F);
+		for (int j = offsets.at<int>(i); j < offsets.at<int>(i + 1); ++j)
+			n += face_normals.row(face_indices.at<int>(j));
+		cv::normalize(n, vertex_normals.row(i));
+	}
+
+	return checkMesh("tetrahedron", mesh, offsets, face_indices, face_normals,
+		vertex_normals, tolerance);
+}
+
+/** Flat grid in the z = 0 plane, large enough to cover the vectorized code paths.
+All the normals are (0, 0, -1).
+*/
+bool checkGrid(int grid_size, float tolerance)
+{
+	const int total_vertices = grid_size * grid_size;
+	const int total_faces = 2 * (grid_size - 1) * (grid_size - 1);
+	face_swap::Mesh mesh;
+	mesh.vertices.create(total_vertices, 3, CV_32F);
+	for (int y = 0; y < grid_size; ++y)
+		for (int x = 0; x < grid_size; ++x)
+		{
+			float* v = mesh.vertices.ptr<float>(y * grid_size + x);
+			v[0] = (float)x; v[1] = (float)y; v[2] = 0.0f;
+		}
+	mesh.faces.create(total_faces, 3, CV_16U);
+	int f = 0;
+	for (int y = 0; y < grid_size - 1; ++y)
+		for (int x = 0; x < grid_size - 1; ++x)
+		{
+			const unsigned short i = (unsigned short)(y * grid_size + x);
+			const unsigned short w = (unsigned short)grid_size;
+			unsigned short* face = mesh.faces.ptr<unsigned short>(f++);
+			face[0] = i; face[1] = i + 1; face[2] = i + w;
+			face = mesh.faces.ptr<unsigned short>(f++);
+			face[0] = i + 1; face[1] = i + w + 1; face[2] = i + w;
+		}
+
+	// Build the expected adjacency by scanning the faces for each vertex
+	std::vector<int> offsets(1, 0), face_indices;
+	for (int i = 0; i < total_vertices; ++i)
+	{
+		for (int j = 0; j < total_faces; ++j)
+		{
+			const unsigned short* face = mesh.faces.ptr<unsigned short>(j);
+			if (face[0] == i || face[1] == i || face[2] == i) face_indices.push_back(j);
+		}
+		offsets.push_back((int)face_indices.size());
+	}
+
+	cv::Mat face_normals = cv::Mat(total_faces, 1, CV_32FC3, cv::Scalar(0, 0, -1)).reshape(1);
+	cv::Mat vertex_normals = cv::Mat(total_vertices, 1, CV_32FC3, cv::Scalar(0, 0, -1)).reshape(1);
+
+	return checkMesh("grid", mesh, cv::Mat(offsets, true), cv::Mat(face_indices, true),
+		face_normals, vertex_normals, tolerance);
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string cfg_path;
+	unsigned int grid_size;
+	float tolerance;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("grid_size,g", value<unsigned int>(&grid_size)->default_value(33), "number of vertices along each side of the grid mesh")
+			("tolerance,t", value<float>(&tolerance)->default_value(1e-5f), "maximum absolute difference from the expected normals")
+			("cfg", value<string>(&cfg_path)->default_value("test_mesh_normals.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: test_mesh_normals [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (grid_size < 2 || grid_size > 64) throw error("grid_size must be in the range [2, 64]!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		bool passed = checkTetrahedron(tolerance);
+		passed = checkGrid((int)grid_size, tolerance) && passed;
+		if (!passed) return 1;
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+// std
+#include <iostream>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_swap
+#include <face_swap/basel_3dmm.h>
+#include <face_swap/render_backend.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+/** Render the mesh into a copy of the background and return the rendered image.
+*/
+cv::Mat runBackend(face_swap::RenderBackend& backend, const cv::Mat& background,
+	const face_swap::Mesh& mesh, const cv::Mat& rvec, const cv::Mat& tvec, const cv::Mat& K,
+	face_swap::RenderContext& ctx, face_swap::AntialiasMode antialias, unsigned int iterations)
+{
+	cv::Mat img;
+	for (unsigned int i = 0; i < iterations; ++i)
+	{
+		background.copyTo(img);
+		backend.renderMesh(img, mesh, rvec, tvec, K, ctx, antialias);
+	}
+
+	return img;
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string input_path, output_path, model_3dmm_h5_path;
+	string cfg_path;
+	unsigned int size, iterations;
+	float tolerance, mask_tolerance;
+	bool antialias;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("input,i", value<string>(&input_path)->required(), "texture image path")
+			("output,o", value<string>(&output_path), "output path for the rendered images")
+			("model_3dmm_h5", value<string>(&model_3dmm_h5_path)->required(), "path to 3DMM file (.h5)")
+			("size,s", value<unsigned int>(&size)->default_value(512), "width and height of the rendered image")
+			("iterations,n", value<unsigned int>(&iterations)->default_value(10), "number of timed iterations per backend")
+			("antialias,a", value<bool>(&antialias)->default_value(false), "toggle antialiasing")
+			("tolerance,t", value<float>(&tolerance)->default_value(8.0f), "maximum mean absolute difference from the cpu backend, where both rendered the mesh")
+			("mask_tolerance", value<float>(&mask_tolerance)->default_value(0.01f), "maximum fraction of the mesh's pixels rendered by only one of the backends")
+			("cfg", value<string>(&cfg_path)->default_value("test_render_backend.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", 1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: test_render_backend [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_regular_file(input_path)) throw error("input must be a path to an image!");
+		if (!is_regular_file(model_3dmm_h5_path)) throw error("model_3dmm_h5 must be a path to a file!");
+		if (size == 0) throw error("size must be positive!");
+		if (iterations == 0) throw error("iterations must be positive!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// The texture is mapped to the mean face by its atlas coordinates
+		cv::Mat tex = cv::imread(input_path);
+		if (tex.empty()) throw runtime_error("Failed to read image \"" + input_path + "\"!");
+		face_swap::Basel3DMM basel_3dmm = face_swap::Basel3DMM::load(model_3dmm_h5_path);
+		face_swap::Mesh mesh;
+		mesh.vertices = (basel_3dmm.shapeMU + basel_3dmm.exprMU).reshape(1, basel_3dmm.shapeMU.rows / 3);
+		mesh.faces = basel_3dmm.faces;
+		mesh.uv = basel_3dmm.atlas_uv;
+		mesh.tex = tex;
+
+		// Frontal camera with the same conventions as the 3DMM fitting (negative focal
+		// length along x, the face in front of the camera at negative depth), placed so
+		// the face covers half of the image's width
+		cv::Mat min_vertex, max_vertex;
+		cv::reduce(mesh.vertices, min_vertex, 0, cv::REDUCE_MIN);
+		cv::reduce(mesh.vertices, max_vertex, 0, cv::REDUCE_MAX);
+		const float f = (float)size;
+		const float face_width = max_vertex.at<float>(0) - min_vertex.at<float>(0);
+		const float distance = 2.0f * f * face_width / (float)size;
+		cv::Mat K = (cv::Mat_<float>(3, 3) << -f, 0, size / 2.0f, 0, f, size / 2.0f, 0, 0, 1);
+		cv::Mat rvec = cv::Mat::zeros(3, 1, CV_32F);
+		cv::Mat tvec = (cv::Mat_<float>(3, 1) <<
+			-0.5f * (min_vertex.at<float>(0) + max_vertex.at<float>(0)),
+			-0.5f * (min_vertex.at<float>(1) + max_vertex.at<float>(1)),
+			-(max_vertex.at<float>(2) + distance));
+		cv::Mat background(size, size, CV_8UC3, cv::Scalar::all(128));
+
+		// Time each of the backends, the outputs are compared to the first (cpu)
+		std::vector<string> names = face_swap::RenderBackend::available();
+		std::vector<cv::Mat> outputs(names.size()), depths(names.size());
+		cout << "Image size: " << size << " X " << size << ", vertices: " << mesh.vertices.rows <<
+			", faces: " << mesh.faces.rows << ", antialias: " << antialias << endl;
+		cout << std::left << std::setw(12) << "backend" << std::setw(16) << "create [ms]" <<
+			std::setw(16) << "render [ms]" << std::setw(16) << "mean abs diff" << "mask diff" << endl;
+		bool passed = true;
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			int64 start = cv::getTickCount();
+			std::shared_ptr<face_swap::RenderBackend> backend = face_swap::RenderBackend::create(names[i]);
+			double create_ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+
+			face_swap::RenderContext ctx;
+			const face_swap::AntialiasMode aa_mode =
+				antialias ? face_swap::ANTIALIAS_COVERAGE : face_swap::ANTIALIAS_NONE;
+			runBackend(*backend, background, mesh, rvec, tvec, K, ctx, aa_mode, 1);	// Warm up
+			start = cv::getTickCount();
+			outputs[i] = runBackend(*backend, background, mesh, rvec, tvec, K, ctx, aa_mode, iterations);
+			double ms = (cv::getTickCount() - start) * 1000.0 / (cv::getTickFrequency() * iterations);
+			depths[i] = ctx.depthbuf < std::numeric_limits<float>::max();
+			if (i == 0 && cv::countNonZero(depths[0]) == 0)
+				throw runtime_error("The mesh is not visible in the rendered image!");
+
+			// Difference from the cpu backend where both rendered the mesh, and the
+			// fraction of the mesh's pixels that only one of them rendered
+			cv::Mat both = depths[i] & depths[0], either = depths[i] | depths[0];
+			double diff = cv::norm(outputs[i], outputs[0], cv::NORM_L1, both) /
+				(3.0 * std::max(cv::countNonZero(both), 1));
+			double mask_diff = (double)(cv::countNonZero(either) - cv::countNonZero(both)) /
+				std::max(cv::countNonZero(either), 1);
+			cout << std::left << std::setw(12) << names[i] << std::fixed << std::setprecision(2) <<
+				std::setw(16) << create_ms << std::setw(16) << ms << std::setw(16) << diff <<
+				std::setprecision(4) << mask_diff << endl;
+			if (diff > tolerance || mask_diff > mask_tolerance)
+			{
+				cerr << "The output of \"" << names[i] << "\" differs from the cpu backend's by more than the tolerance" << endl;
+				passed = false;
+			}
+		}
+
+		// Write the outputs side by side
+		if (!output_path.empty())
+		{
+			cv::Mat out;
+			cv::hconcat(outputs, out);
+			cv::imwrite(output_path, out);
+		}
+
+		if (!passed) return 1;
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
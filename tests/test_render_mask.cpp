@@ -0,0 +1,166 @@
+// std
+#include <iostream>
+#include <exception>
+#include <fstream>
+#include <limits>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_swap
+#include <face_swap/basel_3dmm.h>
+#include <face_swap/render_utilities.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+/** Unpack a bit-packed mask to a byte per pixel, 255 for set bits and 0 elsewhere.
+*/
+cv::Mat unpackMask(const cv::Mat& packed, const cv::Size& size)
+{
+	cv::Mat mask(size, CV_8U);
+	for (int r = 0; r < size.height; ++r)
+	{
+		const unsigned char* packed_data = packed.ptr<unsigned char>(r);
+		unsigned char* mask_data = mask.ptr<unsigned char>(r);
+		for (int c = 0; c < size.width; ++c)
+			mask_data[c] = ((packed_data[c >> 3] >> (c & 7)) & 1) ? 255 : 0;
+	}
+
+	return mask;
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string input_path, output_path, model_3dmm_h5_path;
+	string cfg_path;
+	unsigned int size;
+	float yaw, mask_tolerance;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("input,i", value<string>(&input_path)->required(), "texture image path")
+			("output,o", value<string>(&output_path), "output path for the coverage masks")
+			("model_3dmm_h5", value<string>(&model_3dmm_h5_path)->required(), "path to 3DMM file (.h5)")
+			("size,s", value<unsigned int>(&size)->default_value(512), "width and height of the rendered image")
+			("yaw,y", value<float>(&yaw)->default_value(0.5f), "yaw angle of the mesh in radians")
+			("mask_tolerance", value<float>(&mask_tolerance)->default_value(0.0f), "maximum fraction of the mesh's pixels covered by only one of the masks")
+			("cfg", value<string>(&cfg_path)->default_value("test_render_mask.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", 1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: test_render_mask [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_regular_file(input_path)) throw error("input must be a path to an image!");
+		if (!is_regular_file(model_3dmm_h5_path)) throw error("model_3dmm_h5 must be a path to a file!");
+		if (size == 0) throw error("size must be positive!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// The texture is mapped to the mean face by its atlas coordinates. It has
+		// no alpha channel, so renderMesh renders every covered pixel
+		cv::Mat tex = cv::imread(input_path);
+		if (tex.empty()) throw runtime_error("Failed to read image \"" + input_path + "\"!");
+		face_swap::Basel3DMM basel_3dmm = face_swap::Basel3DMM::load(model_3dmm_h5_path);
+		face_swap::Mesh mesh;
+		mesh.vertices = (basel_3dmm.shapeMU + basel_3dmm.exprMU).reshape(1, basel_3dmm.shapeMU.rows / 3);
+		mesh.faces = basel_3dmm.faces;
+		mesh.uv = basel_3dmm.atlas_uv;
+		mesh.tex = tex;
+
+		// Camera with the same conventions as the 3DMM fitting, the face covers half
+		// of the image's width and is turned by the yaw angle so part of it is hidden
+		cv::Mat min_vertex, max_vertex;
+		cv::reduce(mesh.vertices, min_vertex, 0, cv::REDUCE_MIN);
+		cv::reduce(mesh.vertices, max_vertex, 0, cv::REDUCE_MAX);
+		const float f = (float)size;
+		const float face_width = max_vertex.at<float>(0) - min_vertex.at<float>(0);
+		const float distance = 2.0f * face_width;
+		cv::Mat K = (cv::Mat_<float>(3, 3) << -f, 0, size / 2.0f, 0, f, size / 2.0f, 0, 0, 1);
+		cv::Mat rvec = (cv::Mat_<float>(3, 1) << 0, yaw, 0);
+		cv::Mat tvec = (cv::Mat_<float>(3, 1) <<
+			-0.5f * (min_vertex.at<float>(0) + max_vertex.at<float>(0)),
+			-0.5f * (min_vertex.at<float>(1) + max_vertex.at<float>(1)),
+			-(max_vertex.at<float>(2) + distance));
+
+		// Coverage from the depth of the full render
+		face_swap::RenderContext ctx;
+		cv::Mat img(size, size, CV_8UC3, cv::Scalar::all(128));
+		face_swap::renderMesh(img, mesh, rvec, tvec, K, ctx);
+		cv::Mat depth_mask = ctx.depthbuf < std::numeric_limits<float>::max();
+		const int depth_count = cv::countNonZero(depth_mask);
+		if (depth_count == 0) throw runtime_error("The mesh is not visible in the rendered image!");
+
+		// Coverage only masks, a byte per pixel and bit-packed
+		cv::Mat mask, packed;
+		face_swap::renderMeshMask(mask, img.size(), mesh, rvec, tvec, K, ctx);
+		face_swap::renderMeshMask(packed, img.size(), mesh, rvec, tvec, K, ctx, true);
+		cv::Mat unpacked = unpackMask(packed, img.size());
+
+		// Fraction of the mesh's pixels covered by only one of the masks
+		bool passed = true;
+		const struct { const char* name; const cv::Mat& mask; } masks[] = {
+			{ "8-bit", mask }, { "bit-packed", unpacked } };
+		for (const auto& m : masks)
+		{
+			cv::Mat either = m.mask | depth_mask;
+			const int diff_count = cv::countNonZero(m.mask != depth_mask);
+			const double diff = (double)diff_count / std::max(cv::countNonZero(either), 1);
+			cout << m.name << ": covered = " << cv::countNonZero(m.mask) << ", depth covered = " <<
+				depth_count << ", different = " << diff_count << " (" << diff << ")" << endl;
+			if (diff > mask_tolerance)
+			{
+				cerr << "The " << m.name << " coverage mask differs from the depth coverage by more than the tolerance" << endl;
+				passed = false;
+			}
+		}
+
+		// Write the depth coverage and the coverage masks side by side
+		if (!output_path.empty())
+		{
+			cv::Mat out;
+			cv::hconcat(std::vector<cv::Mat>{ depth_mask, mask, unpacked }, out);
+			cv::imwrite(output_path, out);
+		}
+
+		if (!passed) return 1;
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}